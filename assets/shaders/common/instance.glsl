@@ -0,0 +1,52 @@
+// Per-instance attributes of instanced models, in the layout selected by
+// DeferredRenderer::instanceLayout(). INSTANCE_MATRICES reads the model,
+// normal and model-view matrices computed on the CPU. INSTANCE_TRS reads a
+// translation, rotation and scale. Otherwise only the model matrix is read,
+// and the normal matrix is derived here.
+
+#if defined( INSTANCE_TRS )
+in vec4		vInstanceTranslationScale;	// translation, x scale
+in vec4		vInstanceRotation;			// unit quaternion
+in vec2		vInstanceScale;				// y and z scale
+#else
+in mat4		vInstanceModelMatrix;
+#endif
+#if defined( INSTANCE_MATRICES )
+in mat3		vInstanceNormalMatrix;
+in mat4		vInstanceModelViewMatrix;
+#endif
+
+mat4 getInstanceModelMatrix()
+{
+#if defined( INSTANCE_TRS )
+	vec4 q		= vInstanceRotation;
+	vec3 s		= vec3( vInstanceTranslationScale.w, vInstanceScale );
+	vec3 q2		= q.xyz * 2.0;
+	vec3 qq		= q.xyz * q2;
+	float xy	= q.x * q2.y;
+	float xz	= q.x * q2.z;
+	float yz	= q.y * q2.z;
+	vec3 w		= q.w * q2;
+	mat3 r		= mat3( 1.0 - qq.y - qq.z,	xy + w.z,			xz - w.y,
+						xy - w.z,			1.0 - qq.x - qq.z,	yz + w.x,
+						xz + w.y,			yz - w.x,			1.0 - qq.x - qq.y );
+	return mat4( vec4( r[ 0 ] * s.x, 0.0 ), vec4( r[ 1 ] * s.y, 0.0 ), vec4( r[ 2 ] * s.z, 0.0 ),
+				 vec4( vInstanceTranslationScale.xyz, 1.0 ) );
+#else
+	return vInstanceModelMatrix;
+#endif
+}
+
+// Transforms normals to view space. The cofactor matrix of the model matrix
+// is its inverse transpose scaled by the determinant, which normalizing the
+// normal cancels out apart from the sign.
+mat3 getInstanceNormalMatrix( mat4 viewMatrix, mat4 modelMatrix )
+{
+#if defined( INSTANCE_MATRICES )
+	return vInstanceNormalMatrix;
+#else
+	mat3 m		= mat3( modelMatrix );
+	mat3 c		= mat3( cross( m[ 1 ], m[ 2 ] ), cross( m[ 2 ], m[ 0 ] ), cross( m[ 0 ], m[ 1 ] ) );
+	return mat3( viewMatrix ) * ( c * sign( dot( m[ 0 ], c[ 0 ] ) ) );
+#endif
+}
@@ -1,6 +1,14 @@
-#if !defined ( NUM_LIGHTS )
-#define NUM_LIGHTS 1
-#endif
+// Lights are read from a texture buffer of RGBA32F texels rather than a
+// uniform block, so the number of lights is not baked into the program.
+// Each light occupies five texels, mirroring the layout of the Light class:
+//
+// 0 ambient
+// 1 diffuse
+// 2 specular
+// 3 position.xyz, intensity
+// 4 radius, volume, pad, pad
+
+const int kLightTexels = 5;
 
 struct Light
 {
@@ -11,12 +19,24 @@ struct Light
 	float	intensity;
 	float	radius;
 	float	volume;
-	uint	pad0;
-	uint	pad1;
 };
 
-layout (std140) uniform Lights
+uniform samplerBuffer	uBufferLights;
+uniform int				uNumLights;
+
+Light getLight( int i )
 {
-	Light uLights[ NUM_LIGHTS ];
-};
- 
\ No newline at end of file
+	int t			= i * kLightTexels;
+	vec4 t3			= texelFetch( uBufferLights, t + 3 );
+	vec4 t4			= texelFetch( uBufferLights, t + 4 );
+
+	Light light;
+	light.ambient	= texelFetch( uBufferLights, t );
+	light.diffuse	= texelFetch( uBufferLights, t + 1 );
+	light.specular	= texelFetch( uBufferLights, t + 2 );
+	light.position	= t3.xyz;
+	light.intensity	= t3.w;
+	light.radius	= t4.x;
+	light.volume	= t4.y;
+	return light;
+}
@@ -1,6 +1,15 @@
-#if !defined ( NUM_MATERIALS )
-#define NUM_MATERIALS 1
-#endif
+// Materials are read from a texture buffer of RGBA32F texels rather than a
+// uniform block, so the number of materials is not baked into the program.
+// Each material occupies five texels, mirroring the layout of the Material
+// class:
+//
+// 0 ambient
+// 1 diffuse
+// 2 emissive
+// 3 specular
+// 4 shininess, pad, pad, pad
+
+const int kMaterialTexels = 5;
 
 struct Material
 {
@@ -9,15 +18,22 @@ struct Material
 	vec4	emissive;
 	vec4	specular;
 	float	shininess;
-	uint	pad0;
-	uint	pad1;
-	uint	pad2;
 };
 
-layout (std140) uniform Materials
+uniform samplerBuffer	uBufferMaterials;
+uniform int				uNumMaterials;
+
+Material getMaterial( int i )
 {
-	Material uMaterials[ NUM_MATERIALS ];
-};
+	int t				= i * kMaterialTexels;
+
+	Material material;
+	material.ambient	= texelFetch( uBufferMaterials, t );
+	material.diffuse	= texelFetch( uBufferMaterials, t + 1 );
+	material.emissive	= texelFetch( uBufferMaterials, t + 2 );
+	material.specular	= texelFetch( uBufferMaterials, t + 3 );
+	material.shininess	= texelFetch( uBufferMaterials, t + 4 ).x;
+	return material;
+}
 
 uniform isampler2D uSamplerMaterial;
- 
\ No newline at end of file
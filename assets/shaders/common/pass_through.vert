@@ -8,7 +8,7 @@ in vec2			ciTexCoord0;
 #endif
 
 #if defined( INSTANCED_MODEL )
-in mat4			vInstanceModelMatrix;
+#include "instance.glsl"
 #endif
 
 void main( void )
@@ -19,7 +19,7 @@ void main( void )
 	mat4 m		= ciModelViewProjection;
 	vec4 p		= ciPosition;
 #if defined( INSTANCED_MODEL )
-	m			= m * vInstanceModelMatrix;
+	m			= m * getInstanceModelMatrix();
 #endif
 	gl_Position = m * p;
 }
@@ -0,0 +1,41 @@
+// Shades a G-buffer sample with one point light. Requires light.glsl and
+// material.glsl to be included first. Returns false if the sample is outside
+// of the light's volume.
+
+const float kScatter = 0.07;
+
+bool shadeLight( in Light light, in vec3 lightPosition, in vec4 position, in vec3 N, in vec4 albedo, in Material material, out vec4 color )
+{
+	vec3 L 				= lightPosition - position.xyz;
+	float d 			= length( L );
+	if ( d > light.volume ) {
+		return false;
+	}
+	L 					/= d;
+
+	vec3 V 				= normalize( -position.xyz );
+	vec3 H 				= normalize( L + V );
+	float NdotL 		= max( 0.0, dot( N, L ) );
+	float HdotN 		= max( 0.0, dot( H, N ) );
+	float Ks		 	= pow( HdotN, material.shininess );
+
+	vec4 Ia 			= light.ambient * material.ambient;
+	vec4 Id 			= NdotL * light.diffuse * albedo * material.diffuse;
+	vec4 Ie 			= material.emissive;
+	vec4 Is 			= Ks * light.specular * material.specular;
+	float att			= 1.0 / pow( ( d / ( 1.0 - pow( d / light.volume, 2.0 ) ) ) / light.volume + 1.0, 2.0 );
+
+	vec3 dir			= position.xyz;
+	float l				= length( dir );
+	dir					/= l;
+	vec3 q				= -L;
+	float b				= dot( dir, q );
+	float c				= dot( q, q );
+	float s				= 1.0f / sqrt( c - b * b );
+	s					= smoothstep( 0.005, 1.0, s * (atan( (s + b) * s) - atan( b * s ) ) );
+
+	color 				= ( ( Ia + att * ( Id + Is ) + Ie ) * light.intensity );
+	color.rgb			*= ( vec3( 1.0 - kScatter ) + vec3( 2.5 * light.diffuse.rgb * vec3( s )) * kScatter );
+	color.a				= 1.0;
+	return true;
+}
@@ -53,22 +53,22 @@ void main( void )
 		color 	= vec3( pow( texture( uSamplerDepth, vertex.uv ).r, uFar ) );
 		break;
 	case MODE_AMBIENT:
-		color	= uMaterials[ getId() ].ambient.rgb;
+		color	= getMaterial( getId() ).ambient.rgb;
 		break;
 	case MODE_DIFFUSE:
-		color	= uMaterials[ getId() ].diffuse.rgb;
+		color	= getMaterial( getId() ).diffuse.rgb;
 		break;
 	case MODE_EMISSIVE:
-		color	= uMaterials[ getId() ].emissive.rgb;
+		color	= getMaterial( getId() ).emissive.rgb;
 		break;
 	case MODE_SPECULAR:
-		color	= uMaterials[ getId() ].specular.rgb;
+		color	= getMaterial( getId() ).specular.rgb;
 		break;
 	case MODE_SHININESS:
-		color	= vec3( uMaterials[ getId() ].shininess ) / 128.0;
+		color	= vec3( getMaterial( getId() ).shininess ) / 128.0;
 		break;
 	case MODE_MATERIAL_ID:
-		color	= vec3( float( texture( uSamplerMaterial, vertex.uv ).r ) / float( NUM_MATERIALS ), 0.0, 0.0 );
+		color	= vec3( float( texture( uSamplerMaterial, vertex.uv ).r ) / float( uNumMaterials ), 0.0, 0.0 );
 		break;
 	case MODE_ACCUM:
 		color 	= texture( uSamplerAccum, vertex.uv ).rgb;
@@ -12,5 +12,5 @@ void main( void )
 	int id		= int( texture( uSamplerMaterial, uv ).r );
 	oColor		= texture( uSamplerAlbedo, uv );
 	oColor.a	= 0.5;
-	oColor		*= uMaterials[ id ].emissive;
+	oColor		*= getMaterial( id ).emissive;
 }
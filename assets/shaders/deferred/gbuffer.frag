@@ -1,6 +1,21 @@
+#if defined( MULTI_DRAW )
+flat in int vMaterialId;
+#define uMaterialId vMaterialId
+#else
 uniform int uMaterialId;
+#endif
 uniform sampler2D uTexture;
 uniform samplerCube uCubeMap;
+#if defined( TEXTURE_ARRAY )
+// Layer of uTextureArray to use instead of uTexture, or -1
+uniform sampler2DArray uTextureArray;
+#if defined( MULTI_DRAW )
+flat in int vTextureLayer;
+#define uTextureLayer vTextureLayer
+#else
+uniform int uTextureLayer;
+#endif
+#endif
 
 in Vertex
 {
@@ -27,7 +42,12 @@ void main( void )
     vec3 reflectedEyeWorldSpace = reflect( vertex.EyeDirWorldSpace, normalize( vertex.NormalWorldSpace ) );
     vec4 diffuseColor   = vec4( vertex.color, 1.0 );
     vec4 cubeMapColor   = texture( uCubeMap, reflectedEyeWorldSpace );
+#if defined( TEXTURE_ARRAY )
+    vec4 texColor       = uTextureLayer < 0 ? texture( uTexture, vertex.uv ) :
+                          texture( uTextureArray, vec3( vertex.uv, float( uTextureLayer ) ) );
+#else
     vec4 texColor       = texture( uTexture, vertex.uv );
+#endif
 
 
     oAlbedo     = mix( mix( diffuseColor, cubeMapColor, cubeMapColor.a ), texColor, texColor.a );
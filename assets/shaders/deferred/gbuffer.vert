@@ -1,13 +1,26 @@
 #if defined( INSTANCED_LIGHT_SOURCE )
 #include "../common/light.glsl"
 #endif
+#if defined( INSTANCED_MODEL )
+#include "../common/instance.glsl"
+#endif
 
 uniform mat4	ciModelViewProjection;
 #if !defined( INSTANCED_MODEL )
 uniform mat3	ciNormalMatrix;
 uniform mat4    ciModelViewMatrix;
 #endif
+#if defined( MULTI_DRAW )
+// Per-draw data of multi-draw indirect submission: the texture matrix's
+// columns, then material ID and texture layer. Instances carry the index of
+// their draw.
+uniform samplerBuffer uBufferDraws;
+in float		vInstanceDrawId;
+flat out int	vMaterialId;
+flat out int	vTextureLayer;
+#else
 uniform mat4    uTextureMatrix;
+#endif
 uniform mat4    ciViewMatrix;
 uniform mat4	ciViewMatrixInverse;
 
@@ -15,11 +28,6 @@ in vec4 	ciPosition;
 in vec3 	ciNormal;
 in vec4 	ciColor;
 in vec2     ciTexCoord0;
-#if defined( INSTANCED_MODEL )
-in mat3		vInstanceNormalMatrix;
-in mat4		vInstanceModelMatrix;
-in mat4		vInstanceModelViewMatrix;
-#endif
 
 out Vertex
 {
@@ -32,12 +40,24 @@ out Vertex
 
 void main( void )
 {
+#if defined( MULTI_DRAW )
+	int drawOffset		= int( vInstanceDrawId ) * 5;
+	mat4 uTextureMatrix	= mat4( texelFetch( uBufferDraws, drawOffset ),
+								texelFetch( uBufferDraws, drawOffset + 1 ),
+								texelFetch( uBufferDraws, drawOffset + 2 ),
+								texelFetch( uBufferDraws, drawOffset + 3 ) );
+	vec4 drawIds		= texelFetch( uBufferDraws, drawOffset + 4 );
+	vMaterialId			= int( drawIds.x );
+	vTextureLayer		= int( drawIds.y );
+#endif
+
 	vertex.color		= ciColor.rgb;
     vertex.uv           = (uTextureMatrix * vec4( ciTexCoord0, 0.0, 0.0 )).st;
 
 #if defined( INSTANCED_MODEL )
-	mat3 normalMatrix	= vInstanceNormalMatrix;
-    mat4 modelViewMatrix= vInstanceModelViewMatrix;
+	mat4 modelMatrix	= getInstanceModelMatrix();
+	mat3 normalMatrix	= getInstanceNormalMatrix( ciViewMatrix, modelMatrix );
+    mat4 modelViewMatrix= ciViewMatrix;
 #else
 	mat3 normalMatrix	= ciNormalMatrix;
     mat4 modelViewMatrix= ciModelViewMatrix;
@@ -50,7 +70,7 @@ void main( void )
 
 	vec4 p				= ciPosition;
 #if defined( INSTANCED_LIGHT_SOURCE )
-	Light light			= uLights[ gl_InstanceID ];
+	Light light			= getLight( gl_InstanceID );
 	p.xyz				*= light.radius;
 	p.xyz				+= light.position;
 	p.w					= 1.0;
@@ -58,7 +78,7 @@ void main( void )
 #endif
 	
 #if defined( INSTANCED_MODEL )
-	p					= vInstanceModelMatrix * p;
+	p					= modelMatrix * p;
 #endif
     
     vec4 positionViewSpace = modelViewMatrix * p;
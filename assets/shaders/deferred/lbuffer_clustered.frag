@@ -0,0 +1,52 @@
+#include "../common/unpack.glsl"
+#include "../common/offset.glsl"
+#include "../common/material.glsl"
+#include "../common/light.glsl"
+#include "../common/shade.glsl"
+
+uniform sampler2D		uSamplerAlbedo;
+uniform sampler2D		uSamplerNormal;
+uniform mat4			uViewMatrix;
+
+uniform isamplerBuffer	uBufferClusters;		// ( offset, count ) per cluster
+uniform isamplerBuffer	uBufferClusterLights;	// light indices
+uniform ivec3			uClusterGrid;			// tiles across, tiles down, depth slices
+uniform vec2			uClusterDepth;			// near clip, log( depth / near ) to slice factor
+
+layout (location = 0) out vec4 oColor;
+
+void main( void )
+{
+	vec2 uv				= calcTexCoordFromFrag( gl_FragCoord.xy );
+	vec4 position 		= unpackPosition( uv );
+
+	// Must match LightClusters::getCell()
+	float depth			= -position.z;
+	if ( depth < uClusterDepth.x ) {
+		discard;
+	}
+	ivec2 tile			= clamp( ivec2( floor( uv * vec2( uClusterGrid.xy ) ) ), ivec2( 0 ), uClusterGrid.xy - 1 );
+	int slice			= clamp( int( log( depth / uClusterDepth.x ) * uClusterDepth.y ), 0, uClusterGrid.z - 1 );
+	int cluster			= ( slice * uClusterGrid.y + tile.y ) * uClusterGrid.x + tile.x;
+
+	ivec2 range			= texelFetch( uBufferClusters, cluster ).rg;
+	if ( range.y == 0 ) {
+		discard;
+	}
+
+	vec4 albedo 		= texture( uSamplerAlbedo, uv );
+	int materialId		= int( texture( uSamplerMaterial, uv ).r );
+	Material material 	= getMaterial( materialId );
+	vec3 N 				= unpackNormal( texture( uSamplerNormal, uv ).rg );
+
+	oColor				= vec4( 0.0 );
+	for ( int i = 0; i < range.y; ++i ) {
+		Light light			= getLight( texelFetch( uBufferClusterLights, range.x + i ).r );
+		vec3 lightPosition	= ( uViewMatrix * vec4( light.position, 1.0 ) ).xyz;
+		vec4 color;
+		if ( shadeLight( light, lightPosition, position, N, albedo, material, color ) ) {
+			oColor.rgb		+= color.rgb;
+		}
+	}
+	oColor.a			= 1.0;
+}
@@ -1,15 +1,18 @@
 #include "../common/light.glsl"
 
-uniform mat4	ciModelViewProjection;
+uniform mat4			ciModelViewProjection;
 
-in vec4			ciPosition;
+// Indices of the lights which survived culling, one per instance
+uniform isamplerBuffer	uBufferLightIndices;
 
-flat out int	vInstanceId;
+in vec4					ciPosition;
+
+flat out int			vInstanceId;
 
 void main( void ) 
 {
-	vInstanceId	= gl_InstanceID;
-	Light light = uLights[ vInstanceId ];
+	vInstanceId	= texelFetch( uBufferLightIndices, gl_InstanceID ).r;
+	Light light = getLight( vInstanceId );
 	
 	vec3 p		= ciPosition.xyz * light.volume + light.position;
 	
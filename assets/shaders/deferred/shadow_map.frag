@@ -1,7 +1,6 @@
-layout (location = 0) out vec4 oColor;
+// The shadow map has no color attachment. Depth is written by the
+// rasterizer, so there is nothing to output here.
 
 void main( void )
 {
-	oColor = vec4( gl_FragCoord.zzz, 1.0 );
 }
- 
\ No newline at end of file
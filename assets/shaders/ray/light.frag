@@ -4,7 +4,7 @@ layout (location = 0) out vec4 oColor;
 
 void main ( void )
 {
-	Light light			= uLights[ vInstanceId ];
+	Light light			= getLight( vInstanceId );
 
 	oColor = light.diffuse;
 }
\ No newline at end of file
@@ -9,7 +9,7 @@ flat out int	vInstanceId;
 void main( void ) 
 {
 	vInstanceId	= gl_InstanceID;
-	Light light = uLights[ vInstanceId ];
+	Light light = getLight( vInstanceId );
 	
 	vec3 p		= ciPosition.xyz * light.volume + light.position;
 	
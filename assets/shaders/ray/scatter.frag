@@ -33,8 +33,8 @@ void main( void )
 	oColor			= vec4( 0.0 );
 	vec2 uv			= calcTexCoordFromUv( vertex.uv );
 
-	for ( int li = 0; li < kMaxLights && li < NUM_LIGHTS; ++li ) {
-		Light light = uLights[ li ];
+	for ( int li = 0; li < kMaxLights && li < uNumLights; ++li ) {
+		Light light = getLight( li );
 
 		vec2 p		= lightPosition( light );
 		vec2 d		= uv - p;
@@ -1,82 +1,327 @@
 #pragma once
 
 #include "cinder/gl/gl.h"
+#include "cinder/gl/BufferTexture.h"
+#include "cinder/CinderAssert.h"
 
 #include "Light.hpp"
+#include "LightClusters.hpp"
 #include "Material.hpp"
 #include "Model.hpp"
+#include "PassProfiler.hpp"
+#include "ProgramCache.hpp"
+#include "ProgramQueue.hpp"
+#include "RenderGraph.hpp"
+#include "TextureArrays.hpp"
+#include "ViewFrustum.hpp"
 
 class DeferredRenderer;
 
 typedef int32_t scene_object_id;
+
+// Identifies an object independently of where it currently lives in its
+// container. The generation is bumped whenever a slot is freed, so handles to
+// removed objects can be detected instead of silently aliasing a newer object.
+struct scene_object_handle {
+    uint32_t            slot = UINT32_MAX;
+    uint32_t            generation = 0;
+};
+
+inline bool operator ==( const scene_object_handle &a, const scene_object_handle &b ) { return a.slot == b.slot && a.generation == b.generation; }
+
+// Renderer metadata about how to handle an object. Flags are stored in their
+// own packed array beside the objects, so loops which only test flags don't
+// have to touch the (much larger) object data.
+struct scene_object_flags {
+    bool                visible = true;
+};
+
+// Contiguous storage for one kind of scene object. Elements stay packed so the
+// whole container can back a GPU buffer, and writes are tracked per element so
+// that only the ranges which actually changed need to be re-uploaded.
+//
+// Objects are addressed through a slot map: handles index a table of slots
+// which in turn point at the packed element. Removal moves the last element
+// into the hole (swap-and-pop) and patches its slot, so the packed array never
+// contains dead objects and handles to moved objects remain valid.
+template< class object_t >
+class scene_object_container {
+public:
+    typedef typename std::vector< object_t >::iterator          iterator;
+    typedef typename std::vector< object_t >::const_iterator    const_iterator;
+    typedef std::pair< size_t, size_t >                         range_t; // [first, second)
+
+    scene_object_handle insert( const object_t &o )
+    {
+        scene_object_handle h;
+        if ( mFreeSlots.empty() ) {
+            h.slot = (uint32_t)mSlots.size();
+            mSlots.push_back( slot_t() );
+        } else {
+            h.slot = mFreeSlots.back();
+            mFreeSlots.pop_back();
+        }
+        h.generation = mSlots[ h.slot ].generation;
+        mSlots[ h.slot ].index = (uint32_t)mData.size();
+
+        mData.push_back( o );
+        mFlags.push_back( scene_object_flags() );
+        mIndexToSlot.push_back( h.slot );
+        mDirty.push_back( true );
+        mAnyDirty = true;
+
+        return h;
+    }
+
+    // Removes the object referred to by h, moving the last object into its
+    // place. Returns false if h is stale.
+    bool erase( const scene_object_handle &h )
+    {
+        if ( ! contains( h ) ) return false;
+
+        const uint32_t i    = mSlots[ h.slot ].index;
+        const uint32_t last = (uint32_t)mData.size() - 1;
+        if ( i != last ) {
+            mData[ i ]                          = std::move( mData[ last ] );
+            mFlags[ i ]                         = mFlags[ last ];
+            mIndexToSlot[ i ]                   = mIndexToSlot[ last ];
+            mSlots[ mIndexToSlot[ i ] ].index   = i;
+            markDirty( i );
+        }
+        mData.pop_back();
+        mFlags.pop_back();
+        mIndexToSlot.pop_back();
+        mDirty.pop_back();
+
+        mSlots[ h.slot ].index = kInvalidIndex;
+        ++mSlots[ h.slot ].generation;
+        mFreeSlots.push_back( h.slot );
+
+        return true;
+    }
+
+    bool                contains( const scene_object_handle &h ) const
+    {
+        return h.slot < mSlots.size() && mSlots[ h.slot ].generation == h.generation && mSlots[ h.slot ].index != kInvalidIndex;
+    }
+
+    // Current position of the object in the packed array, or -1 if h is stale.
+    // This is the index shaders see, and it may change when other objects are
+    // removed.
+    scene_object_id     indexOf( const scene_object_handle &h ) const { return contains( h ) ? (scene_object_id)mSlots[ h.slot ].index : -1; }
+    // As indexOf(), without validating h
+    size_t              indexOfUnchecked( const scene_object_handle &h ) const { return mSlots[ h.slot ].index; }
+
+    size_t              size() const { return mData.size(); }
+    bool                empty() const { return mData.empty(); }
+    object_t*           data() { return mData.data(); }
+    const object_t*     data() const { return mData.data(); }
+
+    object_t&           at( size_t i ) { return mData.at( i ); }
+    const object_t&     at( size_t i ) const { return mData.at( i ); }
+    object_t&           operator[]( size_t i ) { return mData[ i ]; }
+    const object_t&     operator[]( size_t i ) const { return mData[ i ]; }
+    object_t&           back() { return mData.back(); }
+
+    scene_object_flags&         flags( size_t i ) { return mFlags[ i ]; }
+    const scene_object_flags&   flags( size_t i ) const { return mFlags[ i ]; }
+
+    iterator            begin() { return mData.begin(); }
+    iterator            end() { return mData.end(); }
+    const_iterator      begin() const { return mData.begin(); }
+    const_iterator      end() const { return mData.end(); }
+
+    void                markDirty( size_t i ) { mDirty[ i ] = true; mAnyDirty = true; }
+    void                markAllDirty() { mDirty.assign( mData.size(), true ); mAnyDirty = ! mData.empty(); }
+    void                clearDirty() { mDirty.assign( mData.size(), false ); mAnyDirty = false; }
+    bool                isDirty() const { return mAnyDirty; }
+
+    // Returns the modified elements as sorted, non-overlapping ranges. Runs
+    // separated by at most `gap` clean elements are merged, trading a few
+    // redundant bytes for fewer buffer updates.
+    std::vector< range_t > dirtyRanges( size_t gap = 0 ) const
+    {
+        std::vector< range_t > ranges;
+        if ( ! mAnyDirty ) return ranges;
+
+        for ( size_t i = 0; i < mDirty.size(); ++i ) {
+            if ( ! mDirty[ i ] ) continue;
+            if ( ! ranges.empty() && i - ranges.back().second <= gap ) {
+                ranges.back().second = i + 1;
+            } else {
+                ranges.emplace_back( i, i + 1 );
+            }
+        }
+        return ranges;
+    }
+
+private:
+    static const uint32_t   kInvalidIndex = UINT32_MAX;
+
+    struct slot_t {
+        uint32_t            index = kInvalidIndex;
+        uint32_t            generation = 0;
+    };
+
+    std::vector< object_t > mData;
+    std::vector< scene_object_flags > mFlags;
+    std::vector< uint32_t > mIndexToSlot;
+    std::vector< bool >     mDirty;
+    bool                    mAnyDirty = false;
+
+    std::vector< slot_t >   mSlots;
+    std::vector< uint32_t > mFreeSlots;
+};
+
+// GPU mirror of a scene_object_container, read by shaders through a texture
+// buffer. Storage grows in power-of-two steps and shaders are given the live
+// object count as a uniform, so adding objects only ever reallocates the
+// buffer and never requires recompiling programs.
 template< class object_t >
-using scene_object_container = std::vector< object_t >;
+class SceneObjectBuffer {
+public:
+    static_assert( sizeof( object_t ) % sizeof( ci::vec4 ) == 0, "objects must be a whole number of RGBA32F texels" );
+
+    // Uploads modified objects, growing storage first if the container has
+    // outgrown it. Returns the number of bytes written.
+    size_t update( scene_object_container< object_t > &container )
+    {
+        size_t bytes = 0;
+
+        if ( ! mBuffer || container.size() > mCapacity ) {
+            size_t capacity = mCapacity;
+            if ( capacity == 0 ) capacity = kMinCapacity;
+            while ( capacity < container.size() ) capacity *= 2;
+            mCapacity = capacity;
+
+            // Reallocating keeps the buffer's name, so the texture bound to it
+            // stays valid and only the contents need to be re-uploaded.
+            if ( ! mBuffer ) {
+                mBuffer = ci::gl::BufferObj::create( GL_TEXTURE_BUFFER, mCapacity * sizeof( object_t ), nullptr, GL_DYNAMIC_DRAW );
+                mTexture = ci::gl::BufferTexture::create( mBuffer, GL_RGBA32F );
+            } else {
+                mBuffer->bufferData( mCapacity * sizeof( object_t ), nullptr, GL_DYNAMIC_DRAW );
+            }
+            container.markAllDirty();
+        }
+
+        for ( const auto &range : container.dirtyRanges( kRangeGap ) ) {
+            const size_t offset = range.first * sizeof( object_t );
+            const size_t size   = ( range.second - range.first ) * sizeof( object_t );
+            mBuffer->bufferSubData( offset, size, container.data() + range.first );
+            bytes += size;
+        }
+        container.clearDirty();
+
+        return bytes;
+    }
+
+    void                            bindTexture( uint8_t unit ) const { if ( mTexture ) mTexture->bindTexture( unit ); }
+    void                            unbindTexture( uint8_t unit ) const { if ( mTexture ) mTexture->unbindTexture( unit ); }
+
+    size_t                          getCapacity() const { return mCapacity; }
+    const ci::gl::BufferObjRef&     getBuffer() const { return mBuffer; }
+    const ci::gl::BufferTextureRef& getTexture() const { return mTexture; }
+
+private:
+    static const size_t             kMinCapacity = 64;
+    // Dirty runs separated by this many clean objects or fewer are uploaded as one range
+    static const size_t             kRangeGap = 2;
+
+    ci::gl::BufferObjRef            mBuffer;
+    ci::gl::BufferTextureRef        mTexture;
+    size_t                          mCapacity = 0;
+};
 
 // A SceneObject is like a fancy pointer that encapsulates the raw buffer data
-// (object_t) and renderer metadata about how to handle the object.
+// (object_t) and renderer metadata about how to handle the object. It stays
+// valid while other objects are added or removed, and evaluates to false once
+// its own object has been removed from the scene. Dereferencing is unchecked
+// unless asserts are enabled, so test stale handles with operator bool.
 template< class object_t >
 class SceneObject {
 public:
     SceneObject() {}
-    SceneObject( scene_object_container< object_t >* container, scene_object_id id ) : mContainerPtr( container ), mId( id ), mMetadata( new metadata ) {}
+    SceneObject( scene_object_container< object_t >* container, const scene_object_handle &handle ) : mContainerPtr( container ), mHandle( handle ) {}
 
-
-    object_t&   operator ()() const { return mContainerPtr->at( mId ); }
+    // Non-const access assumes the object is about to be modified and flags
+    // it for upload. Use get() for read-only access.
+    object_t&   operator ()() const { const size_t i = index(); mContainerPtr->markDirty( i ); return ( *mContainerPtr )[ i ]; }
     object_t*   operator ->() const { return &(*this)(); }
 	object_t&	operator *() const { return ( *this )( ); }
-                operator bool() const { return mContainerPtr != nullptr && mId != -1; }
-                operator scene_object_id() const { return mId; }
+                operator bool() const { return mContainerPtr != nullptr && mContainerPtr->contains( mHandle ); }
+                operator scene_object_id() const { return getId(); }
+
+	const object_t&		get() const { return ( *mContainerPtr )[ index() ]; }
+	// Mutable access which doesn't flag the object, for the renderer's own
+	// bookkeeping. Changes made through it may not be uploaded.
+	object_t&			getUntracked() const { return ( *mContainerPtr )[ index() ]; }
 
-	bool				isValid() { return mContainerPtr != nullptr;  }
-    scene_object_id     getId() const { return mId; }
-    bool                isVisible() const { return mMetadata->visible; }
-    bool&               visible() { return mMetadata->visible; }
+	bool				isValid() const { return (bool)*this; }
+    // The object's current index in its container's buffer, or -1 if it has
+    // been removed. Removing other objects may change it.
+    scene_object_id     getId() const { return mContainerPtr ? mContainerPtr->indexOf( mHandle ) : -1; }
+    const scene_object_handle& getHandle() const { return mHandle; }
+    bool                isVisible() const { return mContainerPtr->flags( index() ).visible; }
+    bool&               visible() { return mContainerPtr->flags( index() ).visible; }
+
+    bool                operator ==( const SceneObject &rhs ) const { return mContainerPtr == rhs.mContainerPtr && mHandle.slot == rhs.mHandle.slot && mHandle.generation == rhs.mHandle.generation; }
+    bool                operator !=( const SceneObject &rhs ) const { return ! ( *this == rhs ); }
 
 private:
+    friend class Scene;
+
     // Pointers and iterators to vector elements are not stable when the vector
-    // is resized, but we need vector's element contiguity for creating UBOs.
-    // So we hold a pointer to the container itself, and the index of the
-    // element, both of which are stable across reallocations.
+    // is resized, but we need vector's element contiguity for creating buffers.
+    // So we hold a pointer to the container itself, and a handle which the
+    // container resolves to the element's current index.
     scene_object_container< object_t >* mContainerPtr = nullptr;
-    scene_object_id                     mId = -1;
-
-    struct metadata {
-        bool                            visible = true;
-    };
-
-    std::shared_ptr< metadata >         mMetadata = nullptr;
+    scene_object_handle                 mHandle;
 
+    size_t                              index() const
+    {
+        CI_ASSERT_MSG( mContainerPtr && mContainerPtr->contains( mHandle ), "SceneObject refers to a removed object" );
+        return mContainerPtr->indexOfUnchecked( mHandle );
+    }
 };
 
 
+// Iterator-style write access to a model's instances. Instances live in a
+// CPU-side array which the renderer culls and uploads in draw(), so writing
+// them never waits on the GPU.
 class ScopedInstancedModelMap {
 public:
+    // access is deprecated and ignored; instances are no longer mapped from
+    // a GL buffer, so reads and writes are always allowed
     ScopedInstancedModelMap( SceneObject< InstancedModel > &model, GLenum access = GL_READ_WRITE ) :
     mModel( model ),
-    mVboPtr( (Model*)mModel->getVbo()->map( access ) ),
-	mVboEndPtr( mVboPtr + size() )
+    mPtr( mModel->data() ),
+	mBeginPtr( mPtr ),
+	mEndPtr( mPtr + size() )
     { }
-
-    ScopedInstancedModelMap( const ScopedInstancedModelMap& ) = delete;
-    ScopedInstancedModelMap& operator=( const ScopedInstancedModelMap& ) = delete;
-
+    // Marks the instances walked over, so modified static ones are uploaded
     ~ScopedInstancedModelMap()
     {
-        mModel->getVbo()->unmap();
+        const size_t walked = mPtr - mBeginPtr + ( isValid() ? 1 : 0 );
+        if ( mModel && walked > 0 ) mModel->markDirty( 0, walked );
     }
 
-	Model*	operator*() const { return mVboPtr; }
-    Model*	operator->() const { return mVboPtr; }
-    Model*	operator++() { return ++mVboPtr; }
-    Model*	operator++(int) { return mVboPtr++; }
+    ScopedInstancedModelMap( const ScopedInstancedModelMap& ) = delete;
+    ScopedInstancedModelMap& operator=( const ScopedInstancedModelMap& ) = delete;
 
-	size_t	size() const { return mModel->size(); }
-	bool	isValid() const { return mVboPtr < mVboEndPtr; }
+	Model*	operator*() const { return mPtr; }
+    Model*	operator->() const { return mPtr; }
+    Model*	operator++() { return ++mPtr; }
+    Model*	operator++(int) { return mPtr++; }
+
+	size_t	size() const { return mModel.get().size(); }
+	bool	isValid() const { return mPtr < mEndPtr; }
 
 private:
 	SceneObject< InstancedModel >&  mModel;
-	Model*                          mVboPtr;
-	const Model*					mVboEndPtr;
+	Model*                          mPtr;
+	const Model*					mBeginPtr;
+	const Model*					mEndPtr;
 };
 
 template< class ubo_t >
@@ -129,14 +374,29 @@ public:
     SceneObject< Material >         add( const Material &material );
     SceneObject< InstancedModel >   add( const InstancedModel &models );
 
+    // Removing an object moves the last object of the same kind into its
+    // slot, so the cost of uploading and drawing stays proportional to the
+    // live objects. Handles to the removed object become invalid; handles to
+    // the moved object stay valid. Returns false for stale handles, and for
+    // materials which are still used by a model or belong to the renderer.
+    // Removing either light of a pair added with castsRays removes both.
+    bool                            remove( const SceneObject< Light > &light );
+    bool                            remove( const SceneObject< Material > &material );
+    bool                            remove( const SceneObject< InstancedModel > &models );
+
 
     ci::CameraPersp                 getCamera() const { return mCamera; };
     ci::CameraPersp&                getCamera() { return mCamera; };
     void                            setCamera( const ci::CameraPersp &cam ) { mCamera = cam; }
 
-	ci::gl::UboRef					getUboLight() { return mUboLight; }
-	ci::gl::UboRef					getUboRayLight() { return mUboRayLight; }
-	ci::gl::UboRef					getUboMaterial() { return mUboMaterial; }
+	const SceneObjectBuffer< Light >&		getLightBuffer() const { return mLightBuffer; }
+	const SceneObjectBuffer< Light >&		getRayLightBuffer() const { return mRayLightBuffer; }
+	const SceneObjectBuffer< Material >&	getMaterialBuffer() const { return mMaterialBuffer; }
+
+	// Images packed here are assigned to models with
+	// InstancedModel::setTextureLayer()
+	TextureArrays&							getTextureArrays() { return mTextureArrays; }
+	const TextureArrays&					getTextureArrays() const { return mTextureArrays; }
 
 private:
 	scene_object_container< Light >             mLightData;
@@ -145,12 +405,16 @@ private:
     scene_object_container< InstancedModel >    mInstancedModelData;
 
     std::vector< SceneObject< InstancedModel > > mInstancedModels;
+	std::vector< std::pair< scene_object_handle, scene_object_handle > > mRayLightTwins; // ( light, ray light )
+	scene_object_handle							mRendererMaterial;	// Can't be removed
 
     ci::CameraPersp                             mCamera;
 
-	ci::gl::UboRef								mUboLight;
-	ci::gl::UboRef								mUboRayLight;
-	ci::gl::UboRef								mUboMaterial;
+	SceneObjectBuffer< Light >					mLightBuffer;
+	SceneObjectBuffer< Light >					mRayLightBuffer;
+	SceneObjectBuffer< Material >				mMaterialBuffer;
+
+	TextureArrays								mTextureArrays;
 };
 
 
@@ -158,6 +422,7 @@ class DeferredRenderer
 {
 public:
     DeferredRenderer();
+    ~DeferredRenderer();
 	DeferredRenderer( DeferredRenderer const& ) = delete;
 	DeferredRenderer& operator=( DeferredRenderer const& ) = delete;
 
@@ -171,58 +436,185 @@ public:
     Scene&                      scene() { return mScene; };
     const Scene&                scene() const { return mScene; };
 
+    // Linked programs are kept in the temporary directory by default. Set
+    // the directory before createBatches(), or clear it to always compile.
+    ProgramCache&               programCache() { return mProgramCache; }
+    // False while programs of enabled effects are still being built, with
+    // asynchronous compilation. Until then, draw() skips those effects.
+    bool                        isPipelineComplete() const;
+    size_t                      getNumPendingPrograms() const { return mProgramQueue ? mProgramQueue->getNumPending() : 0; }
+    // Transient render targets of draw(). Its byte counts report how much
+    // memory they take, and the most they have taken at once.
+    RenderTargetPool&           renderTargetPool() { return mGraph.getPool(); }
+
 
     ci::CameraPersp&            shadowCamera() { return mShadowCamera; }
     const ci::CameraPersp&      shadowCamera() const { return mShadowCamera; }
 
+    // Bytes written to scene buffers by the last call to update()
+    size_t                      getUploadedBytes() const { return mUploadedBytes; }
+    // Bytes of instance data written, and instances drawn to the G-buffer, by
+    // the last call to draw()
+    size_t                      getUploadedInstanceBytes() const { return mUploadedInstanceBytes; }
+    size_t                      getDrawnInstanceCount() const { return mDrawnInstanceCount; }
+
 	enum : int32_t
 	{
 		Ao_None,
 		Ao_Hbao,
 		Ao_Sao
 	} typedef Ao;
+
+	// Per-instance data uploaded for instanced models. Matrices uploads each
+	// Model as-is, including the normal and model-view matrices set on the
+	// CPU. ModelMatrix uploads only the model matrix (64 bytes per instance),
+	// and Trs a translation, rotation and scale decomposed from it (40 bytes).
+	// Both derive the rest in the vertex shader, so camera motion costs
+	// nothing per instance. Matrices is the default, as custom model shaders
+	// set with setShader() read the normal and model-view matrices. Opt in
+	// to the others only once those shaders read the attributes declared in
+	// common/instance.glsl.
+	enum : int32_t
+	{
+		InstanceLayout_Matrices,
+		InstanceLayout_ModelMatrix,
+		InstanceLayout_Trs
+	} typedef InstanceLayout;
+
+	// Light volumes draw one instanced cube per light. Clustered lighting
+	// draws a single full-screen pass which reads per-cluster light lists.
+	enum : int32_t
+	{
+		Lighting_Volumes,
+		Lighting_Clustered
+	} typedef Lighting;
 private:
     Scene                       mScene;
+    ProgramCache                mProgramCache;
+    std::unique_ptr< ProgramQueue >	mProgramQueue;
+    ci::gl::GlslProgRef         loadGlslProg( const ci::gl::GlslProg::Format &format );
+    void                        queueGlslProg( const ci::gl::GlslProg::Format &format, const ProgramQueue::Callback &onReady );
 
     ci::CameraPersp				mShadowCamera;
 
 
-    ci::gl::FboRef				mFboAo;
     ci::gl::FboRef				mFboAccum;
-    ci::gl::FboRef				mFboCsz;
-    ci::gl::FboRef				mFboGBuffer;
-    ci::gl::FboRef				mFboPingPong;
-    ci::gl::FboRef				mFboRayColor;
-    ci::gl::FboRef				mFboRayDepth;
     ci::gl::FboRef				mFboShadowMap;
 
-    ci::gl::Texture2dRef		mTextureFboAo[ 2 ];
-    ci::gl::Texture2dRef		mTextureFboAccum[ 3 ];
-    ci::gl::Texture2dRef		mTextureFboGBuffer[ 3 ];
-    ci::gl::Texture2dRef		mTextureFboPingPong[ 2 ];
-    ci::gl::Texture2dRef		mTextureFboRayColor[ 2 ];
+    // Passes of a frame, and the transient targets they draw into
+    RenderGraph					mGraph;
+    ci::ivec2					mSizeAccum;
+    ci::ivec2					mSizeAo;
+    ci::ivec2					mSizeColor;
+    ci::ivec2					mSizeGBuffer;
+    ci::ivec2					mSizeRay;
 
 
     ci::gl::BatchRef			mBatchDebugRect;
     ci::gl::BatchRef			mBatchEmissiveRect;
     ci::gl::BatchRef			mBatchGBufferLightSourceSphere;
+    ci::gl::BatchRef			mBatchLBufferClusteredRect;
     ci::gl::BatchRef			mBatchLBufferLightCube;
     ci::gl::BatchRef			mBatchLBufferShadowRect;
+    // Each instanced model has one instance buffer for both the G-buffer and
+    // shadow passes. The passes are culled against different cameras, so
+    // each fills its own section of capacity instances and draws through a
+    // batch whose attributes point into it. The buffer follows the model's
+    // capacity, so batches survive instances being added and removed, and
+    // draws use the live count. When streaming, the buffer holds
+    // kNumInstanceRegions regions of both sections, one per frame in flight,
+    // and each pass's batch points at this frame's.
+    //
+    // A model's static instances are packed in instance order into a second
+    // buffer which both passes draw from. Only dirty ranges are uploaded, and
+    // the whole group is culled against its combined bounds.
+    struct StaticInstances {
+        ci::gl::VboRef                vbo;
+        size_t                        capacity = 0;
+        GLsizei                       count = 0;
+        uint32_t                      version = UINT32_MAX; // Of the model's static set when last packed
+        ci::Sphere                    bounds;
+    };
+    struct InstancedModelPass {
+        std::vector< ci::gl::BatchRef > batches; // One per region
+        ci::gl::BatchRef              batch;
+        ci::gl::BatchRef              staticBatch;
+        GLsizei                       count = 0;
+        GLsizei                       staticCount = 0;
+    };
     struct InstancedModelBatch {
         SceneObject< InstancedModel > obj;
-        ci::gl::BatchRef              batch;
+        ci::gl::VboRef                vbo;
+        size_t                        capacity = 0;
+        bool                          streaming = false;
+        uint8_t*                      mapped = nullptr; // Persistent mapping, if any
+        InstancedModelPass            gBuffer;
+        InstancedModelPass            shadowMap;        // Depth only
+        StaticInstances               statics;
+        // The model's shader and whether its textures were blank when the
+        // batch was built. Batches are rebuilt when either changes.
+        ci::gl::GlslProgRef           shader;
+        bool                          blankTextures = false;
+        // Drawn by the G-buffer's multi-draw, from the shared geometry below
+        bool                          indirect = false;
+        GLuint                        firstIndex = 0;
+        GLuint                        indexCount = 0;
+        GLint                         baseVertex = 0;
+    };
+    std::vector< InstancedModelBatch > mInstancedModelBatches;
+
+    // Multi-draw indirect G-buffer path. Models without their own shader or
+    // textures have their meshes packed into shared vertex and index buffers.
+    // Their visible instances are gathered into one instance buffer each
+    // frame, each instance tagged with the index of its draw, and the pass is
+    // submitted with a single glMultiDrawElementsIndirect().
+    struct DrawElementsIndirectCommand {
+        GLuint                        count;
+        GLuint                        instanceCount;
+        GLuint                        firstIndex;
+        GLint                         baseVertex;
+        GLuint                        baseInstance;
     };
-    std::vector< InstancedModelBatch > mBatchGBuffers;
+    // Static instances are copied from their model's buffer, behind all
+    // dynamic instances, once the number of those is known
+    struct IndirectStaticCopy {
+        ci::gl::VboRef                vbo;
+        size_t                        command;
+        GLuint                        drawId;
+        GLuint                        first;            // Placed by uploadIndirect()
+        GLuint                        count;
+    };
+    ci::gl::BatchRef                  mBatchGBufferIndirect;
+    ci::gl::VboRef                    mVboIndirectInstances;
+    ci::gl::VboRef                    mVboIndirectDrawIds;
+    size_t                            mIndirectCapacity = 0;
+    ci::gl::BufferObjRef              mBufferIndirectCommands;
+    ci::gl::BufferObjRef              mBufferIndirectDraws;
+    ci::gl::BufferTextureRef          mTextureIndirectDraws;
+    ci::gl::Texture2dRef              mTextureIndirect;
+    ci::gl::TextureCubeMapRef         mTextureCubeMapIndirect;
+    std::vector< DrawElementsIndirectCommand > mIndirectCommands;
+    std::vector< ci::vec4 >           mIndirectDraws;
+    std::vector< float >              mIndirectDrawIds;
+    std::vector< uint8_t >            mIndirectInstances;
+    std::vector< IndirectStaticCopy > mIndirectStaticCopies;
+    // Commands are sorted by texture array, and each run drawn with that
+    // array bound
+    struct IndirectRange {
+        int32_t                       array;
+        size_t                        first;
+        GLsizei                       count;
+    };
+    std::vector< int32_t >            mIndirectCommandArrays;
+    std::vector< IndirectRange >      mIndirectRanges;
 
 public:
 
-	std::vector< InstancedModelBatch >& gBufferBatches() { return mBatchGBuffers; }
+	std::vector< InstancedModelBatch >& instancedModelBatches() { return mInstancedModelBatches; }
 	ci::gl::FboRef				getFboShadowMap() { return mFboShadowMap; }
 
 private:
 
-    std::vector< InstancedModelBatch > mBatchShadowMaps;
-
     ci::gl::BatchRef			mBatchAoCompositeRect;
     ci::gl::BatchRef			mBatchHbaoAoRect;
     ci::gl::BatchRef			mBatchHbaoBlurRect;
@@ -248,18 +640,99 @@ private:
     ci::gl::BatchRef			mBatchStockTextureRect;
 	ci::gl::BatchRef			mBatchStockColorSphere;
 
+	// Optional passes. Their programs are built when the effect is first
+	// enabled, and their FBOs are only allocated by resize() while it is.
+	enum : int32_t
+	{
+		Effect_AoComposite,
+		Effect_Hbao,
+		Effect_Sao,
+		Effect_Bloom,
+		Effect_Color,
+		Effect_Debug,
+		Effect_DoF,
+		Effect_Fog,
+		Effect_Fxaa,
+		Effect_Ray,
+		Effect_Count
+	} typedef Effect;
+
+	struct EffectProgram
+	{
+		ci::gl::GlslProg::Format	format;
+		ci::gl::VboMeshRef			mesh;
+		ci::gl::BatchRef*			batch = nullptr;
+	};
+
+	struct EffectPrograms
+	{
+		std::vector< EffectProgram >	programs;
+		bool						requested	= false;
+		bool						ready		= false;
+	};
+
+	EffectPrograms				mEffects[ Effect_Count ];
+	bool						isEffectEnabled( Effect effect ) const;
+	bool						isEffectReady( Effect effect ) const { return mEffects[ effect ].ready; }
+	// Requests programs of newly enabled effects, and releases those of
+	// disabled ones if asked to. Returns true if any effect became ready,
+	// in which case uniforms need to be set.
+	bool						updateEffects();
 
     void						setUniforms( const ci::ivec2 &windowSize );
+    void						createInstanceBatches();
+    // Sources of the instanced G-buffer and shadow map programs, loaded
+    // once and given defines for the instance layout when batches are made
+    ci::gl::GlslProg::Format	mFormatGBufferInstanced;
+    ci::gl::GlslProg::Format	mFormatShadowMapInstanced;
+    void						removeStaleBatches();
+    // Culls and uploads b's dynamic instances for the G-buffer (section 0)
+    // or shadow map (section 1)
+    void						uploadInstances( InstancedModelBatch &b, size_t section, const ViewFrustum &frustum );
+    void						uploadVisibleLights( const ViewFrustum &frustum );
+    void						reserveInstances( InstancedModelBatch &b, size_t capacity );
+    void						uploadStaticInstances( InstancedModelBatch &b );
+    void						createIndirectBatch( const ci::gl::GlslProg::Format &format, const ci::gl::Batch::AttributeMapping &mapping );
+    void						appendIndirect( const InstancedModelBatch &b, const Model* models, size_t count );
+    void						uploadIndirect();
+    void						waitForInstanceRegion();
+
+    std::vector< Model >		mCulledModels;
+    std::vector< uint8_t >		mPackedInstances;
+    // Fence per streaming region, signaled once the GPU is done with the
+    // frame which last wrote it
+    static const size_t			kNumInstanceRegions = 3;
+    GLsync						mInstanceFences[ kNumInstanceRegions ] = {};
+    size_t						mInstanceRegion = 0;
+    std::vector< int32_t >		mVisibleLightIndices;
+    ci::gl::BufferObjRef		mBufferVisibleLights;
+    ci::gl::BufferTextureRef	mTextureVisibleLights;
+
+    void						uploadLightClusters();
+
+    PassProfiler				mProfiler;
+
+    LightClusters				mLightClusters;
+    ci::gl::BufferObjRef		mBufferClusters;
+    ci::gl::BufferTextureRef	mTextureClusters;
+    ci::gl::BufferObjRef		mBufferClusterLights;
+    ci::gl::BufferTextureRef	mTextureClusterLights;
 
     bool						mEnabledAoBlur = true;
     bool						mEnabledColor = true;
+    bool						mEnabledCulling = true;
     bool						mEnabledBloom = true;
     bool						mEnabledDoF = true;
     bool						mEnabledFog = true;
     bool						mEnabledFxaa = true;
     bool						mEnabledRay = true;
-    bool						mEnabledRayPrev = true;
     bool						mEnabledShadow = true;
+    bool						mEnabledStreaming = true;
+    bool						mEnabledStreamingPrev = true;
+    bool						mEnabledMultiDraw = false;
+    bool						mEnabledMultiDrawPrev = false;
+    bool						mEnabledAsyncCompile = false;
+    bool						mReleaseDisabledEffects = false;
 
     bool						mDrawAo = false;
     bool						mDrawDebug = false;
@@ -270,10 +743,17 @@ private:
     
     Ao                          mAo = Ao_Sao;
     Ao                          mAoPrev = Ao_Sao;
+    InstanceLayout              mInstanceLayout = InstanceLayout_Matrices;
+    InstanceLayout              mInstanceLayoutPrev = InstanceLayout_Matrices;
+    Lighting                    mLighting = Lighting_Volumes;
     int32_t						mMipmapLevels = 5;
 	ci::vec2					mOffset = ci::vec2( 0.f );
 
-    int32_t                     mLightMaterialId;
+    SceneObject< Material >     mLightMaterial;
+
+    size_t                      mUploadedBytes = 0;
+    size_t                      mUploadedInstanceBytes = 0;
+    size_t                      mDrawnInstanceCount = 0;
 
 	ci::ivec2                   mWindowSize;
 
@@ -286,13 +766,23 @@ public:
 
     bool&                       enabledAoBlur()     { return mEnabledAoBlur; }
     bool&                       enabledColor()      { return mEnabledColor; }
+    bool&                       enabledCulling()    { return mEnabledCulling; }
     bool&                       enabledBloom()      { return mEnabledBloom; }
     bool&                       enabledDoF()        { return mEnabledDoF; }
     bool&                       enabledFog()        { return mEnabledFog; }
     bool&                       enabledFxaa()       { return mEnabledFxaa; }
     bool&                       enabledRay()        { return mEnabledRay; }
-    bool&                       enabledRayPrev()    { return mEnabledRayPrev; }
     bool&                       enabledShadow()     { return mEnabledShadow; }
+    bool&                       enabledStreaming()  { return mEnabledStreaming; }
+    // Requires GL 4.3 or ARB_multi_draw_indirect; ignored otherwise
+    bool&                       enabledMultiDraw()  { return mEnabledMultiDraw; }
+    // Builds post-processing programs on a worker thread. Set before
+    // createBatches().
+    bool&                       enabledAsyncCompile() { return mEnabledAsyncCompile; }
+    // Drops the programs of effects when they are disabled, rather than
+    // keeping them for the next time they are enabled. Render targets of
+    // disabled effects are always released.
+    bool&                       releaseDisabledEffects() { return mReleaseDisabledEffects; }
 
     bool&                       drawAo()            { return mDrawAo; }
     bool&                       drawDebug()         { return mDrawDebug; }
@@ -302,6 +792,11 @@ public:
 
     Ao&                         ao()                { return mAo; }
     Ao&                         aoPrev()            { return mAoPrev; }
+    InstanceLayout&             instanceLayout()    { return mInstanceLayout; }
+    Lighting&                   lighting()          { return mLighting; }
+    LightClusters&              lightClusters()     { return mLightClusters; }
+    // Per-pass GPU and CPU timings of draw(). Disabled by default.
+    PassProfiler&               profiler()          { return mProfiler; }
 
 	float&						lightAccumulation() { return mLightAccumulation; }
 	float&						bloomAttenuation() { return mBloomAttenuation; }
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+#include "cinder/Matrix.h"
+#include "cinder/Vector.h"
+
+#include "Light.hpp"
+
+// Assigns lights to clusters: the cells of a grid which divides a camera's
+// view frustum into screen-space tiles and exponentially spaced depth slices.
+// Each cluster gets the list of lights whose volume may reach into it, so a
+// full-screen lighting pass only has to evaluate nearby lights at each pixel.
+//
+// Assignment runs on the CPU and has no GL dependencies. Its results are
+// uploaded as-is by the renderer, and the shader maps fragments to clusters
+// exactly as getCell() does.
+class LightClusters
+{
+public:
+	LightClusters( const ci::ivec3 &grid = ci::ivec3( 16, 9, 24 ) );
+
+	// Assigns lights[ indices[ i ] ] for i < count. Positions are in world
+	// space and are transformed with viewMatrix; projectionMatrix must be a
+	// perspective projection with the given clip distances.
+	void							update( const ci::mat4 &viewMatrix, const ci::mat4 &projectionMatrix,
+										   float nearClip, float farClip,
+										   const Light* lights, const int32_t* indices, size_t count );
+
+	// Grid dimensions as tiles across, tiles down, and depth slices
+	const ci::ivec3&				getGrid() const { return mGrid; }
+	void							setGrid( const ci::ivec3 &grid );
+	size_t							getNumClusters() const { return (size_t)mGrid.x * mGrid.y * mGrid.z; }
+
+	// Returns the cell containing a view-space position, or ( -1 ) if it lies
+	// outside of the frustum's depth range.
+	ci::ivec3						getCell( const ci::vec3 &positionView ) const;
+	size_t							getClusterIndex( const ci::ivec3 &cell ) const { return ( (size_t)cell.z * mGrid.y + cell.y ) * mGrid.x + cell.x; }
+
+	// ( offset, count ) of each cluster's range in getLightIndices()
+	const std::vector< ci::ivec2 >&	getClusters() const { return mClusters; }
+	const std::vector< int32_t >&	getLightIndices() const { return mLightIndices; }
+
+	// Near clip distance, and the factor which maps log( depth / near ) to a slice
+	ci::vec2						getDepthParams() const { return ci::vec2( mNear, mSliceScale ); }
+protected:
+	float							sliceDepth( int32_t slice ) const;
+	int32_t							depthSlice( float depth ) const;
+	int32_t							ndcTile( float ndc, int32_t tiles ) const;
+
+	ci::ivec3						mGrid;
+	ci::mat4						mProjection;
+	float							mNear;
+	float							mFar;
+	float							mSliceScale;
+
+	std::vector< ci::ivec2 >		mClusters;
+	std::vector< int32_t >			mLightIndices;
+	std::vector< std::pair< int32_t, int32_t > > mAssignments; // ( cluster, light )
+};
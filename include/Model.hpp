@@ -1,8 +1,15 @@
 #pragma once
 
+#include <functional>
+
 #include "cinder/gl/gl.h"
 #include "cinder/Matrix.h"
 #include "cinder/GeomIo.h"
+#include "cinder/Quaternion.h"
+#include "cinder/Sphere.h"
+
+#include "TextureArrays.hpp"
+#include "ViewFrustum.hpp"
 
 class Model
 {
@@ -22,6 +29,8 @@ public:
 
     void            setMatrices( const ci::mat4& modelMatrix, const ci::mat4& viewMatrix );
 protected:
+	friend class InstancedModel;
+
 	ci::mat4		mModelMatrix;
 	ci::mat3		mNormalMatrix;
     ci::mat4        mModelViewMatrix;
@@ -36,7 +45,10 @@ public:
     InstancedModel( const ci::geom::Source &geometry, size_t n );
 
     size_t                              size() const { return mModels.size(); };
+    size_t                              capacity() const { return mModels.capacity(); }
+    bool                                empty() const { return mModels.empty(); }
     Model*                              data() { return mModels.data(); };
+    const Model*                        data() const { return mModels.data(); };
 
     container_t::const_iterator         begin() const { return mModels.begin(); }
     container_t::const_iterator         end() const { return mModels.end(); }
@@ -48,13 +60,23 @@ public:
 
     ci::gl::Texture2dRef                getTexture() { return mTexture; }
     const ci::gl::Texture2dRef&         getTexture() const { return mTexture; }
-    void                                setTexture( const ci::gl::Texture2dRef &t ) { mTexture = t; }
+    // Setting a texture replaces the model's texture layer
+    void                                setTexture( const ci::gl::Texture2dRef &t ) { mTexture = t; mTextureLayer = TextureLayer(); }
     bool                                hasTexture() const { return mTexture != nullptr; }
 
     ci::gl::TextureCubeMapRef           getTextureCubeMap() { return mTextureCubeMap; }
     const ci::gl::TextureCubeMapRef&    getTextureCubeMap() const { return mTextureCubeMap; }
     void                                setTextureCubeMap( const ci::gl::TextureCubeMapRef &t ) { mTextureCubeMap = t; }
     bool                                hasTextureCubeMap() const { return mTextureCubeMap != nullptr; }
+    // True while both textures are the 1x1 blank ones assigned on construction
+    bool                                hasBlankTextures() const;
+
+    // A layer of one of the renderer's TextureArrays, used instead of the
+    // model's own texture. Models sharing an array need no texture binds
+    // between them. Resets the texture to the blank one.
+    const TextureLayer&                 getTextureLayer() const { return mTextureLayer; }
+    void                                setTextureLayer( const TextureLayer &layer );
+    bool                                hasTextureLayer() const { return mTextureLayer.isValid(); }
 
     ci::mat4                            getTextureMatrix() const { return mTextureMtx; }
     void                                setTextureMatrix( const ci::mat4 &m ) { mTextureMtx = m; }
@@ -64,16 +86,103 @@ public:
     bool                                hasShader() const { return mShader != nullptr; }
     
     ci::gl::VboMeshRef                  getMesh() const { return mMesh; };
-    ci::gl::VboRef                      getVbo() const { return mVbo; };
+
+    // Changes the number of instances. Capacity grows geometrically, so
+    // spawning instances one at a time reallocates O(log n) times and
+    // shrinking never does. The renderer keeps its batches and picks up the
+    // new count when it next draws.
+    void                                reserve( size_t n );
+    void                                resize( size_t n );
+    void                                push_back( const Model &model );
+    void                                pop_back();
+    void                                clear();
+    // Removes instance i by moving the last instance into its place
+    void                                eraseUnordered( size_t i );
+
+    // Bounding sphere of the mesh in model space, used for culling. It is
+    // computed from the mesh's positions on construction; a negative radius
+    // means the model is never culled.
+    const ci::Sphere&                   getBounds() const { return mBounds; }
+    void                                setBounds( const ci::Sphere &bounds ) { mBounds = bounds; }
+    bool                                hasBounds() const { return mBounds.getRadius() >= 0.0f; }
+
+    // Bounds of instance i in world space
+    ci::Sphere                          getInstanceBounds( size_t i ) const;
+
+    // Copies the dynamic instances whose bounds intersect frustum into
+    // visible, which must have room for size() models. Returns the number
+    // copied.
+    size_t                              cull( const ViewFrustum &frustum, Model* visible ) const;
+    // Copies all dynamic instances to dst. Returns the number copied.
+    size_t                              copyDynamic( Model* dst ) const;
+
+    // Static instances are uploaded to a buffer of their own once and drawn
+    // from it without per-instance culling, so they cost nothing per frame
+    // until they are modified. Only the ones marked dirty are uploaded again.
+    // setTransforms() and setMatrices() mark what they write, also from
+    // within updateParallel(); call markDirty() after writing instances any
+    // other way.
+    void                                setStatic( size_t first, size_t count, bool isStatic = true );
+    bool                                isStatic( size_t i ) const { return mStatic[ i ] != 0; }
+    size_t                              getNumStatic() const { return mStaticIndices.size(); }
+    // Instance indices of the static instances, in order
+    const std::vector< uint32_t >&      getStaticIndices() const { return mStaticIndices; }
+    // Changes whenever instances become or stop being static, or static
+    // instances are removed or moved
+    uint32_t                            getStaticVersion() const { return mStaticVersion; }
+
+    void                                markDirty( size_t first, size_t count = 1 );
+    void                                clearDirty();
+    bool                                isDirty() const { return mAnyDirty; }
+    // Returns the modified static instances as sorted, non-overlapping
+    // ranges of getStaticIndices(). Runs separated by at most gap clean
+    // instances are merged.
+    std::vector< std::pair< size_t, size_t > > dirtyStaticRanges( size_t gap = 0 ) const;
+
+    // Bulk updates of the instances in [first, first + count), vectorized
+    // with SSE where it is available.
+    //
+    // setTransforms() composes model matrices from arrays of count
+    // translations, rotations and scales; a null array leaves that component
+    // as identity. Each result is pre-multiplied by its parent matrix if
+    // parents is not null.
+    void                                setTransforms( size_t first, size_t count, const ci::vec3* translations,
+                                                       const ci::quat* rotations, const ci::vec3* scales,
+                                                       const ci::mat4* parents = nullptr );
+    // Computes model-view and normal matrices from the current model
+    // matrices, like Model::setMatrices(). Only the Matrices instance layout
+    // reads them.
+    void                                setMatrices( size_t first, size_t count, const ci::mat4 &viewMatrix );
+
+    // Splits the instances into chunks of up to grain and calls
+    // fn( begin, end ) for each on WorkerPool's threads. fn may modify the
+    // instances in its range, e.g. with setTransforms(). Only this CPU copy
+    // is written; the renderer uploads it in one go when it next draws.
+    // Static instances written directly must be passed to markDirty() by fn.
+    void                                updateParallel( const std::function< void( size_t begin, size_t end ) > &fn,
+                                                        size_t grain = 4096 );
     
 private:
+    void                        grow( size_t n );
+    void                        updateStaticIndices();
+
     int                         mMaterialId;
     container_t                 mModels;
     ci::gl::VboMeshRef          mMesh;
-    ci::gl::VboRef              mVbo;
+    ci::Sphere                  mBounds;
     ci::gl::Texture2dRef        mTexture = nullptr;
     ci::gl::TextureCubeMapRef   mTextureCubeMap = nullptr;
+    TextureLayer                mTextureLayer;
     ci::mat4                    mTextureMtx;
     ci::gl::GlslProgRef         mShader = nullptr;
+
+    // Per-instance flags. Bytes rather than bits, so workers in
+    // updateParallel() can mark disjoint ranges concurrently.
+    std::vector< uint8_t >      mStatic;
+    std::vector< uint8_t >      mDirty;
+    bool                        mAnyDirty = false;
+    bool                        mUpdatingParallel = false;
+    std::vector< uint32_t >     mStaticIndices;
+    uint32_t                    mStaticVersion = 0;
 };
  
\ No newline at end of file
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cinder/gl/Query.h"
+#include "cinder/Filesystem.h"
+#include "cinder/Timer.h"
+
+// Times render passes on the GPU with GL_TIME_ELAPSED queries and on the
+// CPU with wall clock timers. Each pass keeps a small ring of queries whose
+// results are collected frames later, once they are available, so reading
+// them never stalls the pipeline. Queries of this type cannot nest, so
+// passes must not overlap.
+class PassProfiler
+{
+public:
+	struct Stats
+	{
+		size_t						count	= 0;
+		double						average	= 0.0;
+		double						min		= 0.0;
+		double						max		= 0.0;
+		double						p50		= 0.0;
+		double						p95		= 0.0;
+		double						p99		= 0.0;
+	};
+
+	// Milliseconds over the last getHistorySize() samples of a pass
+	struct PassStats
+	{
+		std::string					name;
+		Stats						gpu;
+		Stats						cpu;
+	};
+
+	PassProfiler( size_t historySize = 120 );
+
+	// Average, extremes and nearest-rank percentiles of samples
+	static Stats					calcStats( const std::vector< double > &samples );
+
+	// Collects finished queries and advances the query ring. Call once per
+	// frame before the first pass.
+	void							beginFrame();
+	void							begin( const std::string &name );
+	void							end();
+
+	// Passes in the order they were first seen
+	std::vector< PassStats >		getStats() const;
+	PassStats						getStats( const std::string &name ) const;
+
+	size_t							getHistorySize() const { return mHistorySize; }
+	void							setHistorySize( size_t n );
+	void							clear();
+
+	void							writeCsv( const ci::fs::path &path ) const;
+	void							writeJson( const ci::fs::path &path ) const;
+
+	bool&							enabled() { return mEnabled; }
+protected:
+	static const size_t				kNumQueries = 2;
+
+	// Fixed-size ring of samples
+	struct History
+	{
+		std::vector< double >		samples;
+		size_t						head = 0;
+
+		void						push( double v, size_t capacity );
+		Stats						getStats() const;
+	};
+
+	struct Pass
+	{
+		std::string					name;
+		ci::gl::QueryTimeElapsedRef	queries[ kNumQueries ];
+		bool						pending[ kNumQueries ] = {};
+		bool						active = false;
+		ci::Timer					timer;
+		History						gpu;
+		History						cpu;
+	};
+
+	PassStats						getStats( const Pass &pass ) const;
+
+	bool							mEnabled = false;
+	size_t							mFrame = 0;
+	size_t							mHistorySize;
+	Pass*							mCurrent = nullptr;
+	std::vector< Pass >				mPasses;
+	std::map< std::string, size_t >	mPassIndices;
+};
+
+class ScopedPassProfile
+{
+public:
+	ScopedPassProfile( PassProfiler &profiler, const std::string &name ) :
+		mProfiler( profiler )
+	{
+		mProfiler.begin( name );
+	}
+	~ScopedPassProfile()
+	{
+		mProfiler.end();
+	}
+private:
+	PassProfiler&					mProfiler;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "cinder/Filesystem.h"
+#include "cinder/gl/GlslProg.h"
+
+// Creates GLSL programs, keeping their linked binaries on disk so that later
+// runs can skip compiling them. Binaries are keyed by the program's sources,
+// including files they #include, its defines and GLSL version, and the GL
+// vendor, renderer and version strings. A binary the driver rejects, after
+// a driver update for instance, is deleted and the program compiled again.
+// Requires GL 4.1 or ARB_get_program_binary; otherwise every program is
+// compiled. create() may be called from several threads.
+class ProgramCache
+{
+public:
+	// An empty directory disables the cache
+	explicit ProgramCache( const ci::fs::path &directory = ci::fs::path() );
+
+	const ci::fs::path&				getDirectory() const { return mDirectory; }
+	void							setDirectory( const ci::fs::path &directory ) { mDirectory = directory; }
+
+	// Same as GlslProg::create(), and throws the same exceptions
+	ci::gl::GlslProgRef				create( const ci::gl::GlslProg::Format &format );
+
+	// Programs loaded from and written to disk since construction
+	size_t							getNumLoaded() const { return mNumLoaded; }
+	size_t							getNumCompiled() const { return mNumCompiled; }
+protected:
+	bool							isSupported();
+	// Empty if a file the program #includes cannot be found
+	std::string						getKey( const ci::gl::GlslProg::Format &format ) const;
+	ci::fs::path					getPath( const std::string &key ) const;
+	ci::gl::GlslProgRef				load( const ci::fs::path &path, const std::string &key ) const;
+	void							save( const ci::fs::path &path, const std::string &key, const ci::gl::GlslProgRef &program ) const;
+
+	ci::fs::path					mDirectory;
+	std::atomic< int32_t >			mSupported{ -1 };	// Unknown until the first create()
+	std::atomic< size_t >			mNumLoaded{ 0 };
+	std::atomic< size_t >			mNumCompiled{ 0 };
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cinder/gl/Context.h"
+#include "cinder/gl/GlslProg.h"
+
+#include "ProgramCache.hpp"
+
+// Builds GLSL programs on a worker thread, with its own GL context sharing
+// objects with the context current at construction. Programs are handed
+// back on the owning thread by poll(), in the order they were pushed, so
+// batches can be made there; VAOs are not shared between contexts.
+//
+// GL_KHR_parallel_shader_compile would let the driver do the same without a
+// thread, but only if nothing asks for a program's status until it is done.
+// GlslProg asks as soon as it links, so a shared context is used instead.
+class ProgramQueue
+{
+public:
+	typedef std::function< void( const ci::gl::GlslProgRef& ) > Callback;
+
+	explicit ProgramQueue( ProgramCache &cache );
+	// Waits for the program being built, and drops the rest
+	~ProgramQueue();
+
+	ProgramQueue( const ProgramQueue& ) = delete;
+	ProgramQueue& operator=( const ProgramQueue& ) = delete;
+
+	void							push( const ci::gl::GlslProg::Format &format, const Callback &onReady );
+	// Calls back for finished programs. Compile and link errors are rethrown
+	// here. Returns the number of programs still pending.
+	size_t							poll();
+	size_t							getNumPending() const;
+protected:
+	struct Job
+	{
+		ci::gl::GlslProg::Format	format;
+		Callback					onReady;
+		ci::gl::GlslProgRef			program;
+		std::exception_ptr			error;
+		bool						done = false;
+	};
+
+	void							run();
+
+	ProgramCache&					mCache;
+	// Current on the worker only while it runs, and destroyed here after
+	// the worker has released it
+	ci::gl::ContextRef				mContext;
+	std::thread						mThread;
+	mutable std::mutex				mMutex;
+	std::condition_variable			mCondition;
+	std::deque< std::shared_ptr< Job > > mJobs;		// In push order, finished or not
+	size_t							mNext	= 0;	// First job not yet taken by the worker
+	bool							mQuit	= false;
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "cinder/gl/Fbo.h"
+#include "cinder/gl/Texture.h"
+
+#include "PassProfiler.hpp"
+#include "RenderTargetPool.hpp"
+
+// Runs a frame as passes which declare the textures they read and write.
+// execute() culls passes whose results are never read, orders the rest so
+// that every texture is written before it is read, and runs them. Each
+// pass draws into a frame buffer made of the textures it writes, in the
+// order it declared them, with a viewport covering the first.
+//
+// Textures are either imported, and owned by the caller, or transient.
+// A transient texture only lives from the first pass using it to the last,
+// after which its pool may hand it to later passes wanting the same size
+// and format. Its contents are undefined until written. Pooled textures
+// left unused by a frame are deleted after it. Writing a texture produces
+// a new version of it, and readers name the version they need. Writes to
+// imported textures outlive the frame, so passes making them are never
+// culled.
+class RenderGraph
+{
+public:
+	// A version of a texture
+	typedef int32_t Handle;
+
+	typedef RenderTargetPool::Desc TextureDesc;
+
+	typedef std::function< void( const RenderGraph& ) > ExecuteFn;
+
+	class PassBuilder
+	{
+	public:
+		PassBuilder&				read( Handle handle );
+		// Returns the version of the texture this pass produces. To draw
+		// over a texture's contents, read it as well.
+		Handle						write( Handle handle );
+	private:
+		friend class RenderGraph;
+		PassBuilder( RenderGraph &graph, size_t pass ) : mGraph( graph ), mPass( pass ) {}
+
+		RenderGraph&				mGraph;
+		size_t						mPass;
+	};
+
+	// Drops the passes and textures of the last frame
+	void							clear();
+
+	Handle							importTexture( const std::string &name, const ci::gl::Texture2dRef &texture );
+	Handle							createTexture( const std::string &name, const TextureDesc &desc );
+	PassBuilder						addPass( const std::string &name, const ExecuteFn &execute );
+	// Keeps the passes producing handle, and its texture until clear()
+	void							setOutput( Handle handle );
+
+	// Runs passes, timing each with profiler
+	void							execute( PassProfiler &profiler );
+
+	// The texture holding handle, while a pass using it runs, or after
+	// execute() for outputs
+	const ci::gl::Texture2dRef&		getTexture( Handle handle ) const;
+
+	// Passes run, and culled, by the last execute()
+	const std::vector< std::string >&	getExecutedPasses() const { return mExecutedPasses; }
+	size_t							getNumCulledPasses() const { return mNumCulledPasses; }
+
+	// Deletes unused textures and frame buffers, after a resize for instance
+	void							releaseTextures();
+
+	// Transient textures, and how much memory they take
+	RenderTargetPool&				getPool() { return mPool; }
+	const RenderTargetPool&			getPool() const { return mPool; }
+protected:
+	struct Resource
+	{
+		std::string					name;
+		TextureDesc					desc;
+		ci::gl::Texture2dRef		texture;
+		bool						imported	= false;
+		Handle						latest		= -1;	// Newest version
+		int32_t						last		= -1;	// Execution order of the last pass using it
+	};
+
+	struct Version
+	{
+		size_t						resource	= 0;
+		Handle						previous	= -1;	// Version this one was written over
+		int32_t						writer		= -1;
+		std::vector< size_t >		readers;
+		int32_t						refCount	= 0;
+		bool						output		= false;
+	};
+
+	struct Pass
+	{
+		std::string					name;
+		ExecuteFn					execute;
+		std::vector< Handle >		reads;
+		std::vector< Handle >		writes;
+		int32_t						refCount	= 0;
+		bool						culled		= false;
+	};
+
+	void							cull();
+	std::vector< size_t >			sort() const;
+	ci::gl::FboRef					getFbo( const Pass &pass );
+
+	std::vector< Resource >			mResources;
+	std::vector< Version >			mVersions;
+	std::vector< Pass >				mPasses;
+	std::vector< std::string >		mExecutedPasses;
+	size_t							mNumCulledPasses = 0;
+
+	RenderTargetPool				mPool;
+	std::map< std::vector< GLuint >, ci::gl::FboRef >	mFbos;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+
+#include "cinder/gl/Texture.h"
+
+// Hands out textures to draw into, keyed by size and format. A released
+// target returns to the pool, and the next request with an identical
+// description reuses it instead of allocating another. GL cannot place
+// textures of different formats in the same memory, so only targets with
+// identical descriptions share storage. Byte counts are estimates from each
+// target's format, size and mip levels; drivers may pad or compress them.
+class RenderTargetPool
+{
+public:
+	struct Desc
+	{
+		Desc() {}
+		Desc( const ci::ivec2 &size, GLint internalFormat, GLenum dataType, GLenum filter = GL_NEAREST, int32_t mipmapLevels = 0 );
+
+		ci::ivec2					size;
+		GLint						internalFormat	= GL_RGBA8;
+		GLenum						dataType		= GL_UNSIGNED_BYTE;
+		GLenum						filter			= GL_NEAREST;
+		int32_t						mipmapLevels	= 0;	// Highest mip level, or zero for none
+
+		bool						isDepth() const;
+		size_t						getBytes() const;
+		bool						operator==( const Desc &rhs ) const;
+		bool						operator!=( const Desc &rhs ) const { return !( *this == rhs ); }
+	};
+
+	static bool						isDepthFormat( GLint internalFormat );
+
+	// Returns a free target matching desc, or creates one
+	ci::gl::Texture2dRef			acquire( const Desc &desc );
+	void							release( const ci::gl::Texture2dRef &texture );
+
+	// Deletes free targets which were not acquired since the last call,
+	// and returns how many were deleted
+	size_t							trim();
+	// Deletes every free target
+	void							clear();
+
+	size_t							getNumTargets() const { return mTargets.size(); }
+	// Bytes held by the pool, in use or free, and by targets in use
+	size_t							getBytes() const { return mBytes; }
+	size_t							getBytesInUse() const { return mBytesInUse; }
+	// Most bytes held, and in use, at once since the last resetPeakBytes()
+	size_t							getPeakBytes() const { return mPeakBytes; }
+	size_t							getPeakBytesInUse() const { return mPeakBytesInUse; }
+	void							resetPeakBytes();
+protected:
+	struct Target
+	{
+		Desc						desc;
+		ci::gl::Texture2dRef		texture;
+		bool						free		= false;
+		bool						acquired	= true;	// Since the last trim()
+	};
+
+	std::vector< Target >			mTargets;
+	size_t							mBytes			= 0;
+	size_t							mBytesInUse		= 0;
+	size_t							mPeakBytes		= 0;
+	size_t							mPeakBytesInUse	= 0;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+
+#include "cinder/gl/Texture.h"
+#include "cinder/Surface.h"
+
+// A slice of one of the arrays in TextureArrays
+struct TextureLayer
+{
+	int32_t							array	= -1;
+	int32_t							layer	= -1;
+
+	bool							isValid() const { return array >= 0 && layer >= 0; }
+	bool							operator==( const TextureLayer &rhs ) const { return array == rhs.array && layer == rhs.layer; }
+	bool							operator!=( const TextureLayer &rhs ) const { return ! ( *this == rhs ); }
+};
+
+// Packs images into the layers of GL_TEXTURE_2D_ARRAY textures. Images of
+// the same size share an array, so models textured from it can be drawn
+// with one binding, and merged into one multi-draw, by indexing their layer
+// in the shader. Arrays have a fixed number of layers; another array of the
+// same size is started when one fills up.
+class TextureArrays
+{
+public:
+	explicit TextureArrays( int32_t layersPerArray = 16 );
+
+	TextureArrays( const TextureArrays& ) = delete;
+	TextureArrays& operator=( const TextureArrays& ) = delete;
+
+	// Copies surface into a free layer and generates its mipmaps. Returns an
+	// invalid layer for empty surfaces.
+	TextureLayer					add( const ci::Surface8u &surface );
+	// Frees layer for reuse by a later add(). Models still referring to it
+	// show whatever is added next.
+	bool							remove( const TextureLayer &layer );
+	// Overwrites the contents of a layer with a surface of the same size
+	bool							update( const TextureLayer &layer, const ci::Surface8u &surface );
+
+	size_t							getNumArrays() const { return mArrays.size(); }
+	int32_t							getLayersPerArray() const { return mLayersPerArray; }
+	const ci::gl::Texture3dRef&		getTexture( int32_t array ) const { return mArrays[ array ].texture; }
+	const ci::ivec2&				getSize( int32_t array ) const { return mArrays[ array ].size; }
+protected:
+	struct Array
+	{
+		ci::gl::Texture3dRef		texture;
+		ci::ivec2					size;
+		std::vector< int32_t >		freeLayers;
+	};
+
+	bool							contains( const TextureLayer &layer ) const;
+	void							upload( const TextureLayer &layer, const ci::Surface8u &surface );
+
+	std::vector< Array >			mArrays;
+	int32_t							mLayersPerArray;
+};
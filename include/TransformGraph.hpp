@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+
+#include "cinder/Matrix.h"
+#include "cinder/Quaternion.h"
+#include "cinder/Vector.h"
+
+#include "DeferredRenderer.hpp"
+
+// A transform hierarchy. Nodes have a local translation, rotation and scale
+// relative to their parent, and may drive the model matrix of an instance of
+// an InstancedModel in the scene.
+//
+// Nodes are stored in flat arrays which are kept in parent-before-child
+// order. Editing a node flags it, and update() resolves world matrices in one
+// forward sweep starting at the first flagged node, where a node is
+// recomputed if it or its parent changed. Moving a parent of 10,000 children
+// therefore costs one linear pass over contiguous arrays. Untouched subtrees
+// only cost a flag test each. Results are written straight into the attached
+// instances, which are marked dirty for upload.
+class TransformGraph
+{
+public:
+	typedef uint32_t				node_t;
+	static const node_t				kNoNode = UINT32_MAX;
+
+	// Adds a node as a child of parent, or as a root if parent is kNoNode.
+	node_t							add( node_t parent = kNoNode,
+										const ci::vec3 &translation = ci::vec3( 0.0f ),
+										const ci::quat &rotation = ci::quat( 1.0f, 0.0f, 0.0f, 0.0f ),
+										const ci::vec3 &scale = ci::vec3( 1.0f ) );
+	// Removes node and all of its descendants. Returns false if node is stale.
+	bool							remove( node_t node );
+	bool							contains( node_t node ) const { return node < mIdToIndex.size() && mIdToIndex[ node ] != kNoNode; }
+	size_t							size() const { return mParents.size(); }
+	void							clear();
+
+	// Moves node, with its subtree, under parent. If parent comes after node
+	// in storage, the subtree is moved behind it to keep parents first.
+	// Returns false, leaving the graph unchanged, if either node is stale or
+	// parent is node itself or one of its descendants.
+	bool							setParent( node_t node, node_t parent );
+	node_t							getParent( node_t node ) const;
+
+	void							setTranslation( node_t node, const ci::vec3 &translation );
+	void							setRotation( node_t node, const ci::quat &rotation );
+	void							setScale( node_t node, const ci::vec3 &scale );
+	void							setLocalTransform( node_t node, const ci::vec3 &translation,
+													  const ci::quat &rotation, const ci::vec3 &scale );
+	const ci::vec3&					getTranslation( node_t node ) const { return mTranslations[ index( node ) ]; }
+	const ci::quat&					getRotation( node_t node ) const { return mRotations[ index( node ) ]; }
+	const ci::vec3&					getScale( node_t node ) const { return mScales[ index( node ) ]; }
+
+	// World matrix as of the last update()
+	const ci::mat4&					getWorldMatrix( node_t node ) const { return mWorldMatrices[ index( node ) ]; }
+
+	// Makes node write its world matrix to instance i of model on update().
+	// The Matrices instance layout also reads model-view and normal matrices,
+	// which only update( viewMatrix ) writes.
+	void							attach( node_t node, const SceneObject< InstancedModel > &model, size_t i );
+	void							detach( node_t node );
+
+	// Propagates edits to world matrices and attached instances. Returns the
+	// number of nodes recomputed. update() only writes instances' model
+	// matrices, which is enough for every instance layout but Matrices.
+	size_t							update();
+	// As update(), and also writes the model-view and normal matrices of
+	// attached instances, as Model::setMatrices() does. Use it each frame
+	// with the Matrices instance layout; when viewMatrix changes, every
+	// attached instance is rewritten.
+	size_t							update( const ci::mat4 &viewMatrix );
+protected:
+	struct Target
+	{
+		uint32_t					model		= kNoNode;	// Index into mModels
+		uint32_t					instance	= 0;
+	};
+
+	size_t							index( node_t node ) const;
+	// Recomputes flagged nodes, and writes the matrices of every attached
+	// instance rather than only flagged ones if allTargets is set
+	size_t							sweep( const ci::mat4* viewMatrix, bool allTargets );
+	void							markDirty( size_t i );
+	// Rearranges the nodes so that new index i holds old index order[ i ].
+	// Nodes missing from order are dropped.
+	void							reorder( const std::vector< uint32_t > &order );
+
+	// Parallel arrays indexed by storage position. Parents are storage
+	// positions too, and always precede their children.
+	std::vector< uint32_t >			mParents;
+	std::vector< ci::vec3 >			mTranslations;
+	std::vector< ci::quat >			mRotations;
+	std::vector< ci::vec3 >			mScales;
+	std::vector< ci::mat4 >			mWorldMatrices;
+	std::vector< Target >			mTargets;
+	std::vector< uint8_t >			mDirty;
+	std::vector< node_t >			mIndexToId;
+	size_t							mFirstDirty = SIZE_MAX;
+	ci::mat4						mViewMatrix;
+	bool							mHasViewMatrix = false;
+
+	std::vector< uint32_t >			mIdToIndex;
+	std::vector< node_t >			mFreeIds;
+
+	std::vector< SceneObject< InstancedModel > > mModels;
+	std::vector< InstancedModel* >	mModelPtrs;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "cinder/Camera.h"
+#include "cinder/Matrix.h"
+#include "cinder/Sphere.h"
+
+// A camera's view volume as six inward-facing planes, for conservative
+// visibility tests on the CPU.
+class ViewFrustum
+{
+public:
+	ViewFrustum();
+	explicit ViewFrustum( const ci::Camera &camera );
+	explicit ViewFrustum( const ci::mat4 &viewProjection );
+
+	void				set( const ci::Camera &camera );
+	void				set( const ci::mat4 &viewProjection );
+
+	// Returns false only if the sphere lies entirely outside of the frustum
+	bool				intersects( const ci::vec3 &center, float radius ) const;
+	bool				intersects( const ci::Sphere &sphere ) const;
+
+	// Planes are ( normal, distance ), with normals pointing into the frustum,
+	// ordered left, right, bottom, top, near, far
+	const ci::vec4&		getPlane( size_t i ) const { return mPlanes[ i ]; }
+protected:
+	ci::vec4			mPlanes[ 6 ];
+};
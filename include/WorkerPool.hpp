@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for splitting loops across cores. The
+// calling thread takes chunks as well, and parallelFor() returns once every
+// chunk has run.
+class WorkerPool
+{
+public:
+	typedef std::function< void( size_t begin, size_t end ) > range_fn;
+
+	// Defaults to one thread fewer than the number of cores, since the
+	// calling thread also works
+	explicit WorkerPool( size_t numThreads = defaultNumThreads() );
+	~WorkerPool();
+
+	WorkerPool( const WorkerPool& ) = delete;
+	WorkerPool& operator=( const WorkerPool& ) = delete;
+
+	// A pool shared by the renderer and models, created on first use
+	static WorkerPool&		get();
+	static size_t			defaultNumThreads();
+
+	size_t					getNumThreads() const { return mThreads.size(); }
+
+	// Calls fn( begin, end ) for consecutive chunks of up to grain indices
+	// in [0, count). Chunks run concurrently, in no particular order. A call
+	// made from inside fn runs serially on its calling thread. If fn throws,
+	// remaining chunks are skipped and the first exception is rethrown here
+	// once every worker has stopped.
+	void					parallelFor( size_t count, size_t grain, const range_fn &fn );
+private:
+	void					run();
+	void					runChunks();
+
+	std::vector< std::thread >	mThreads;
+	std::mutex					mCallMutex;
+	std::mutex					mMutex;
+	std::condition_variable		mWake;
+	std::condition_variable		mDone;
+
+	const range_fn*				mFn = nullptr;
+	std::exception_ptr			mError;
+	size_t						mCount = 0;
+	size_t						mGrain = 1;
+	std::atomic< size_t >		mNext;
+	size_t						mBusy = 0;
+	uint64_t					mGeneration = 0;
+	bool						mQuit = false;
+};
@@ -0,0 +1,598 @@
+#include "cinder/app/App.h"
+#include "cinder/app/RendererGl.h"
+#include "cinder/gl/gl.h"
+#include "cinder/GeomIo.h"
+#include "cinder/Rand.h"
+#include "cinder/Timer.h"
+#include "cinder/Utilities.h"
+#include "glm/gtc/type_ptr.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+
+#include "DeferredRenderer.hpp"
+#include "TransformGraph.hpp"
+
+/*
+ * Renders synthetic scenes offscreen and reports frame times, upload
+ * volume and per-pass timings as CSV. Every combination of the comma
+ * separated values below is run. The GL context comes from an app window;
+ * see README.md for running without a display.
+ *
+ *   --instances 1000,10000		Cube instances
+ *   --lights 64,512			Point lights
+ *   --materials 4				Materials, one instanced model each
+ *   --resolution 1280x720		Render target sizes
+ *   --frames 200				Measured frames per run
+ *   --warmup 20				Unmeasured frames per run
+ *   --enable clustered,...		Features to turn on for every run
+ *   --disable shadow,...		Features to turn off for every run
+ *   --sweep-features			Also run with each feature flipped
+ *   --static					Don't animate instances, and mark them
+ *								static so they are uploaded only once
+ *   --out results.csv			Write to a file as well as stdout
+ *
+ *   --transform-bench 1000,100000
+ *								Instead of rendering, time per-instance
+ *								transform updates against the bulk
+ *								InstancedModel::setTransforms() and
+ *								setMatrices() path, serially and across
+ *								WorkerPool threads, and against moving the
+ *								parent of all instances in a TransformGraph
+ *   --verify					Instead of rendering, check the bulk
+ *								setTransforms() and setMatrices() path,
+ *								vectorized where SSE is available, against
+ *								per-instance glm on random input. Exits
+ *								with a failure status on any mismatch.
+ *
+ * Features: ao aoblur asynccompile bloom clustered color culling dof fog
+ * fxaa highquality multidraw ray shadow streaming
+ */
+
+class BenchmarkApp : public ci::app::App {
+public:
+	void setup() override;
+	void draw() override;
+
+private:
+	struct Config
+	{
+		size_t							instances	= 1000;
+		size_t							lights		= 64;
+		size_t							materials	= 4;
+		ci::ivec2						size		= ci::ivec2( 1280, 720 );
+		std::map< std::string, bool >	features;
+
+		std::string						getFeatureString() const;
+	};
+
+	struct Result
+	{
+		std::vector< double >			cpu;	// update() and draw() submission
+		std::vector< double >			wall;	// including glFinish()
+		double							startup	= 0.0;	// createBatches() and resize()
+		double							pipeline	= 0.0;	// Until every program is built
+		size_t							uploadedBytes	= 0;
+		size_t							drawnInstances	= 0;
+		size_t							targetBytes				= 0;	// Transient render targets held after the last frame,
+		size_t							peakTargetBytes			= 0;	// the most held at once after warm-up,
+		size_t							peakTargetBytesInUse	= 0;	// and the most of those in use at once
+		std::vector< PassProfiler::PassStats > passes;
+	};
+
+	void								runTransformBenchmark( const std::vector< size_t > &counts, std::ostream &out );
+	// Returns the number of failed checks
+	size_t								verifyTransforms( std::ostream &out );
+
+	std::vector< Config >				parseConfigs();
+	Result								run( const Config &config );
+	void								writeHeader( std::ostream &out );
+	void								writeResult( std::ostream &out, size_t index, const Config &config, const Result &result );
+
+	size_t								mFrames = 200;
+	size_t								mWarmup = 20;
+	bool								mAnimate = true;
+};
+
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+typedef function< void( DeferredRenderer&, bool ) > FeatureFn;
+
+static const map< string, FeatureFn > kFeatures = {
+	{ "ao",				[]( DeferredRenderer &r, bool v ) { r.ao() = v ? DeferredRenderer::Ao_Sao : DeferredRenderer::Ao_None; } },
+	{ "aoblur",			[]( DeferredRenderer &r, bool v ) { r.enabledAoBlur() = v; } },
+	{ "asynccompile",	[]( DeferredRenderer &r, bool v ) { r.enabledAsyncCompile() = v; } },
+	{ "bloom",			[]( DeferredRenderer &r, bool v ) { r.enabledBloom() = v; } },
+	{ "clustered",		[]( DeferredRenderer &r, bool v ) { r.lighting() = v ? DeferredRenderer::Lighting_Clustered : DeferredRenderer::Lighting_Volumes; } },
+	{ "color",			[]( DeferredRenderer &r, bool v ) { r.enabledColor() = v; } },
+	{ "culling",		[]( DeferredRenderer &r, bool v ) { r.enabledCulling() = v; } },
+	{ "dof",			[]( DeferredRenderer &r, bool v ) { r.enabledDoF() = v; } },
+	{ "fog",			[]( DeferredRenderer &r, bool v ) { r.enabledFog() = v; } },
+	{ "fxaa",			[]( DeferredRenderer &r, bool v ) { r.enabledFxaa() = v; } },
+	{ "highquality",	[]( DeferredRenderer &r, bool v ) { r.highQuality() = v; } },
+	{ "multidraw",		[]( DeferredRenderer &r, bool v ) { r.enabledMultiDraw() = v; } },
+	{ "ray",			[]( DeferredRenderer &r, bool v ) { r.enabledRay() = v; } },
+	{ "shadow",			[]( DeferredRenderer &r, bool v ) { r.enabledShadow() = v; } },
+	{ "streaming",		[]( DeferredRenderer &r, bool v ) { r.enabledStreaming() = v; } }
+};
+
+// Renderer defaults, used when a feature isn't mentioned
+static const map< string, bool > kFeatureDefaults = {
+	{ "ao", true }, { "aoblur", true }, { "asynccompile", false }, { "bloom", true }, { "clustered", false },
+	{ "color", true }, { "culling", true }, { "dof", true }, { "fog", true },
+	{ "fxaa", true }, { "highquality", false }, { "multidraw", false }, { "ray", true },
+	{ "shadow", true }, { "streaming", true }
+};
+
+string BenchmarkApp::Config::getFeatureString() const
+{
+	string s;
+	for ( const auto &feature : features ) {
+		if ( kFeatureDefaults.at( feature.first ) != feature.second ) {
+			s += ( feature.second ? "+" : "-" ) + feature.first;
+		}
+	}
+	return s.empty() ? "default" : s;
+}
+
+template< typename T >
+static vector< T > parseList( const string &s, function< T( const string& ) > parse )
+{
+	vector< T > values;
+	for ( const string &token : split( s, "," ) ) {
+		if ( ! token.empty() ) {
+			values.push_back( parse( token ) );
+		}
+	}
+	return values;
+}
+
+vector< BenchmarkApp::Config > BenchmarkApp::parseConfigs()
+{
+	auto parseSize		= []( const string &s ) { return (size_t)stoul( s ); };
+	auto parseString	= []( const string &s ) { return s; };
+	auto parseResolution = []( const string &s )
+	{
+		const vector< string > wh = split( s, "x" );
+		return ivec2( stoi( wh.at( 0 ) ), stoi( wh.at( 1 ) ) );
+	};
+
+	vector< size_t > instances	= { 1000 };
+	vector< size_t > lights		= { 64 };
+	vector< size_t > materials	= { 4 };
+	vector< ivec2 > resolutions	= { ivec2( 1280, 720 ) };
+	map< string, bool > features( kFeatureDefaults );
+	bool sweepFeatures			= false;
+
+	const vector< string > &args = getCommandLineArgs();
+	for ( size_t i = 1; i < args.size(); ++i ) {
+		const string &arg	= args[ i ];
+		const bool hasValue	= i + 1 < args.size();
+		if ( arg == "--instances" && hasValue ) {
+			instances = parseList< size_t >( args[ ++i ], parseSize );
+		} else if ( arg == "--lights" && hasValue ) {
+			lights = parseList< size_t >( args[ ++i ], parseSize );
+		} else if ( arg == "--materials" && hasValue ) {
+			materials = parseList< size_t >( args[ ++i ], parseSize );
+		} else if ( arg == "--resolution" && hasValue ) {
+			resolutions = parseList< ivec2 >( args[ ++i ], parseResolution );
+		} else if ( arg == "--frames" && hasValue ) {
+			mFrames = max( parseSize( args[ ++i ] ), (size_t)1 );
+		} else if ( arg == "--warmup" && hasValue ) {
+			mWarmup = parseSize( args[ ++i ] );
+		} else if ( ( arg == "--enable" || arg == "--disable" ) && hasValue ) {
+			for ( const string &name : parseList< string >( args[ ++i ], parseString ) ) {
+				if ( kFeatures.count( name ) == 0 ) {
+					cerr << "Unknown feature: " << name << endl;
+					continue;
+				}
+				features[ name ] = arg == "--enable";
+			}
+		} else if ( arg == "--sweep-features" ) {
+			sweepFeatures = true;
+		} else if ( arg == "--static" ) {
+			mAnimate = false;
+		} else if ( ( arg == "--out" || arg == "--transform-bench" ) && hasValue ) {
+			++i; // Handled in setup()
+		} else {
+			cerr << "Ignoring argument: " << arg << endl;
+		}
+	}
+
+	vector< map< string, bool > > featureSets = { features };
+	if ( sweepFeatures ) {
+		for ( const auto &feature : features ) {
+			map< string, bool > flipped( features );
+			flipped[ feature.first ] = ! feature.second;
+			featureSets.push_back( flipped );
+		}
+	}
+
+	vector< Config > configs;
+	for ( size_t n : instances ) {
+		for ( size_t m : lights ) {
+			for ( size_t k : materials ) {
+				for ( const ivec2 &size : resolutions ) {
+					for ( const auto &featureSet : featureSets ) {
+						Config config;
+						config.instances	= n;
+						config.lights		= m;
+						config.materials	= max( k, (size_t)1 );
+						config.size			= size;
+						config.features		= featureSet;
+						configs.push_back( config );
+					}
+				}
+			}
+		}
+	}
+	return configs;
+}
+
+BenchmarkApp::Result BenchmarkApp::run( const Config &config )
+{
+	unique_ptr< DeferredRenderer > renderer( new DeferredRenderer() );
+	Scene &scene = renderer->scene();
+	Rand rand( 1 );
+
+	// Lay instances out on a grid, split evenly across one model per material
+	const int32_t side		= (int32_t)ceil( cbrt( (double)config.instances ) );
+	const float spacing		= 2.5f;
+	const float extent		= side * spacing;
+	const vec3 origin		= vec3( -0.5f * ( extent - spacing ) );
+
+	vector< SceneObject< InstancedModel > > models;
+	vector< vector< vec3 > > positions;
+	size_t placed = 0;
+	for ( size_t k = 0; k < config.materials; ++k ) {
+		const size_t count = config.instances / config.materials + ( k < config.instances % config.materials ? 1 : 0 );
+		if ( count == 0 ) continue;
+
+		SceneObject< Material > material = scene.add( Material()
+													 .colorDiffuse( Colorf( CM_HSV, rand.nextFloat(), 0.5f, 0.9f ) )
+													 .shininess( rand.nextFloat( 0.5f, 50.0f ) ) );
+		positions.emplace_back();
+		for ( size_t i = 0; i < count; ++i, ++placed ) {
+			const int32_t x = (int32_t)( placed % side );
+			const int32_t y = (int32_t)( ( placed / side ) % side );
+			const int32_t z = (int32_t)( placed / ( side * side ) );
+			positions.back().push_back( origin + vec3( x, y, z ) * spacing );
+		}
+
+		InstancedModel model( geom::Cube(), count );
+		model.setMaterialId( material.getId() );
+		model.setTransforms( 0, count, positions.back().data(), nullptr, nullptr );
+		if ( ! mAnimate ) {
+			model.setStatic( 0, count );
+		}
+		models.push_back( scene.add( model ) );
+	}
+
+	for ( size_t i = 0; i < config.lights; ++i ) {
+		scene.add( Light()
+				  .color( Colorf( CM_HSV, rand.nextFloat(), 1.0f, 0.8f ) )
+				  .position( ( rand.nextVec3() * rand.nextFloat() ) * extent * 0.5f )
+				  .volume( spacing * 2.0f )
+				  .intensity( 0.5f ) );
+	}
+	scene.add( Light().color( Colorf::white() ).position( vec3( 0.0f ) ).volume( spacing * 3.0f ), true );
+
+	const float radius = extent * 0.5f * sqrt( 3.0f );
+	CameraPersp camera( config.size.x, config.size.y, 60.0f, 0.1f, 1000.0f );
+	camera = camera.calcFraming( Sphere( vec3( 0.0f ), radius ) );
+	camera.setFarClip( length( camera.getEyePoint() ) + radius );
+	scene.setCamera( camera );
+
+	for ( const auto &feature : config.features ) {
+		kFeatures.at( feature.first )( *renderer, feature.second );
+	}
+	renderer->profiler().enabled() = true;
+
+	// Programs are cached on disk, so only the first run compiles them
+	Result result;
+	Timer startupTimer( true );
+	renderer->createBatches( config.size );
+	renderer->resize( config.size );
+	glFinish();
+	result.startup = startupTimer.getSeconds() * 1000.0;
+
+	// With asynchronous compilation, frames are timed once every effect is
+	// available, so that results compare with synchronous runs
+	while ( ! renderer->isPipelineComplete() ) {
+		ci::sleep( 1.0f );
+		renderer->update();
+	}
+	result.pipeline = startupTimer.getSeconds() * 1000.0;
+
+	gl::FboRef fbo = gl::Fbo::create( config.size.x, config.size.y, gl::Fbo::Format().disableDepth() );
+	const gl::ScopedFramebuffer scopedFramebuffer( fbo );
+	const gl::ScopedViewport scopedViewport( ivec2( 0 ), config.size );
+
+	for ( size_t frame = 0; frame < mWarmup + mFrames; ++frame ) {
+		if ( frame == mWarmup ) {
+			renderer->profiler().clear();
+			renderer->renderTargetPool().resetPeakBytes();
+		}
+
+		// Animating the instances stands in for application code, so it
+		// isn't timed
+		if ( mAnimate ) {
+			const float t = (float)frame / 60.0f;
+			for ( size_t k = 0; k < models.size(); ++k ) {
+				ScopedInstancedModelMap vboMap( models[ k ] );
+				for ( const vec3 &p : positions[ k ] ) {
+					vboMap->setModelMatrix( glm::translate( p ) * glm::rotate( t, vec3( 1.0f, 1.0f, 0.0f ) ) );
+					vboMap++;
+				}
+			}
+		}
+
+		Timer timer( true );
+		renderer->update();
+		renderer->draw( Rectf( vec2( 0.0f ), vec2( config.size ) ) );
+		const double cpu = timer.getSeconds();
+		glFinish();
+		const double wall = timer.getSeconds();
+
+		if ( frame >= mWarmup ) {
+			result.cpu.push_back( cpu * 1000.0 );
+			result.wall.push_back( wall * 1000.0 );
+			result.uploadedBytes	+= renderer->getUploadedBytes() + renderer->getUploadedInstanceBytes();
+			result.drawnInstances	+= renderer->getDrawnInstanceCount();
+		}
+	}
+
+	// Collect the last frames' GPU timings
+	for ( size_t i = 0; i < 2; ++i ) {
+		glFinish();
+		renderer->profiler().beginFrame();
+	}
+	result.uploadedBytes	/= mFrames;
+	result.drawnInstances	/= mFrames;
+	result.passes			= renderer->profiler().getStats();
+	result.targetBytes			= renderer->renderTargetPool().getBytes();
+	result.peakTargetBytes		= renderer->renderTargetPool().getPeakBytes();
+	result.peakTargetBytesInUse	= renderer->renderTargetPool().getPeakBytesInUse();
+	return result;
+}
+
+void BenchmarkApp::writeHeader( ostream &out )
+{
+	out << "run,instances,lights,materials,width,height,features,upload_bytes,drawn_instances,"
+		<< "target_bytes,peak_target_bytes,peak_target_bytes_in_use,"
+		<< "name,timer,count,average_ms,min_ms,max_ms,p50_ms,p95_ms,p99_ms" << endl;
+}
+
+void BenchmarkApp::writeResult( ostream &out, size_t index, const Config &config, const Result &result )
+{
+	auto row = [ & ]( const string &name, const string &timer, const PassProfiler::Stats &s )
+	{
+		out << index << "," << config.instances << "," << config.lights << "," << config.materials << ","
+			<< config.size.x << "," << config.size.y << "," << config.getFeatureString() << ","
+			<< result.uploadedBytes << "," << result.drawnInstances << ","
+			<< result.targetBytes << "," << result.peakTargetBytes << "," << result.peakTargetBytesInUse << ","
+			<< name << "," << timer << "," << s.count << "," << s.average << "," << s.min << "," << s.max << ","
+			<< s.p50 << "," << s.p95 << "," << s.p99 << endl;
+	};
+	row( "Frame", "cpu", PassProfiler::calcStats( result.cpu ) );
+	row( "Frame", "wall", PassProfiler::calcStats( result.wall ) );
+	row( "Startup", "wall", PassProfiler::calcStats( vector< double >( 1, result.startup ) ) );
+	row( "Pipeline", "wall", PassProfiler::calcStats( vector< double >( 1, result.pipeline ) ) );
+	for ( const PassProfiler::PassStats &pass : result.passes ) {
+		row( pass.name, "gpu", pass.gpu );
+		row( pass.name, "cpu", pass.cpu );
+	}
+}
+
+void BenchmarkApp::runTransformBenchmark( const vector< size_t > &counts, ostream &out )
+{
+	const size_t iterations = max( mFrames, (size_t)1 );
+	const mat4 viewMatrix	= glm::lookAt( vec3( 0.0f, 0.0f, 10.0f ), vec3( 0.0f ), vec3( 0.0f, 1.0f, 0.0f ) );
+	Rand rand( 1 );
+
+	out << "instances,path,iterations,average_ms,min_ms" << endl;
+	for ( size_t n : counts ) {
+		InstancedModel model( geom::Cube(), n );
+		vector< vec3 > translations( n );
+		vector< quat > rotations( n );
+		vector< vec3 > scales( n );
+		for ( size_t i = 0; i < n; ++i ) {
+			translations[ i ]	= rand.nextVec3() * 100.0f;
+			rotations[ i ]		= glm::angleAxis( rand.nextFloat( 6.28f ), rand.nextVec3() );
+			scales[ i ]			= vec3( rand.nextFloat( 0.5f, 2.0f ) );
+		}
+
+		auto time = [ & ]( const string &path, const function< void() > &update )
+		{
+			double total	= 0.0;
+			double best		= numeric_limits< double >::max();
+			for ( size_t i = 0; i < iterations; ++i ) {
+				Timer timer( true );
+				update();
+				const double ms = timer.getSeconds() * 1000.0;
+				total	+= ms;
+				best	= min( best, ms );
+			}
+			out << n << "," << path << "," << iterations << "," << total / (double)iterations << "," << best << endl;
+		};
+
+		time( "per_instance", [ & ]
+		{
+			size_t i = 0;
+			for ( Model &m : model ) {
+				m.setMatrices( glm::translate( translations[ i ] ) * glm::mat4_cast( rotations[ i ] ) * glm::scale( scales[ i ] ), viewMatrix );
+				++i;
+			}
+		} );
+		time( "bulk", [ & ]
+		{
+			model.setTransforms( 0, n, translations.data(), rotations.data(), scales.data() );
+			model.setMatrices( 0, n, viewMatrix );
+		} );
+		time( "bulk_model_only", [ & ]
+		{
+			model.setTransforms( 0, n, translations.data(), rotations.data(), scales.data() );
+		} );
+		time( "bulk_parallel", [ & ]
+		{
+			model.updateParallel( [ & ]( size_t begin, size_t end )
+			{
+				model.setTransforms( begin, end - begin, translations.data() + begin, rotations.data() + begin, scales.data() + begin );
+				model.setMatrices( begin, end - begin, viewMatrix );
+			} );
+		} );
+
+		// One root with every instance as a child; moving the root
+		// recomputes all of them in a single sweep
+		Scene scene;
+		SceneObject< InstancedModel > obj = scene.add( model );
+		TransformGraph graph;
+		const TransformGraph::node_t root = graph.add();
+		for ( size_t i = 0; i < n; ++i ) {
+			graph.attach( graph.add( root, translations[ i ], rotations[ i ], scales[ i ] ), obj, i );
+		}
+		graph.update( viewMatrix );
+		float angle = 0.0f;
+		time( "hierarchy", [ & ]
+		{
+			angle += 0.01f;
+			graph.setRotation( root, glm::angleAxis( angle, vec3( 0.0f, 1.0f, 0.0f ) ) );
+			graph.update( viewMatrix );
+		} );
+	}
+}
+
+size_t BenchmarkApp::verifyTransforms( ostream &out )
+{
+	const mat4 viewMatrix	= glm::lookAt( vec3( 3.0f, 4.0f, 10.0f ), vec3( 0.0f ), vec3( 0.0f, 1.0f, 0.0f ) );
+	const float tolerance	= 1.0e-4f;
+	Rand rand( 1 );
+
+	// Largest difference, relative to the expected magnitude above one
+	auto error = []( const float* actual, const float* expected, size_t n )
+	{
+		float e = 0.0f;
+		for ( size_t i = 0; i < n; ++i ) {
+			e = max( e, abs( actual[ i ] - expected[ i ] ) / max( abs( expected[ i ] ), 1.0f ) );
+		}
+		return e;
+	};
+
+	// Counts which aren't multiples of four leave instances to the scalar
+	// tail, and the range starts one instance in so that neither end lines
+	// up with the model's storage
+	const char* inputNames[] = { "translations", "trs", "trs_parents" };
+	size_t failures = 0;
+	out << "instances,inputs,max_error,result" << endl;
+	for ( size_t n : { 1, 2, 3, 4, 5, 7, 8, 13, 67, 1021 } ) {
+		InstancedModel model( geom::Cube(), n + 2 );
+		vector< vec3 > translations( n );
+		vector< quat > rotations( n );
+		vector< vec3 > scales( n );
+		vector< mat4 > parents( n );
+		for ( size_t i = 0; i < n; ++i ) {
+			translations[ i ]	= rand.nextVec3() * 100.0f;
+			rotations[ i ]		= glm::angleAxis( rand.nextFloat( 6.28f ), rand.nextVec3() );
+			scales[ i ]			= vec3( rand.nextFloat( 0.5f, 2.0f ), rand.nextFloat( 0.5f, 2.0f ), rand.nextFloat( 0.5f, 2.0f ) );
+			parents[ i ]		= glm::translate( rand.nextVec3() * 10.0f ) * glm::mat4_cast( glm::angleAxis( rand.nextFloat( 6.28f ), rand.nextVec3() ) ) *
+				glm::scale( vec3( rand.nextFloat( 0.5f, 2.0f ) ) );
+		}
+
+		for ( size_t inputs = 0; inputs < 3; ++inputs ) {
+			const bool trs		= inputs > 0;
+			const bool parented	= inputs == 2;
+			model.setTransforms( 1, n, translations.data(), trs ? rotations.data() : nullptr, trs ? scales.data() : nullptr, parented ? parents.data() : nullptr );
+			model.setMatrices( 1, n, viewMatrix );
+
+			float maxError = 0.0f;
+			for ( size_t i = 0; i < n; ++i ) {
+				mat4 m = glm::translate( translations[ i ] );
+				if ( trs ) {
+					m *= glm::mat4_cast( rotations[ i ] ) * glm::scale( scales[ i ] );
+				}
+				if ( parented ) {
+					m = parents[ i ] * m;
+				}
+				Model expected;
+				expected.setMatrices( m, viewMatrix );
+
+				const Model &actual = model.data()[ i + 1 ];
+				maxError = max( maxError, error( glm::value_ptr( actual.getModelMatrix() ), glm::value_ptr( expected.getModelMatrix() ), 16 ) );
+				maxError = max( maxError, error( glm::value_ptr( actual.getModelViewMatrix() ), glm::value_ptr( expected.getModelViewMatrix() ), 16 ) );
+				maxError = max( maxError, error( glm::value_ptr( actual.getNormalMatrix() ), glm::value_ptr( expected.getNormalMatrix() ), 9 ) );
+			}
+			const bool untouched	= model.data()[ 0 ].getModelMatrix() == mat4( 1.0f ) && model.data()[ n + 1 ].getModelMatrix() == mat4( 1.0f );
+			const bool passed		= maxError <= tolerance && untouched;
+			if ( ! passed ) {
+				++failures;
+			}
+			out << n << "," << inputNames[ inputs ] << "," << maxError << "," << ( passed ? "ok" : "FAIL" ) << endl;
+		}
+	}
+	return failures;
+}
+
+void BenchmarkApp::setup()
+{
+	const vector< string > &args = getCommandLineArgs();
+	ofstream file;
+	vector< size_t > transformCounts;
+	for ( size_t i = 1; i + 1 < args.size(); ++i ) {
+		if ( args[ i ] == "--out" ) {
+			file.open( args[ i + 1 ] );
+		} else if ( args[ i ] == "--transform-bench" ) {
+			transformCounts = parseList< size_t >( args[ i + 1 ], []( const string &s ) { return (size_t)stoul( s ); } );
+		}
+	}
+
+	if ( find( args.begin(), args.end(), "--verify" ) != args.end() ) {
+		const size_t failures = verifyTransforms( file.is_open() ? (ostream&)file : cout );
+		if ( failures > 0 ) {
+			cerr << failures << " transform checks failed" << endl;
+		}
+
+		// quit() always exits successfully, so report the result directly
+		cout.flush();
+		if ( file.is_open() ) file.close();
+		exit( failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+	}
+
+	if ( ! transformCounts.empty() ) {
+		parseConfigs(); // For --frames
+		runTransformBenchmark( transformCounts, file.is_open() ? (ostream&)file : cout );
+		quit();
+		return;
+	}
+
+	const vector< Config > configs = parseConfigs();
+	writeHeader( cout );
+	if ( file.is_open() ) writeHeader( file );
+	for ( size_t i = 0; i < configs.size(); ++i ) {
+		const Result result = run( configs[ i ] );
+		writeResult( cout, i, configs[ i ], result );
+		if ( file.is_open() ) writeResult( file, i, configs[ i ], result );
+	}
+
+	quit();
+}
+
+void BenchmarkApp::draw()
+{
+}
+
+CINDER_APP( BenchmarkApp, RendererGl( RendererGl::Options().version( 3, 3 ) ), []( App::Settings* settings )
+{
+	settings->disableFrameRate();
+	settings->setHighDensityDisplayEnabled( false );
+	settings->setWindowSize( 640, 360 );
+} );
@@ -4,21 +4,49 @@
 #include "cinder/gl/scoped.h"
 #include "cinder/ImageIo.h"
 #include "cinder/Log.h"
+#include "cinder/Quaternion.h"
 #include "cinder/Utilities.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <numeric>
+
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 
-const GLint UBO_LOCATION_LIGHTS = 0;
-const GLint UBO_LOCATION_MATERIALS = 1;
+// Texture arrays share the G-buffer pass with each model's texture (0) and
+// cube map (1)
+const int32_t TEXTURE_UNIT_TEXTURE_ARRAY = 2;
+
+// Per-draw data of the multi-draw G-buffer pass
+const int32_t TEXTURE_UNIT_DRAWS = 10;
+
+// Light and material buffers are bound to texture units above those used by
+// any pass, so they can stay bound for the whole frame
+const int32_t TEXTURE_UNIT_CLUSTERS = 11;
+const int32_t TEXTURE_UNIT_CLUSTER_LIGHTS = 12;
+const int32_t TEXTURE_UNIT_LIGHT_INDICES = 13;
+const int32_t TEXTURE_UNIT_LIGHTS = 14;
+const int32_t TEXTURE_UNIT_MATERIALS = 15;
+
+// Instance buffers hold a section for the G-buffer pass followed by one for
+// the shadow map pass
+const size_t NUM_INSTANCE_SECTIONS = 2;
+
+// vec4s of per-draw data in the multi-draw G-buffer pass; see gbuffer.vert
+const size_t INDIRECT_DRAW_SIZE = 5;
+
+// Dirty runs of static instances separated by this many clean ones or fewer
+// are uploaded as one range
+const size_t STATIC_INSTANCE_RANGE_GAP = 2;
 
 #pragma mark - Scene
 
 SceneObject< Light > Scene::add( const Light &light )
 {
-	mLightData.push_back( light );
-	return SceneObject< Light >( &mLightData, mLightData.size() - 1 );
+	return SceneObject< Light >( &mLightData, mLightData.insert( light ) );
 }
 
 vector< SceneObject< Light > > Scene::add( const Light &light, bool castsRays )
@@ -27,8 +55,8 @@ vector< SceneObject< Light > > Scene::add( const Light &light, bool castsRays )
 	objs.push_back( add( light ) );
 
 	if ( castsRays ) {
-		mRayLightData.push_back( light );
-		objs.push_back( SceneObject< Light >( &mRayLightData, mRayLightData.size() - 1 ) );
+		objs.push_back( SceneObject< Light >( &mRayLightData, mRayLightData.insert( light ) ) );
+		mRayLightTwins.emplace_back( objs.front().getHandle(), objs.back().getHandle() );
 	}
 
 	return objs;
@@ -36,18 +64,76 @@ vector< SceneObject< Light > > Scene::add( const Light &light, bool castsRays )
 
 SceneObject< Material > Scene::add( const Material &material )
 {
-    mMaterialData.push_back( material );
-
-    return SceneObject< Material >( &mMaterialData, mMaterialData.size() - 1 );
+    return SceneObject< Material >( &mMaterialData, mMaterialData.insert( material ) );
 }
 
 SceneObject< InstancedModel > Scene::add( const InstancedModel &models )
 {
-    mInstancedModelData.push_back( models );
-    mInstancedModels.emplace_back( &mInstancedModelData, mInstancedModelData.size() - 1 );
+    mInstancedModels.emplace_back( &mInstancedModelData, mInstancedModelData.insert( models ) );
     return mInstancedModels.back();
 }
 
+bool Scene::remove( const SceneObject< Light > &light )
+{
+	if ( light.mContainerPtr != &mLightData && light.mContainerPtr != &mRayLightData ) return false;
+	if ( ! light.mContainerPtr->erase( light.getHandle() ) ) return false;
+
+	const bool isRay = light.mContainerPtr == &mRayLightData;
+	for ( auto it = mRayLightTwins.begin(); it != mRayLightTwins.end(); ++it ) {
+		if ( ( isRay ? it->second : it->first ) == light.getHandle() ) {
+			if ( isRay ) {
+				mLightData.erase( it->first );
+			} else {
+				mRayLightData.erase( it->second );
+			}
+			mRayLightTwins.erase( it );
+			break;
+		}
+	}
+	return true;
+}
+
+bool Scene::remove( const SceneObject< Material > &material )
+{
+	const scene_object_id id = material.getId();
+	if ( material.mContainerPtr != &mMaterialData || id < 0 ) return false;
+	if ( material.getHandle() == mRendererMaterial ) {
+		CI_LOG_W( "Material " << id << " belongs to the renderer and cannot be removed" );
+		return false;
+	}
+
+	for ( const auto &models : mInstancedModelData ) {
+		if ( models.getMaterialId() == id ) {
+			CI_LOG_W( "Material " << id << " is still in use and cannot be removed" );
+			return false;
+		}
+	}
+
+	// The last material moves into the removed material's index, so models
+	// which referenced it need to follow.
+	const scene_object_id last = (scene_object_id)mMaterialData.size() - 1;
+	mMaterialData.erase( material.getHandle() );
+	if ( id != last ) {
+		for ( auto &models : mInstancedModelData ) {
+			if ( models.getMaterialId() == last ) {
+				models.setMaterialId( id );
+			}
+		}
+	}
+
+	return true;
+}
+
+bool Scene::remove( const SceneObject< InstancedModel > &models )
+{
+	// Copy first, models may refer to an element of mInstancedModels
+	const SceneObject< InstancedModel > obj = models;
+	if ( obj.mContainerPtr != &mInstancedModelData || ! mInstancedModelData.erase( obj.getHandle() ) ) return false;
+
+	mInstancedModels.erase( std::remove( mInstancedModels.begin(), mInstancedModels.end(), obj ), mInstancedModels.end() );
+	return true;
+}
+
 #pragma mark - DeferredRenderer
 
 // These scaling functions take a float where 1.f is the renderer default,
@@ -70,19 +156,323 @@ float scaleBloomScale( float v )
 	return math< float >::max( v, 0.f ) * 0.012f;
 }
 
-DeferredRenderer::DeferredRenderer()
+DeferredRenderer::DeferredRenderer() :
+    mProgramCache( getTemporaryDirectory() / "DeferredRendererPrograms" )
 {
-    mLightMaterialId = scene().add( Material().colorAmbient( ColorAf::black() )
+    mLightMaterial = scene().add( Material().colorAmbient( ColorAf::black() )
                                    .colorDiffuse( Colorf::black() ).colorEmission( Colorf::white() )
                                    .shininess( 100.0f ) ); // Lights
+    mScene.mRendererMaterial = mLightMaterial.getHandle();
+
+}
+
+DeferredRenderer::~DeferredRenderer()
+{
+	for ( GLsync &fence : mInstanceFences ) {
+		if ( fence != nullptr ) {
+			glDeleteSync( fence );
+			fence = nullptr;
+		}
+	}
+}
+
+// Compact per-instance format of InstanceLayout_Trs
+struct InstanceTrs
+{
+	vec4	translationScale;	// translation, x scale
+	vec4	rotation;			// unit quaternion as x, y, z, w
+	vec2	scale;				// y and z scale
+};
+
+size_t getInstanceStride( DeferredRenderer::InstanceLayout layout )
+{
+	switch ( layout ) {
+	case DeferredRenderer::InstanceLayout_Matrices:
+		return sizeof( Model );
+	case DeferredRenderer::InstanceLayout_Trs:
+		return sizeof( InstanceTrs );
+	default:
+		return sizeof( mat4 );
+	}
+}
+
+geom::BufferLayout getInstanceBufferLayout( DeferredRenderer::InstanceLayout layout, size_t offset = 0 )
+{
+	geom::BufferLayout bufferLayout;
+	const size_t stride = getInstanceStride( layout );
+	switch ( layout ) {
+	case DeferredRenderer::InstanceLayout_Matrices:
+		bufferLayout.append( geom::Attrib::CUSTOM_0, 16, stride, offset, 1 );
+		bufferLayout.append( geom::Attrib::CUSTOM_1, 9, stride, offset + sizeof( mat4 ), 1 );
+		bufferLayout.append( geom::Attrib::CUSTOM_2, 16, stride, offset + sizeof( mat4 ) + sizeof( mat3 ), 1 );
+		break;
+	case DeferredRenderer::InstanceLayout_Trs:
+		bufferLayout.append( geom::Attrib::CUSTOM_0, 4, stride, offset + offsetof( InstanceTrs, translationScale ), 1 );
+		bufferLayout.append( geom::Attrib::CUSTOM_1, 4, stride, offset + offsetof( InstanceTrs, rotation ), 1 );
+		bufferLayout.append( geom::Attrib::CUSTOM_2, 2, stride, offset + offsetof( InstanceTrs, scale ), 1 );
+		break;
+	default:
+		bufferLayout.append( geom::Attrib::CUSTOM_0, 16, stride, offset, 1 );
+		break;
+	}
+	return bufferLayout;
+}
+
+// Writes count models to dst in the given layout's format
+void packInstances( const Model* models, size_t count, DeferredRenderer::InstanceLayout layout, void* dst )
+{
+	switch ( layout ) {
+	case DeferredRenderer::InstanceLayout_Matrices:
+		copy( models, models + count, (Model*)dst );
+		break;
+	case DeferredRenderer::InstanceLayout_Trs:
+		for ( size_t i = 0; i < count; ++i ) {
+			const mat4 &m	= models[ i ].getModelMatrix();
+			vec3 axes[ 3 ]	= { vec3( m[ 0 ] ), vec3( m[ 1 ] ), vec3( m[ 2 ] ) };
+			vec3 scale( glm::length( axes[ 0 ] ), glm::length( axes[ 1 ] ), glm::length( axes[ 2 ] ) );
+
+			// A mirroring transform is a rotation with one negative scale
+			if ( glm::dot( glm::cross( axes[ 0 ], axes[ 1 ] ), axes[ 2 ] ) < 0.0f ) {
+				scale.x = -scale.x;
+			}
+			for ( int32_t j = 0; j < 3; ++j ) {
+				if ( scale[ j ] != 0.0f ) axes[ j ] /= scale[ j ];
+			}
+			const quat q = glm::quat_cast( mat3( axes[ 0 ], axes[ 1 ], axes[ 2 ] ) );
+
+			InstanceTrs &trs		= ( (InstanceTrs*)dst )[ i ];
+			trs.translationScale	= vec4( vec3( m[ 3 ] ), scale.x );
+			trs.rotation			= vec4( q.x, q.y, q.z, q.w );
+			trs.scale				= vec2( scale.y, scale.z );
+		}
+		break;
+	default:
+		for ( size_t i = 0; i < count; ++i ) {
+			( (mat4*)dst )[ i ] = models[ i ].getModelMatrix();
+		}
+		break;
+	}
+}
+
+// Returns a mesh which shares the model's geometry and reads per-instance
+// attributes from vbo, laid out by layout.
+gl::VboMeshRef createInstanceMesh( const InstancedModel &model, const geom::BufferLayout &layout, const gl::VboRef &vbo )
+{
+	const gl::VboMeshRef &mesh = model.getMesh();
+	vector< pair< geom::BufferLayout, gl::VboRef > > layoutVbos = mesh->getVertexArrayLayoutVbos();
+	layoutVbos.push_back( make_pair( layout, vbo ) );
+	return gl::VboMesh::create( mesh->getNumVertices(), mesh->getGlPrimitive(), layoutVbos,
+							   mesh->getNumIndices(), mesh->getIndexDataType(), mesh->getIndexVbo() );
+}
+
+// Each region of an instance buffer holds one section per pass, of capacity
+// instances each. Returns the byte offset of a section; the offset of
+// section 0 of region n is the size of n regions.
+size_t getSectionOffset( size_t capacity, size_t stride, size_t region, size_t section )
+{
+	return ( region * NUM_INSTANCE_SECTIONS + section ) * capacity * stride;
+}
+
+// Allocates an instance buffer of the given size. When streaming where buffer
+// storage is available (GL 4.4 or ARB_buffer_storage), the buffer is
+// immutable and stays mapped for its lifetime; mapped receives the pointer.
+// Otherwise mapped is null and regions are mapped unsynchronized per frame.
+gl::VboRef createInstanceVbo( size_t size, bool streaming, uint8_t** mapped )
+{
+	*mapped = nullptr;
+	if ( ! streaming ) {
+		return gl::Vbo::create( GL_ARRAY_BUFFER, size, nullptr, GL_DYNAMIC_DRAW );
+	}
+#if defined( GL_MAP_PERSISTENT_BIT )
+	if ( gl::isExtensionAvailable( "GL_ARB_buffer_storage" ) ) {
+		gl::VboRef vbo = gl::Vbo::create( GL_ARRAY_BUFFER );
+		const gl::ScopedBuffer scopedBuffer( vbo );
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage( GL_ARRAY_BUFFER, size, nullptr, flags );
+		*mapped = (uint8_t*)glMapBufferRange( GL_ARRAY_BUFFER, 0, size, flags );
+		if ( *mapped != nullptr ) {
+			return vbo;
+		}
+		CI_LOG_W( "Unable to persistently map instance buffer" );
+	}
+#endif
+	return gl::Vbo::create( GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW );
+}
+
+// Writes bytes of data to a texture buffer, creating it or growing it in
+// power-of-two steps when it is too small.
+void uploadTextureBuffer( gl::BufferObjRef &buffer, gl::BufferTextureRef &texture, GLenum format, const void *data, size_t bytes )
+{
+	if ( ! buffer || bytes > buffer->getSize() ) {
+		size_t capacity = 256;
+		while ( capacity < bytes ) capacity *= 2;
+		if ( ! buffer ) {
+			buffer	= gl::BufferObj::create( GL_TEXTURE_BUFFER, capacity, nullptr, GL_STREAM_DRAW );
+			texture	= gl::BufferTexture::create( buffer, format );
+		} else {
+			buffer->bufferData( capacity, nullptr, GL_STREAM_DRAW );
+		}
+	}
 
+	if ( bytes > 0 ) {
+		buffer->bufferSubData( 0, bytes, data );
+	}
 }
 
-gl::GlslProgRef loadGlslProg( const gl::GlslProg::Format& format )
+// Vertex format of the shared geometry drawn by the multi-draw G-buffer pass
+struct IndirectVertex
 {
-    return gl::GlslProg::create( format );
+	vec3	position;
+	vec3	normal;
+	vec4	color;
+	vec2	uv;
 };
 
+// Reads an attribute of every vertex in mesh. Components the mesh doesn't
+// have are taken from value.
+vector< vec4 > readVertexAttrib( const gl::VboMeshRef &mesh, geom::Attrib attrib, const vec4 &value )
+{
+	vector< vec4 > result( mesh->getNumVertices(), value );
+	geom::AttribInfo info;
+	gl::VboRef vbo;
+	if ( result.empty() || ! mesh->findAttrib( attrib, &info, &vbo ) ) {
+		return result;
+	}
+
+	const uint8_t dims	= math< uint8_t >::min( info.getDims(), 4 );
+	const size_t stride	= info.getStride() > 0 ? info.getStride() : info.getDims() * sizeof( float );
+	const uint8_t* ptr	= (const uint8_t*)vbo->map( GL_READ_ONLY ) + info.getOffset();
+	for ( vec4 &v : result ) {
+		const float* f = (const float*)ptr;
+		for ( uint8_t j = 0; j < dims; ++j ) {
+			v[ j ] = f[ j ];
+		}
+		ptr += stride;
+	}
+	vbo->unmap();
+
+	return result;
+}
+
+// Returns mesh's indices as 32-bit values, or a sequence for meshes which
+// aren't indexed
+vector< uint32_t > readIndices( const gl::VboMeshRef &mesh )
+{
+	vector< uint32_t > result;
+	if ( mesh->getNumIndices() == 0 ) {
+		result.resize( mesh->getNumVertices() );
+		for ( uint32_t i = 0; i < (uint32_t)result.size(); ++i ) {
+			result[ i ] = i;
+		}
+		return result;
+	}
+
+	result.resize( mesh->getNumIndices() );
+	const void* data = mesh->getIndexVbo()->map( GL_READ_ONLY );
+	switch ( mesh->getIndexDataType() ) {
+	case GL_UNSIGNED_BYTE:
+		copy( (const uint8_t*)data, (const uint8_t*)data + result.size(), result.begin() );
+		break;
+	case GL_UNSIGNED_SHORT:
+		copy( (const uint16_t*)data, (const uint16_t*)data + result.size(), result.begin() );
+		break;
+	default:
+		copy( (const uint32_t*)data, (const uint32_t*)data + result.size(), result.begin() );
+		break;
+	}
+	mesh->getIndexVbo()->unmap();
+
+	return result;
+}
+
+gl::GlslProgRef DeferredRenderer::loadGlslProg( const gl::GlslProg::Format& format )
+{
+    return mProgramCache.create( format );
+}
+
+void DeferredRenderer::queueGlslProg( const gl::GlslProg::Format& format, const ProgramQueue::Callback &onReady )
+{
+    if ( mProgramQueue ) {
+        mProgramQueue->push( format, onReady );
+    } else {
+        onReady( loadGlslProg( format ) );
+    }
+}
+
+bool DeferredRenderer::isPipelineComplete() const
+{
+    for ( int32_t i = 0; i < Effect_Count; ++i ) {
+        if ( isEffectEnabled( (Effect)i ) && ! isEffectReady( (Effect)i ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeferredRenderer::isEffectEnabled( Effect effect ) const
+{
+    switch ( effect ) {
+    case Effect_AoComposite:
+        return mAo != Ao_None;
+    case Effect_Hbao:
+        return mAo == Ao_Hbao;
+    case Effect_Sao:
+        return mAo == Ao_Sao;
+    case Effect_Bloom:
+        return mEnabledBloom;
+    case Effect_Color:
+        return mEnabledColor;
+    case Effect_Debug:
+        return mDrawDebug || mDrawAo;
+    case Effect_DoF:
+        return mEnabledDoF;
+    case Effect_Fog:
+        return mEnabledFog;
+    case Effect_Fxaa:
+        return mEnabledFxaa;
+    case Effect_Ray:
+        return mEnabledRay;
+    default:
+        return false;
+    }
+}
+
+bool DeferredRenderer::updateEffects()
+{
+    bool changed = false;
+    for ( int32_t i = 0; i < Effect_Count; ++i ) {
+        EffectPrograms &effect	= mEffects[ i ];
+        const bool enabled		= isEffectEnabled( (Effect)i );
+        if ( enabled && ! effect.requested ) {
+            effect.requested = true;
+            for ( const EffectProgram &program : effect.programs ) {
+                gl::BatchRef* batch		= program.batch;
+                gl::VboMeshRef mesh		= program.mesh;
+                queueGlslProg( program.format, [ batch, mesh ]( const gl::GlslProgRef &glsl )
+                {
+                    *batch = gl::Batch::create( mesh, glsl );
+                } );
+            }
+        } else if ( ! enabled && effect.ready && mReleaseDisabledEffects ) {
+            for ( const EffectProgram &program : effect.programs ) {
+                *program.batch = nullptr;
+            }
+            effect.requested	= false;
+            effect.ready		= false;
+        }
+
+        // Programs may still be building on the queue's thread
+        if ( effect.requested && ! effect.ready ) {
+            effect.ready = true;
+            for ( const EffectProgram &program : effect.programs ) {
+                effect.ready = effect.ready && *program.batch;
+            }
+            changed = changed || effect.ready;
+        }
+    }
+    return changed;
+}
+
 void DeferredRenderer::createBatches( const ivec2& windowSize )
 {
     /*
@@ -111,9 +501,9 @@ void DeferredRenderer::createBatches( const ivec2& windowSize )
     DataSourceRef fragDeferredDebug			= loadAsset( "shaders/deferred/debug.frag" );
     DataSourceRef fragDeferredEmissive		= loadAsset( "shaders/deferred/emissive.frag" );
     DataSourceRef fragDeferredGBuffer		= loadAsset( "shaders/deferred/gbuffer.frag" );
+    DataSourceRef fragDeferredLBufferClustered	= loadAsset( "shaders/deferred/lbuffer_clustered.frag" );
     DataSourceRef fragDeferredLBufferLight	= loadAsset( "shaders/deferred/lbuffer_light.frag" );
     DataSourceRef fragDeferredLBufferShadow	= loadAsset( "shaders/deferred/lbuffer_shadow.frag" );
-    DataSourceRef fragDeferredShadowMap		= loadAsset( "shaders/deferred/shadow_map.frag" );
     DataSourceRef fragPostColor				= loadAsset( "shaders/post/color.frag" );
     DataSourceRef fragPostDof				= loadAsset( "shaders/post/dof.frag" );
     DataSourceRef fragPostFog				= loadAsset( "shaders/post/fog.frag" );
@@ -122,107 +512,40 @@ void DeferredRenderer::createBatches( const ivec2& windowSize )
     DataSourceRef fragRayOcclude			= loadAsset( "shaders/ray/occlude.frag" );
     DataSourceRef fragRayScatter			= loadAsset( "shaders/ray/scatter.frag" );
 	DataSourceRef fragRayLight				= loadAsset( "shaders/ray/light.frag" );
-    DataSourceRef fragComposite             = loadAsset( "shaders/post/composite.frag" );
 
     DataSourceRef vertDeferredGBuffer		= loadAsset( "shaders/deferred/gbuffer.vert" );
     DataSourceRef vertDeferredLBufferLight	= loadAsset( "shaders/deferred/lbuffer_light.vert" );
 	DataSourceRef vertRayLight				= loadAsset( "shaders/ray/light.vert" );
 	DataSourceRef vertPassThrough			= loadAsset( "shaders/common/pass_through.vert" );
 
-    // Create GLSL programs
-    string numLights				= toString( mScene.mLightData.size() );
-	string numRayLights				= toString( mScene.mRayLightData.size() );
-    string numMaterials				= toString( mScene.mMaterialData.size() );
+    // Programs of optional passes may be built on a worker thread, so that
+    // the first frames can be drawn without them
+    mProgramQueue.reset();
+    if ( mEnabledAsyncCompile ) {
+        mProgramQueue.reset( new ProgramQueue( mProgramCache ) );
+    }
+
+    // Create the GLSL programs every frame needs
     int32_t version					= 330;
-    gl::GlslProgRef aoComposite		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragAoComposite )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef aoHbao			= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragAoHbaoAo )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef aoHbaoBlur		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragAoHbaoBlur )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef aoSaoAo			= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragAoSaoAo ) );
-    gl::GlslProgRef aoSaoBlur		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragAoSaoBlur )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef aoSaoCsz		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragAoSaoCsz )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef bloomBlur		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragBloomBlur )
-                                                   .define( "TEX_COORD" ) );
     gl::GlslProgRef bloomComposite	= loadGlslProg( gl::GlslProg::Format().version( version )
                                                    .vertex( vertPassThrough ).fragment( fragBloomComposite )
                                                    .define( "TEX_COORD" ) );
-    gl::GlslProgRef bloomHighpass	= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragBloomHighpass )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef debug			= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragDeferredDebug )
-                                                   .define( "TEX_COORD" ).define( "NUM_MATERIALS", numMaterials ) );
     gl::GlslProgRef emissive		= loadGlslProg( gl::GlslProg::Format().version( version )
                                                    .vertex( vertPassThrough ).fragment( fragDeferredEmissive )
-                                                   .define( "TEX_COORD" ).define( "NUM_MATERIALS", numMaterials ) );
-    gl::GlslProgRef gBuffer			= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertDeferredGBuffer ).fragment( fragDeferredGBuffer ) );
-    gl::GlslProgRef gBufferInvNorm	= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertDeferredGBuffer ).fragment( fragDeferredGBuffer )
-                                                   .define( "INVERT_NORMAL" ) );
-    gl::GlslProgRef gBufferInst     = loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertDeferredGBuffer ).fragment( fragDeferredGBuffer )
-                                                   .define( "INSTANCED_MODEL" ) );
+                                                   .define( "TEX_COORD" ) );
     gl::GlslProgRef gBufferInstLS	= loadGlslProg( gl::GlslProg::Format().version( version )
                                                    .vertex( vertDeferredGBuffer ).fragment( fragDeferredGBuffer )
-                                                   .define( "INSTANCED_LIGHT_SOURCE" ).define( "NUM_LIGHTS", numLights ) );
+                                                   .define( "INSTANCED_LIGHT_SOURCE" ) );
     gl::GlslProgRef lBufferLight	= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertDeferredLBufferLight ).fragment( fragDeferredLBufferLight )
-                                                   .define( "NUM_MATERIALS", numMaterials )
-                                                   .define( "NUM_LIGHTS", numLights ) );
+                                                   .vertex( vertDeferredLBufferLight ).fragment( fragDeferredLBufferLight ) );
+    gl::GlslProgRef lBufferClustered	= loadGlslProg( gl::GlslProg::Format().version( version )
+                                                   .vertex( vertPassThrough ).fragment( fragDeferredLBufferClustered ) );
     gl::GlslProgRef lBufferShadow	= loadGlslProg( gl::GlslProg::Format().version( version )
                                                    .vertex( vertPassThrough ).fragment( fragDeferredLBufferShadow ) );
-    gl::GlslProgRef shadowMapInst	= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragDeferredShadowMap )
-                                                   .define( "INSTANCED_MODEL" ) );
-    gl::GlslProgRef postColor		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragPostColor )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef postDof			= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragPostDof )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef postFog			= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragPostFog )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef postFxaa		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragPostFxaa )
-                                                   .define( "TEX_COORD" ) );
-	gl::GlslProgRef rayLight		= numRayLights == "0" ? nullptr : loadGlslProg( gl::GlslProg::Format().version( version )
-												   .vertex( vertRayLight ).fragment( fragRayLight )
-												   .define( "NUM_LIGHTS", numRayLights ) );
-    gl::GlslProgRef rayComposite	= numRayLights == "0" ? nullptr : loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragRayComposite )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef rayOcclude		= numRayLights == "0" ? nullptr : loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragRayOcclude )
-                                                   .define( "TEX_COORD" ) );
-    gl::GlslProgRef rayScatter		= numRayLights == "0" ? nullptr : loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragRayScatter )
-												   .define( "NUM_LIGHTS", numRayLights )
-												   .define( "TEX_COORD" ) );
-
-    gl::GlslProgRef composite       = loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragComposite )
-                                                   .define( "TEX_COORD" ) );
 
     gl::GlslProgRef stockColor		= gl::context()->getStockShader( gl::ShaderDef().color() );
     gl::GlslProgRef stockTexture	= gl::context()->getStockShader( gl::ShaderDef().texture( GL_TEXTURE_2D ) );
 
-    // Unused in this sample - use this shader to draw a shadow caster without instancing
-    gl::GlslProgRef shadowMap		= loadGlslProg( gl::GlslProg::Format().version( version )
-                                                   .vertex( vertPassThrough ).fragment( fragDeferredShadowMap ) );
-
     // Create geometry as VBO meshes
     gl::VboMeshRef cylinder		= gl::VboMesh::create( geom::Cylinder().subdivisionsAxis( 5 ).subdivisionsHeight( 1 ) );
     gl::VboMeshRef cube			= gl::VboMesh::create( geom::Cube().size( vec3( 2.0f ) ) );
@@ -231,61 +554,89 @@ void DeferredRenderer::createBatches( const ivec2& windowSize )
     gl::VboMeshRef sphereLow	= gl::VboMesh::create( geom::Sphere().subdivisions( 12 ) );
 
     // Create batches of VBO meshes and GLSL programs
-    mBatchAoCompositeRect			= gl::Batch::create( rect,		aoComposite );
-    mBatchBloomBlurRect				= gl::Batch::create( rect,		bloomBlur );
     mBatchBloomCompositeRect		= gl::Batch::create( rect,		bloomComposite );
-    mBatchBloomHighpassRect			= gl::Batch::create( rect,		bloomHighpass );
-    mBatchColorRect					= gl::Batch::create( rect,		postColor );
-    mBatchDebugRect					= gl::Batch::create( rect,		debug );
-    mBatchDofRect					= gl::Batch::create( rect,		postDof );
-    mBatchFogRect					= gl::Batch::create( rect,		postFog );
     mBatchEmissiveRect				= gl::Batch::create( rect,		emissive );
-    mBatchFxaaRect					= gl::Batch::create( rect,		postFxaa );
     mBatchGBufferLightSourceSphere	= gl::Batch::create( sphere,	gBufferInstLS );
-    mBatchHbaoAoRect				= gl::Batch::create( rect,		aoHbao );
-    mBatchHbaoBlurRect				= gl::Batch::create( rect,		aoHbaoBlur );
+    mBatchLBufferClusteredRect		= gl::Batch::create( rect,		lBufferClustered );
     mBatchLBufferLightCube			= gl::Batch::create( cube,		lBufferLight );
     mBatchLBufferShadowRect			= gl::Batch::create( rect,		lBufferShadow );
-    mBatchRayCompositeRect			= rayComposite ? gl::Batch::create( rect,		rayComposite ) : nullptr;
-    mBatchRayOccludeRect			= rayOcclude ? gl::Batch::create(	rect,		rayOcclude ) : nullptr;
-    mBatchRayScatterRect			= rayScatter ? gl::Batch::create(	rect,		rayScatter ) : nullptr;
-	mBatchRayLightSphere			= rayLight ? gl::Batch::create(		sphereLow,	rayLight ) : nullptr;
-	mBatchSaoAoRect					= gl::Batch::create( rect,		aoSaoAo );
-    mBatchSaoBlurRect				= gl::Batch::create( rect,		aoSaoBlur );
-    mBatchSaoCszRect				= gl::Batch::create( rect,		aoSaoCsz );
     mBatchStockColorRect			= gl::Batch::create( rect,		stockColor );
 	mBatchStockColorSphere			= gl::Batch::create( sphereLow, stockColor );
     mBatchStockTextureRect			= gl::Batch::create( rect,		stockTexture );
 
-    // Create scene batches
-    // Create uniform buffer objects for lights and materials
-	mScene.mUboLight = gl::Ubo::create( sizeof( Light ) * mScene.mLightData.size(), mScene.mLightData.data() );
-	mScene.mUboRayLight = mBatchRayLightSphere ? gl::Ubo::create( sizeof( Light ) * mScene.mRayLightData.size(), mScene.mRayLightData.data() ) : nullptr;
-
-    mScene.mUboMaterial = gl::Ubo::create( sizeof( Material ) * mScene.mMaterialData.size(), mScene.mMaterialData.data() );
-
-    for ( auto &model : mScene.mInstancedModels ) {
-        
-        auto shaderRef = gBufferInst;
-        if ( model->hasShader() ) {
-            shaderRef = model->getShader();
-        }
-        auto gbatch = gl::Batch::create( model->getMesh() , shaderRef, {
-            { geom::Attrib::CUSTOM_0, "vInstanceModelMatrix" },
-            { geom::Attrib::CUSTOM_1, "vInstanceNormalMatrix" },
-            { geom::Attrib::CUSTOM_2, "vInstanceModelViewMatrix" }
-        } );
-        mBatchGBuffers.push_back( InstancedModelBatch{ model, gbatch } );
-
+    // Describe the programs of optional passes. They are built by
+    // updateEffects() once their effect is enabled.
+    auto add = [ & ]( Effect effect, gl::BatchRef &batch, const gl::VboMeshRef &mesh, const gl::GlslProg::Format &format )
+    {
+        batch = nullptr;
+        EffectProgram program;
+        program.format	= format;
+        program.mesh	= mesh;
+        program.batch	= &batch;
+        mEffects[ effect ].programs.push_back( program );
+    };
+    for ( EffectPrograms &effect : mEffects ) {
+        effect = EffectPrograms();
+    }
+    add( Effect_AoComposite, mBatchAoCompositeRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragAoComposite )
+        .define( "TEX_COORD" ) );
+    add( Effect_Hbao, mBatchHbaoAoRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragAoHbaoAo )
+        .define( "TEX_COORD" ) );
+    add( Effect_Hbao, mBatchHbaoBlurRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragAoHbaoBlur )
+        .define( "TEX_COORD" ) );
+    add( Effect_Sao, mBatchSaoAoRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragAoSaoAo ) );
+    add( Effect_Sao, mBatchSaoBlurRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragAoSaoBlur )
+        .define( "TEX_COORD" ) );
+    add( Effect_Sao, mBatchSaoCszRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragAoSaoCsz )
+        .define( "TEX_COORD" ) );
+    add( Effect_Bloom, mBatchBloomBlurRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragBloomBlur )
+        .define( "TEX_COORD" ) );
+    add( Effect_Bloom, mBatchBloomHighpassRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragBloomHighpass )
+        .define( "TEX_COORD" ) );
+    add( Effect_Debug, mBatchDebugRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragDeferredDebug )
+        .define( "TEX_COORD" ) );
+    add( Effect_Color, mBatchColorRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragPostColor )
+        .define( "TEX_COORD" ) );
+    add( Effect_DoF, mBatchDofRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragPostDof )
+        .define( "TEX_COORD" ) );
+    add( Effect_Fog, mBatchFogRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragPostFog )
+        .define( "TEX_COORD" ) );
+    add( Effect_Fxaa, mBatchFxaaRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragPostFxaa )
+        .define( "TEX_COORD" ) );
+    add( Effect_Ray, mBatchRayLightSphere, sphereLow, gl::GlslProg::Format().version( version )
+        .vertex( vertRayLight ).fragment( fragRayLight ) );
+    add( Effect_Ray, mBatchRayCompositeRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragRayComposite )
+        .define( "TEX_COORD" ) );
+    add( Effect_Ray, mBatchRayOccludeRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragRayOcclude )
+        .define( "TEX_COORD" ) );
+    add( Effect_Ray, mBatchRayScatterRect, rect, gl::GlslProg::Format().version( version )
+        .vertex( vertPassThrough ).fragment( fragRayScatter )
+        .define( "TEX_COORD" ) );
+    updateEffects();
 
-        auto sbatch = gl::Batch::create( model->getMesh() , shaderRef, {
-            { geom::Attrib::CUSTOM_0, "vInstanceModelMatrix" },
-            { geom::Attrib::CUSTOM_1, "vInstanceNormalMatrix" },
-            { geom::Attrib::CUSTOM_2, "vInstanceModelViewMatrix" }
-        } );
-        mBatchShadowMaps.push_back( InstancedModelBatch{ model, sbatch } );
+    // Create scene batches
+    // Create texture buffers for lights and materials. These grow on their
+    // own in update() as objects are added.
+	mScene.mLightBuffer.update( mScene.mLightData );
+	mScene.mRayLightBuffer.update( mScene.mRayLightData );
+	mScene.mMaterialBuffer.update( mScene.mMaterialData );
 
-    }
+    createInstanceBatches();
 
     // Set uniforms that don't need per-frame updates
     setUniforms( windowSize );
@@ -298,7 +649,12 @@ void DeferredRenderer::draw()
 
 void DeferredRenderer::draw( const Rectf &rect )
 {
-	if ( ! mFboGBuffer ) return;
+	if ( ! mFboAccum ) return;
+
+	// Models may have been removed since update()
+	removeStaleBatches();
+
+    mProfiler.beginFrame();
 
     //////////////////////////////////////////////////////////////////////////////////////////////
     /* DEFERRED SHADING PIPELINE
@@ -308,7 +664,7 @@ void DeferredRenderer::draw( const Rectf &rect )
      * a second pass when lights are drawn.
      *
      * This scene is rendered into a frame buffer with multiple attachments
-     * (G-buffer). Uniform buffer objects are used to store a database of
+     * (G-buffer). Texture buffer objects are used to store a database of
      * material and light data on the GPU; reducing drawing overhead.
      * Shadow casters are rendered into a shadow map FBO. The buffers are
      * read while drawing light volumes into the light buffer (L-buffer)
@@ -327,8 +683,83 @@ void DeferredRenderer::draw( const Rectf &rect )
     const vec2 projectionParams		= vec2( f / ( f - n ), ( -f * n ) / ( f - n ) );
     const mat4 projMatrixInverse	= glm::inverse( mScene.mCamera.getProjectionMatrix() );
 
-	mScene.getUboLight()->bindBufferBase( UBO_LOCATION_LIGHTS );
-	mScene.getUboMaterial()->bindBufferBase( UBO_LOCATION_MATERIALS );
+    // Effects whose programs are still being built are skipped
+    const bool aoReady		= isEffectReady( Effect_AoComposite ) && isEffectReady( mAo == Ao_Hbao ? Effect_Hbao : Effect_Sao );
+    const Ao ao				= aoReady ? mAo : Ao_None;
+    const bool bloom		= mEnabledBloom && isEffectReady( Effect_Bloom );
+    const bool color		= mEnabledColor && isEffectReady( Effect_Color );
+    const bool dof			= mEnabledDoF && isEffectReady( Effect_DoF );
+    const bool fog			= mEnabledFog && isEffectReady( Effect_Fog );
+    const bool fxaa			= mEnabledFxaa && isEffectReady( Effect_Fxaa );
+    const bool ray			= mEnabledRay && isEffectReady( Effect_Ray ) && ! mScene.mRayLightData.empty();
+    const bool drawAo		= mDrawAo && ao != Ao_None && isEffectReady( Effect_Debug );
+    const bool drawDebug	= mDrawDebug && isEffectReady( Effect_Debug );
+
+	mScene.getLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
+	mScene.getMaterialBuffer().bindTexture( TEXTURE_UNIT_MATERIALS );
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    /* CULLING
+     *
+     * Instances are tested against the camera's frustum on the CPU, and shadow casters against
+     * the shadow camera's. Only the survivors are packed into each batch's instance buffer, so
+     * the vertex workload scales with what is visible rather than with the size of the scene.
+     *
+     * Light volumes are culled the same way. The indices of visible lights are written to a
+     * buffer which the L-buffer pass reads by instance ID, so lights behind the camera are
+     * never rasterized.
+     */
+
+    mProfiler.begin( "Culling" );
+    mUploadedInstanceBytes	= 0;
+    mDrawnInstanceCount		= 0;
+    if ( mEnabledStreaming ) {
+        mInstanceRegion = ( mInstanceRegion + 1 ) % kNumInstanceRegions;
+        waitForInstanceRegion();
+    }
+    {
+        mIndirectCommands.clear();
+        mIndirectDraws.clear();
+        mIndirectDrawIds.clear();
+        mIndirectInstances.clear();
+        mIndirectStaticCopies.clear();
+        mIndirectCommandArrays.clear();
+
+        const ViewFrustum frustum( mScene.mCamera );
+        for ( auto &b : mInstancedModelBatches ) {
+            uploadStaticInstances( b );
+            uploadInstances( b, 0, frustum );
+            mDrawnInstanceCount += b.gBuffer.count + b.gBuffer.staticCount;
+        }
+        if ( mBatchGBufferIndirect ) {
+            uploadIndirect();
+        }
+    }
+    if ( mEnabledShadow ) {
+        const ViewFrustum frustum( mShadowCamera );
+        for ( auto &b : mInstancedModelBatches ) {
+            uploadInstances( b, 1, frustum );
+        }
+    }
+    uploadVisibleLights( ViewFrustum( mScene.mCamera ) );
+    if ( mLighting == Lighting_Clustered ) {
+        uploadLightClusters();
+    }
+    mProfiler.end();
+
+    // The frame is described as passes reading and writing textures. The
+    // graph culls passes whose results go unused, orders the rest and hands
+    // out transient targets, reusing them once nothing reads them anymore.
+    typedef RenderGraph::Handle Handle;
+    typedef RenderGraph::TextureDesc TextureDesc;
+    const TextureDesc colorDesc( mSizeColor, GL_RGB10_A2, GL_FLOAT );
+    const TextureDesc accumDesc( mSizeAccum, GL_RGB10_A2, GL_FLOAT, GL_LINEAR );
+    const TextureDesc aoDesc( mSizeAo, GL_RG32F, GL_FLOAT, GL_LINEAR );
+    const TextureDesc rayDesc( mSizeRay, GL_RGB10_A2, GL_FLOAT, GL_LINEAR );
+
+    mGraph.clear();
+    Handle accum		= mGraph.importTexture( "Accumulation", mFboAccum->getColorTexture() );
+    Handle shadowMap	= mGraph.importTexture( "Shadow map", mFboShadowMap->getDepthTexture() );
 
     //////////////////////////////////////////////////////////////////////////////////////////////
     /* G-BUFFER
@@ -342,63 +773,117 @@ void DeferredRenderer::draw( const Rectf &rect )
      *
      * "unpack.glsl" contains methods for decoding normals and calculating 3D positions from
      * depth and camera data. The material ID represents the index of a material in our
-     * UBO. This allows models to access information for diffuse, specular, shininess, etc
+     * material buffer. This allows models to access information for diffuse, specular, shininess, etc
      * values without having to store them in a texture.
      */
 
+    Handle albedo	= mGraph.createTexture( "Albedo",		TextureDesc( mSizeGBuffer, GL_RGB10_A2,				GL_FLOAT ) );
+    Handle material	= mGraph.createTexture( "Material ID",	TextureDesc( mSizeGBuffer, GL_R16I,					GL_SHORT ) );
+    Handle normal	= mGraph.createTexture( "Normal",		TextureDesc( mSizeGBuffer, GL_RG16F,				GL_BYTE ) );
+    Handle depth	= mGraph.createTexture( "Depth",		TextureDesc( mSizeGBuffer, GL_DEPTH_COMPONENT32F,	GL_FLOAT, GL_LINEAR ) );
     {
-        const gl::ScopedFramebuffer scopedFrameBuffer( mFboGBuffer );
-        const static GLenum buffers[] = {
-            GL_COLOR_ATTACHMENT0,	// Albedo (color)
-            GL_COLOR_ATTACHMENT1, 	// Encoded normal
-            GL_COLOR_ATTACHMENT2 	// Material ID
-        };
-        gl::drawBuffers( 3, buffers );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboGBuffer->getSize() );
-        gl::clear();
-        const gl::ScopedMatrices scopedMatrices;
-        gl::setMatrices( mScene.mCamera );
-        gl::enableDepthRead();
-        gl::enableDepthWrite();
+        RenderGraph::PassBuilder builder = mGraph.addPass( "G-buffer", [ this ]( const RenderGraph& )
+        {
+            gl::clear();
+            gl::setMatrices( mScene.mCamera );
+            gl::enableDepthRead();
+            gl::enableDepthWrite();
 
-        ////// BEGIN DRAW STUFF ////////////////////////////////////////////////
+            ////// BEGIN DRAW STUFF ////////////////////////////////////////////////
+
+            // Draw shadow casters
+            const gl::ScopedFaceCulling scopedFaceCulling( true, GL_BACK );
+
+#if defined( GL_DRAW_INDIRECT_BUFFER )
+            if ( mBatchGBufferIndirect && ! mIndirectCommands.empty() ) {
+                const gl::ScopedTextureBind scopedTextureBind0( mTextureIndirect, 0 );
+                const gl::ScopedTextureBind scopedTextureBind1( mTextureCubeMapIndirect, 1 );
+                const gl::ScopedTextureBind scopedTextureBind10( GL_TEXTURE_BUFFER, mTextureIndirectDraws->getId(), TEXTURE_UNIT_DRAWS );
+                const gl::ScopedVao scopedVao( mBatchGBufferIndirect->getVao() );
+                const gl::ScopedGlslProg scopedGlslProg( mBatchGBufferIndirect->getGlslProg() );
+                const gl::ScopedBuffer scopedBuffer( mBufferIndirectCommands );
+                gl::setDefaultShaderVars();
+                for ( const IndirectRange &range : mIndirectRanges ) {
+                    if ( range.array >= 0 ) {
+                        mScene.mTextureArrays.getTexture( range.array )->bind( TEXTURE_UNIT_TEXTURE_ARRAY );
+                    }
+                    glMultiDrawElementsIndirect( GL_TRIANGLES, GL_UNSIGNED_INT,
+                                                 (const void*)( range.first * sizeof( DrawElementsIndirectCommand ) ), range.count, 0 );
+                }
+                if ( mIndirectRanges.back().array >= 0 ) {
+                    mScene.mTextureArrays.getTexture( mIndirectRanges.back().array )->unbind( TEXTURE_UNIT_TEXTURE_ARRAY );
+                }
+            }
+#endif
+
+            // Textures stay bound until a model needs different ones
+            gl::TextureBaseRef boundTexture;
+            gl::TextureBaseRef boundCubeMap;
+            int32_t boundArray = -1;
+            for ( const auto &b : mInstancedModelBatches ) {
+                const InstancedModelPass &pass = b.gBuffer;
+                if ( b.indirect || ( pass.count == 0 && pass.staticCount == 0 ) ) continue;
+                const InstancedModel &model = b.obj.get();
+
+                if ( model.getTexture() != boundTexture ) {
+                    if ( model.hasTexture() ) {
+                        model.getTexture()->bind( 0 );
+                    } else {
+                        boundTexture->unbind( 0 );
+                    }
+                    boundTexture = model.getTexture();
+                }
 
-        // Draw shadow casters
-        const gl::ScopedFaceCulling scopedFaceCulling( true, GL_BACK );
+                if ( model.getTextureCubeMap() != boundCubeMap ) {
+                    if ( model.hasTextureCubeMap() ) {
+                        model.getTextureCubeMap()->bind( 1 );
+                    } else {
+                        boundCubeMap->unbind( 1 );
+                    }
+                    boundCubeMap = model.getTextureCubeMap();
+                }
 
-        for ( const auto &b : mBatchGBuffers ) {
-            if ( ! b.obj.isVisible() ) continue;
+                const TextureLayer &layer = model.getTextureLayer();
+                if ( layer.isValid() && layer.array != boundArray ) {
+                    mScene.mTextureArrays.getTexture( layer.array )->bind( TEXTURE_UNIT_TEXTURE_ARRAY );
+                    boundArray = layer.array;
+                }
 
-            if ( b.obj->hasTexture() ) {
-                b.obj->getTexture()->bind( 0 );
+                // Custom shaders are only told about layers when a model has one
+                if ( ! model.hasShader() || layer.isValid() ) {
+                    pass.batch->getGlslProg()->uniform( "uTextureLayer", layer.isValid() ? layer.layer : -1 );
+                }
+                pass.batch->getGlslProg()->uniform( "uTextureMatrix", model.getTextureMatrix() );
+                pass.batch->getGlslProg()->uniform( "uMaterialId", model.getMaterialId() );
+                if ( pass.count > 0 ) {
+                    pass.batch->drawInstanced( pass.count );
+                }
+                if ( pass.staticCount > 0 ) {
+                    pass.staticBatch->drawInstanced( pass.staticCount );
+                }
             }
-
-            if ( b.obj->hasTextureCubeMap() ) {
-                b.obj->getTextureCubeMap()->bind( 1 );
+            if ( boundTexture ) {
+                boundTexture->unbind( 0 );
             }
-
-            b.batch->getGlslProg()->uniform( "uTextureMatrix", b.obj->getTextureMatrix() );
-            b.batch->getGlslProg()->uniform( "uMaterialId", b.obj->getMaterialId() );
-            b.batch->drawInstanced( b.obj->size() );
-
-            if ( b.obj->hasTexture() ) {
-                b.obj->getTexture()->unbind();
+            if ( boundCubeMap ) {
+                boundCubeMap->unbind( 1 );
             }
-
-            if ( b.obj->hasTextureCubeMap() ) {
-                b.obj->getTextureCubeMap()->unbind();
+            if ( boundArray >= 0 ) {
+                mScene.mTextureArrays.getTexture( boundArray )->unbind( TEXTURE_UNIT_TEXTURE_ARRAY );
             }
-        }
-
-        // Draw light sources
-        mBatchGBufferLightSourceSphere->getGlslProg()->uniform( "uMaterialId", mLightMaterialId );
-		mBatchGBufferLightSourceSphere->drawInstanced( (GLsizei)mScene.mLightData.size() );
 
-        ////// END DRAW STUFF //////////////////////////////////////////////////
+            // Draw light sources
+            mBatchGBufferLightSourceSphere->getGlslProg()->uniform( "uMaterialId", mLightMaterial.getId() );
+            mBatchGBufferLightSourceSphere->drawInstanced( (GLsizei)mScene.mLightData.size() );
 
+            ////// END DRAW STUFF //////////////////////////////////////////////////
+        } );
+        albedo		= builder.write( albedo );
+        material	= builder.write( material );
+        normal		= builder.write( normal );
+        depth		= builder.write( depth );
     }
 
-
     //////////////////////////////////////////////////////////////////////////////////////////////
     /* SHADOW MAP
      *
@@ -408,18 +893,23 @@ void DeferredRenderer::draw( const Rectf &rect )
 
     // Draw shadow casters into framebuffer from view of shadow camera
     if ( mEnabledShadow ) {
-        const gl::ScopedFramebuffer scopedFrameBuffer( mFboShadowMap );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboShadowMap->getSize() );
-        const gl::ScopedMatrices scopedMatrices;
-        gl::enableDepthRead();
-        gl::enableDepthWrite();
-        gl::clear();
-        gl::setMatrices( mShadowCamera );
+        shadowMap = mGraph.addPass( "Shadow map", [ this ]( const RenderGraph& )
+        {
+            gl::enableDepthRead();
+            gl::enableDepthWrite();
+            gl::clear( GL_DEPTH_BUFFER_BIT );
+            gl::setMatrices( mShadowCamera );
 
-        for ( const auto &b : mBatchShadowMaps ) {
-            if ( ! b.obj.isVisible() ) continue;
-            b.batch->drawInstanced( b.obj->size() );
-        }
+            for ( const auto &b : mInstancedModelBatches ) {
+                const InstancedModelPass &pass = b.shadowMap;
+                if ( pass.count > 0 ) {
+                    pass.batch->drawInstanced( pass.count );
+                }
+                if ( pass.staticCount > 0 ) {
+                    pass.staticBatch->drawInstanced( pass.staticCount );
+                }
+            }
+        } ).write( shadowMap );
     }
 
     //////////////////////////////////////////////////////////////////////////////////////////////
@@ -435,62 +925,78 @@ void DeferredRenderer::draw( const Rectf &rect )
      * the overhead of implementing shadows low.
      */
 
-    size_t ping = 0;
-    size_t pong = 1;
-
+    Handle lBuffer = mGraph.createTexture( "L-buffer", colorDesc );
     {
-        const gl::ScopedFramebuffer scopedFrameBuffer( mFboPingPong );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboPingPong->getSize() );
+        RenderGraph::PassBuilder builder = mGraph.addPass( "L-buffer", [ = ]( const RenderGraph &graph )
         {
-            const static GLenum buffers[] = {
-                GL_COLOR_ATTACHMENT0,
-                GL_COLOR_ATTACHMENT1
-            };
-            gl::drawBuffers( 2, buffers );
             gl::clear();
-        }
+            gl::enableDepthRead();
 
-        gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-        gl::enableDepthRead();
+            // Draw light volumes into L-buffer, reading G-buffer to perform shading
+            if ( mLighting == Lighting_Volumes ) {
+                gl::enableDepthWrite();
+                const gl::ScopedMatrices scopedMatrices;
+                gl::setMatrices( mScene.mCamera );
+                const gl::ScopedFaceCulling scopedFaceCulling( true, GL_FRONT );
+                const gl::ScopedBlendAdditive scopedBlendAdditive;
+                const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( albedo ),		0 );
+                const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( material ),	1 );
+                const gl::ScopedTextureBind scopedTextureBind2( graph.getTexture( normal ),		2 );
+                const gl::ScopedTextureBind scopedTextureBind3( graph.getTexture( depth ),		3 );
+                const gl::ScopedTextureBind scopedTextureBind13( GL_TEXTURE_BUFFER, mTextureVisibleLights->getId(), TEXTURE_UNIT_LIGHT_INDICES );
+
+                mBatchLBufferLightCube->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
+                mBatchLBufferLightCube->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
+                mBatchLBufferLightCube->getGlslProg()->uniform( "uViewMatrix",			mScene.mCamera.getViewMatrix() );
+                mBatchLBufferLightCube->drawInstanced( (GLsizei)mVisibleLightIndices.size() );
+            }
 
-        // Draw light volumes into L-buffer, reading G-buffer to perform shading
-        {
-            gl::enableDepthWrite();
-            const gl::ScopedMatrices scopedMatrices;
-            gl::setMatrices( mScene.mCamera );
-            const gl::ScopedFaceCulling scopedFaceCulling( true, GL_FRONT );
-            const gl::ScopedBlendAdditive scopedBlendAdditive;
-            const gl::ScopedTextureBind scopedTextureBind0( mTextureFboGBuffer[ 0 ],		0 );
-            const gl::ScopedTextureBind scopedTextureBind1( mTextureFboGBuffer[ 1 ],		1 );
-            const gl::ScopedTextureBind scopedTextureBind2( mTextureFboGBuffer[ 2 ],		2 );
-            const gl::ScopedTextureBind scopedTextureBind3( mFboGBuffer->getDepthTexture(),	3 );
-
-            mBatchLBufferLightCube->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
-            mBatchLBufferLightCube->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
-            mBatchLBufferLightCube->getGlslProg()->uniform( "uViewMatrix",			mScene.mCamera.getViewMatrix() );
-			mBatchLBufferLightCube->drawInstanced( (GLsizei)mScene.mLightData.size() );
-        }
+            // Or shade every pixel once with the lights assigned to its cluster
+            if ( mLighting == Lighting_Clustered ) {
+                gl::disableDepthWrite();
+                const gl::ScopedBlendAdditive scopedBlendAdditive;
+                const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( albedo ),		0 );
+                const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( material ),	1 );
+                const gl::ScopedTextureBind scopedTextureBind2( graph.getTexture( normal ),		2 );
+                const gl::ScopedTextureBind scopedTextureBind3( graph.getTexture( depth ),		3 );
+                const gl::ScopedTextureBind scopedTextureBind11( GL_TEXTURE_BUFFER, mTextureClusters->getId(),		TEXTURE_UNIT_CLUSTERS );
+                const gl::ScopedTextureBind scopedTextureBind12( GL_TEXTURE_BUFFER, mTextureClusterLights->getId(),	TEXTURE_UNIT_CLUSTER_LIGHTS );
+
+                mBatchLBufferClusteredRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
+                mBatchLBufferClusteredRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
+                mBatchLBufferClusteredRect->getGlslProg()->uniform( "uViewMatrix",			mScene.mCamera.getViewMatrix() );
+                mBatchLBufferClusteredRect->getGlslProg()->uniform( "uClusterGrid",			mLightClusters.getGrid() );
+                mBatchLBufferClusteredRect->getGlslProg()->uniform( "uClusterDepth",		mLightClusters.getDepthParams() );
+
+                const gl::ScopedModelMatrix scopedModelMatrix;
+                gl::translate( mWindowSize / 2 );
+                gl::scale( mWindowSize );
+                mBatchLBufferClusteredRect->draw();
+            }
 
-        // Draw shadows onto L-buffer
-        if ( mEnabledShadow ) {
-            gl::disableDepthWrite();
-            const gl::ScopedTextureBind scopedTextureBind0( mFboShadowMap->getDepthTexture(),	0 );
-            const gl::ScopedTextureBind scopedTextureBind1( mFboGBuffer->getDepthTexture(),		1 );
+            // Draw shadows onto L-buffer
+            if ( mEnabledShadow ) {
+                gl::disableDepthWrite();
+                const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( shadowMap ),	0 );
+                const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( depth ),		1 );
 
-            mBatchLBufferShadowRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
-            mBatchLBufferShadowRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
-            mBatchLBufferShadowRect->getGlslProg()->uniform( "uProjView",			mShadowCamera.getProjectionMatrix() * mShadowCamera.getViewMatrix() );
-            mBatchLBufferShadowRect->getGlslProg()->uniform( "uViewMatrixInverse",	mScene.mCamera.getInverseViewMatrix() );
+                mBatchLBufferShadowRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
+                mBatchLBufferShadowRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
+                mBatchLBufferShadowRect->getGlslProg()->uniform( "uProjView",			mShadowCamera.getProjectionMatrix() * mShadowCamera.getViewMatrix() );
+                mBatchLBufferShadowRect->getGlslProg()->uniform( "uViewMatrixInverse",	mScene.mCamera.getInverseViewMatrix() );
 
-            const gl::ScopedBlendAlpha scopedBlendAlpha;
-            const gl::ScopedModelMatrix scopedModelMatrix;
-            gl::translate( mWindowSize / 2 );
-            gl::scale( mWindowSize );
-            mBatchLBufferShadowRect->draw();
+                const gl::ScopedBlendAlpha scopedBlendAlpha;
+                const gl::ScopedModelMatrix scopedModelMatrix;
+                gl::translate( mWindowSize / 2 );
+                gl::scale( mWindowSize );
+                mBatchLBufferShadowRect->draw();
+            }
+        } );
+        builder.read( albedo ).read( material ).read( normal ).read( depth );
+        if ( mEnabledShadow ) {
+            builder.read( shadowMap );
         }
-
-        ping = pong;
-        pong = ( ping + 1 ) % 2;
+        lBuffer = builder.write( lBuffer );
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////
@@ -510,20 +1016,17 @@ void DeferredRenderer::draw( const Rectf &rect )
      *
      * The accumulation buffer is half the size of the window to improve performance.
      * While it can look great even at half size, it looks amazing if you have have the GPU
-     * to pull off the full size window in real time. Try changing the size of mFboAccum in
-     * ::resize() to see how works for you.
+     * to pull off the full size window in real time. Try changing mSizeAccum in ::resize()
+     * to see how works for you.
      */
 
+    accum = mGraph.addPass( "Accumulation", [ = ]( const RenderGraph &graph )
     {
-        const gl::ScopedFramebuffer scopedFrameBuffer( mFboAccum );
-        gl::drawBuffer( GL_COLOR_ATTACHMENT0 );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboAccum->getSize() );
-        const gl::ScopedMatrices scopedMatrices;
-        gl::setMatricesWindow( mFboAccum->getSize() );
+        gl::setMatricesWindow( mSizeAccum );
         gl::disableDepthRead();
         gl::disableDepthWrite();
-        gl::translate( mFboAccum->getSize() / 2 );
-        gl::scale( mFboAccum->getSize() );
+        gl::translate( mSizeAccum / 2 );
+        gl::scale( mSizeAccum );
 
         // Dim the light accumulation buffer to produce trails. Lower alpha
         // makes longer trails.
@@ -534,49 +1037,54 @@ void DeferredRenderer::draw( const Rectf &rect )
         }
 
         // Paint light sources onto the accumulation buffer.
+        const gl::ScopedBlendAdditive scopedBlendAdditive;
+        const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( albedo ),		0 );
+        const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( material ),	1 );
+        mBatchEmissiveRect->draw();
+    } ).read( albedo ).read( material ).read( accum ).write( accum );
+
+    Handle bloomed = accum;
+    if ( bloom ) {
+
+        // First, we run a highpass filter on the L-buffer to draw out luminance.
+        // Next, we add light from the accumulation buffer onto the filtered image.
+        bloomed = mGraph.addPass( "Bloom highpass", [ = ]( const RenderGraph &graph )
         {
-            const gl::ScopedBlendAdditive scopedBlendAdditive;
-            const gl::ScopedTextureBind scopedTextureBind0( mTextureFboGBuffer[ 0 ], 0 );
-            const gl::ScopedTextureBind scopedTextureBind1( mTextureFboGBuffer[ 1 ], 1 );
-            mBatchEmissiveRect->draw();
-        }
-
-        if ( mEnabledBloom ) {
-
-            // First, we run a highpass filter on the L-buffer to draw out luminance.
-            gl::drawBuffer( GL_COLOR_ATTACHMENT2 );
+            gl::setMatricesWindow( mSizeAccum );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
+            gl::translate( mSizeAccum / 2 );
+            gl::scale( mSizeAccum );
             {
-                const gl::ScopedTextureBind scopedTextureBind( mTextureFboPingPong[ pong ], 0 );
+                const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( lBuffer ), 0 );
                 mBatchBloomHighpassRect->draw();
             }
-
-            // Next, we add light from the accumulation buffer onto the filtered image.
             {
                 const gl::ScopedBlendAdditive scopedBlendAdditive;
-                const gl::ScopedTextureBind scopedTextureBind( mTextureFboAccum[ 0 ], 0 );
+                const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( accum ), 0 );
                 mBatchStockTextureRect->draw();
             }
+        } ).read( lBuffer ).read( accum ).write( mGraph.createTexture( "Bloom highpass", accumDesc ) );
 
-			mBatchBloomBlurRect->getGlslProg()->uniform( "uAttenuation", scaleBloomAttenuation( mBloomAttenuation ) );
-			mBatchBloomBlurRect->getGlslProg()->uniform( "uScale", scaleBloomScale( mBloomScale ) );
-
-            // Run a horizontal blur pass
-            {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT1 );
-                mBatchBloomBlurRect->getGlslProg()->uniform( "uAxis", vec2( 1.0f, 0.0f ) );
-                const gl::ScopedTextureBind scopedTextureBind( mTextureFboAccum[ 2 ], 0 );
-                mBatchBloomBlurRect->draw();
-            }
-
-            // Run a vertical blur pass
+        // Run a horizontal, then a vertical blur pass
+        for ( size_t i = 0; i < 2; ++i ) {
+            const vec2 axis		= i == 0 ? vec2( 1.0f, 0.0f ) : vec2( 0.0f, 1.0f );
+            const Handle input	= bloomed;
+            bloomed = mGraph.addPass( i == 0 ? "Bloom blur X" : "Bloom blur Y", [ = ]( const RenderGraph &graph )
             {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT2 );
-                mBatchBloomBlurRect->getGlslProg()->uniform( "uAxis", vec2( 0.0f, 1.0f ) );
-                const gl::ScopedTextureBind scopedTextureBind( mTextureFboAccum[ 1 ], 0 );
+                gl::setMatricesWindow( mSizeAccum );
+                gl::disableDepthRead();
+                gl::disableDepthWrite();
+                gl::translate( mSizeAccum / 2 );
+                gl::scale( mSizeAccum );
+
+                mBatchBloomBlurRect->getGlslProg()->uniform( "uAttenuation",	scaleBloomAttenuation( mBloomAttenuation ) );
+                mBatchBloomBlurRect->getGlslProg()->uniform( "uScale",			scaleBloomScale( mBloomScale ) );
+                mBatchBloomBlurRect->getGlslProg()->uniform( "uAxis",			axis );
+                const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( input ), 0 );
                 mBatchBloomBlurRect->draw();
-            }
+            } ).read( input ).write( mGraph.createTexture( "Bloom blur", accumDesc ) );
         }
-
     }
 
     //////////////////////////////////////////////////////////////////////////////////////////////
@@ -595,64 +1103,62 @@ void DeferredRenderer::draw( const Rectf &rect )
      * or reduce kNumSamples in scatter.frag.
      */
 
-    if ( mEnabledRay && mBatchRayLightSphere ) {
-		mScene.getUboRayLight()->bindBufferBase( UBO_LOCATION_LIGHTS );
+    Handle rayColor		= -1;
+    Handle rayScatter	= -1;
+    if ( ray ) {
 
         // Draw lights into depth buffer
+        const Handle rayDepth = mGraph.addPass( "Ray depth", [ this ]( const RenderGraph& )
         {
-            const gl::ScopedFramebuffer scopedFrameBuffer( mFboRayDepth );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboRayDepth->getSize() );
+            mScene.getRayLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
             gl::clear();
             gl::enableDepthRead();
             gl::enableDepthWrite();
-            const gl::ScopedMatrices scopedMatrices;
             gl::setMatrices( mScene.mCamera );
-			mBatchRayLightSphere->drawInstanced( (GLsizei)mScene.mRayLightData.size() );
-        }
+            mBatchRayLightSphere->drawInstanced( (GLsizei)mScene.mRayLightData.size() );
+            mScene.getLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
+        } ).write( mGraph.createTexture( "Ray depth", TextureDesc( mSizeGBuffer / 2, GL_DEPTH_COMPONENT32F, GL_FLOAT, GL_LINEAR ) ) );
 
+        // Draw light sources into color buffer, then occluders in front of
+        // them by comparing scene depth with the light's depth
+        rayColor = mGraph.addPass( "Ray occlude", [ = ]( const RenderGraph &graph )
         {
-            const gl::ScopedFramebuffer scopedFrameBuffer( mFboRayColor );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboRayColor->getSize() );
-			gl::clear();
-			gl::enableDepthRead();
+            mScene.getRayLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
+            gl::clear();
+            gl::enableDepthRead();
             gl::disableDepthWrite();
-
-			gl::drawBuffer( GL_COLOR_ATTACHMENT0 );
-
-			// Draw light sources into color buffer
             {
-				const gl::ScopedMatrices scopedMatrices;
+                const gl::ScopedMatrices scopedMatrices;
                 gl::setMatrices( mScene.mCamera );
-				mBatchRayLightSphere->drawInstanced( (GLsizei)mScene.mRayLightData.size() );
-			}
-
-            const gl::ScopedMatrices scopedMatrices;
-            gl::setMatricesWindow( mFboRayColor->getSize() );
-            gl::translate( mFboRayColor->getSize() / 2 );
-            gl::scale( mFboRayColor->getSize() );
-
-            // Draw occluders in front of light source by comparing
-            // scene depth with the light's depth
-            {
-                const gl::ScopedTextureBind scopedTextureBind0( mFboGBuffer->getDepthTexture(),		0 );
-                const gl::ScopedTextureBind scopedTextureBind1( mFboRayDepth->getDepthTexture(),	1 );
-                mBatchRayOccludeRect->draw();
+                mBatchRayLightSphere->drawInstanced( (GLsizei)mScene.mRayLightData.size() );
             }
 
-            // Perform light scattering
-            {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT1 );
-
-                // Calculate the primary light's position in screen space
-
-                const gl::ScopedTextureBind scopedTextureBind( mTextureFboRayColor[ 0 ], 0 );
-				mBatchRayScatterRect->getGlslProg()->uniform( "uLightMatrix", mScene.mCamera.getProjectionMatrix() * mScene.mCamera.getViewMatrix() );
-                mBatchRayScatterRect->draw();
-            }
-        }
-
-		mScene.getUboLight()->bindBufferBase( UBO_LOCATION_LIGHTS );
-	}
+            gl::setMatricesWindow( mSizeRay );
+            gl::translate( mSizeRay / 2 );
+            gl::scale( mSizeRay );
+            const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( depth ),		0 );
+            const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( rayDepth ),	1 );
+            mBatchRayOccludeRect->draw();
+            mScene.getLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
+        } ).read( depth ).read( rayDepth ).write( mGraph.createTexture( "Ray color", rayDesc ) );
+
+        // Perform light scattering
+        rayScatter = mGraph.addPass( "Ray scatter", [ = ]( const RenderGraph &graph )
+        {
+            mScene.getRayLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
+            gl::setMatricesWindow( mSizeRay );
+            gl::translate( mSizeRay / 2 );
+            gl::scale( mSizeRay );
+
+            const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( rayColor ), 0 );
+            mBatchRayScatterRect->getGlslProg()->uniform( "uLightMatrix", mScene.mCamera.getProjectionMatrix() * mScene.mCamera.getViewMatrix() );
+            mBatchRayScatterRect->getGlslProg()->uniform( "uNumLights", (int32_t)mScene.mRayLightData.size() );
+            mBatchRayScatterRect->draw();
+            mScene.getLightBuffer().bindTexture( TEXTURE_UNIT_LIGHTS );
+        } ).read( rayColor ).write( mGraph.createTexture( "Ray scatter", rayDesc ) );
+    }
 
     //////////////////////////////////////////////////////////////////////////////////////////////
     /* AMBIENT OCCLUSION
@@ -667,78 +1173,51 @@ void DeferredRenderer::draw( const Rectf &rect )
      * Open the relevant shader files for links to papers on each technique.
      */
 
-    if ( mAo == Ao_Sao ) {
+    Handle aoBuffer = -1;
+    if ( ao != Ao_None ) {
 
         // Convert depth to clip-space Z if we're performing SAO
-        const gl::ScopedFramebuffer scopedFrameBuffer( mFboCsz );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboCsz->getSize() );
-        gl::drawBuffer( GL_COLOR_ATTACHMENT0 );
-        gl::clear();
-        gl::disableDepthWrite();
-        const gl::ScopedMatrices scopedMatrices;
-        gl::setMatricesWindow( mFboCsz->getSize() );
-        gl::translate( mFboCsz->getSize() / 2 );
-        gl::scale( mFboCsz->getSize() );
-        gl::enableDepthRead();
-
-        const gl::ScopedTextureBind scopedTextureBind( mFboGBuffer->getDepthTexture(), 0 );
-        mBatchSaoCszRect->getGlslProg()->uniform( "uNear", n );
-        mBatchSaoCszRect->draw();
-
-        gl::disableDepthRead();
-    }
-
-    {
-        // Clear AO buffer whether we use it or not
-        const gl::ScopedFramebuffer scopedFrameBuffer( mFboAo );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboAo->getSize() );
-        gl::clear();
-
-        if ( mAo != Ao_None ) {
+        Handle csz = -1;
+        if ( ao == Ao_Sao ) {
+            csz = mGraph.addPass( "CSZ", [ = ]( const RenderGraph &graph )
+            {
+                gl::clear();
+                gl::disableDepthRead();
+                gl::disableDepthWrite();
+                gl::setMatricesWindow( mSizeGBuffer );
+                gl::translate( mSizeGBuffer / 2 );
+                gl::scale( mSizeGBuffer );
+
+                const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( depth ), 0 );
+                mBatchSaoCszRect->getGlslProg()->uniform( "uNear", n );
+                mBatchSaoCszRect->draw();
+            } ).read( depth ).write( mGraph.createTexture( "CSZ", TextureDesc( mSizeGBuffer, GL_R32F, GL_FLOAT, GL_NEAREST, mMipmapLevels ) ) );
+        }
 
-            // Draw next pass into AO buffer's first attachment
-            const gl::ScopedMatrices scopedMatrices;
-            gl::setMatricesWindow( mFboAo->getSize() );
-            gl::enableDepthRead();
+        RenderGraph::PassBuilder builder = mGraph.addPass( "AO", [ = ]( const RenderGraph &graph )
+        {
+            gl::clear();
+            gl::disableDepthRead();
             gl::disableDepthWrite();
-            gl::translate( mFboAo->getSize() / 2 );
-            gl::scale( mFboAo->getSize() );
+            gl::setMatricesWindow( mSizeAo );
+            gl::translate( mSizeAo / 2 );
+            gl::scale( mSizeAo );
             const gl::ScopedBlendPremult scopedBlendPremult;
 
-            if ( mAo == Ao_Hbao ) {
+            if ( ao == Ao_Hbao ) {
 
                 // HBAO (Horizon-based Ambient Occlusion)
-                {
-                    const gl::ScopedTextureBind scopedTextureBind0( mFboGBuffer->getDepthTexture(), 0 );
-                    const gl::ScopedTextureBind scopedTextureBind1( mTextureFboGBuffer[ 2 ],		1 );
-                    mBatchHbaoAoRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
-                    mBatchHbaoAoRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
-                    mBatchHbaoAoRect->draw();
-                }
-
-                // Bilateral blur
-                if ( mEnabledAoBlur ) {
-                    mBatchHbaoBlurRect->getGlslProg()->uniform( "uNear", n );
-                    {
-                        gl::drawBuffer( GL_COLOR_ATTACHMENT1 );
-                        const gl::ScopedTextureBind scopedTextureBind( mTextureFboAo[ 0 ], 0 );
-                        mBatchHbaoBlurRect->getGlslProg()->uniform( "uAxis", vec2( 1.0f, 0.0f ) );
-                        mBatchHbaoBlurRect->draw();
-                    }
-                    {
-                        gl::drawBuffer( GL_COLOR_ATTACHMENT0 );
-                        const gl::ScopedTextureBind scopedTextureBind( mTextureFboAo[ 1 ], 0 );
-                        mBatchHbaoBlurRect->getGlslProg()->uniform( "uAxis", vec2( 0.0f, 1.0f ) );
-                        mBatchHbaoBlurRect->draw();
-                    }
-                }
-
-            } else if ( mAo == Ao_Sao ) {
+                const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( depth ),	0 );
+                const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( normal ),	1 );
+                mBatchHbaoAoRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
+                mBatchHbaoAoRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
+                mBatchHbaoAoRect->draw();
+            } else {
 
                 // SAO (Scalable Ambient Obscurance)
-                const gl::ScopedTextureBind scopedTextureBind( mFboCsz->getColorTexture(), 0 );
-                const int32_t h	= mFboPingPong->getHeight();
-                const int32_t w	= mFboPingPong->getWidth();
+                const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( csz ), 0 );
+                const int32_t h	= mSizeColor.y;
+                const int32_t w	= mSizeColor.x;
                 const mat4& m	= mScene.mCamera.getProjectionMatrix();
                 const vec4 p	= vec4( -2.0f / ( w * m[ 0 ][ 0 ] ),
                                        -2.0f / ( h * m[ 1 ][ 1 ] ),
@@ -747,21 +1226,48 @@ void DeferredRenderer::draw( const Rectf &rect )
                 mBatchSaoAoRect->getGlslProg()->uniform( "uProj",		p );
                 mBatchSaoAoRect->getGlslProg()->uniform( "uProjScale",	(float)h );
                 mBatchSaoAoRect->draw();
+            }
+        } );
+        if ( ao == Ao_Hbao ) {
+            builder.read( depth ).read( normal );
+        } else {
+            builder.read( csz );
+        }
+        aoBuffer = builder.write( mGraph.createTexture( "AO", aoDesc ) );
 
-                // Bilateral blur
-                if ( mEnabledAoBlur ) {
-                    {
-                        gl::drawBuffer( GL_COLOR_ATTACHMENT1 );
-                        const gl::ScopedTextureBind scopedTextureBind( mTextureFboAo[ 0 ], 0 );
-                        mBatchSaoBlurRect->getGlslProg()->uniform( "uAxis", ivec2( 1, 0 ) );
-                        mBatchSaoBlurRect->draw();
+        // Bilateral blur. The vertical pass is blended onto the unblurred AO.
+        if ( mEnabledAoBlur ) {
+            Handle blurred = -1;
+            for ( size_t i = 0; i < 2; ++i ) {
+                const bool horizontal	= i == 0;
+                const Handle input		= horizontal ? aoBuffer : blurred;
+                RenderGraph::PassBuilder blurBuilder = mGraph.addPass( horizontal ? "AO blur X" : "AO blur Y", [ = ]( const RenderGraph &graph )
+                {
+                    if ( horizontal ) {
+                        gl::clear();
                     }
-                    {
-                        gl::drawBuffer( GL_COLOR_ATTACHMENT0 );
-                        const gl::ScopedTextureBind scopedTextureBind( mTextureFboAo[ 1 ], 0 );
-                        mBatchSaoBlurRect->getGlslProg()->uniform( "uAxis", ivec2( 0, 1 ) );
+                    gl::disableDepthRead();
+                    gl::disableDepthWrite();
+                    gl::setMatricesWindow( mSizeAo );
+                    gl::translate( mSizeAo / 2 );
+                    gl::scale( mSizeAo );
+                    const gl::ScopedBlendPremult scopedBlendPremult;
+                    const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( input ), 0 );
+
+                    if ( ao == Ao_Hbao ) {
+                        mBatchHbaoBlurRect->getGlslProg()->uniform( "uNear", n );
+                        mBatchHbaoBlurRect->getGlslProg()->uniform( "uAxis", horizontal ? vec2( 1.0f, 0.0f ) : vec2( 0.0f, 1.0f ) );
+                        mBatchHbaoBlurRect->draw();
+                    } else {
+                        mBatchSaoBlurRect->getGlslProg()->uniform( "uAxis", horizontal ? ivec2( 1, 0 ) : ivec2( 0, 1 ) );
                         mBatchSaoBlurRect->draw();
                     }
+                } );
+                blurBuilder.read( input );
+                if ( horizontal ) {
+                    blurred = blurBuilder.write( mGraph.createTexture( "AO blur", aoDesc ) );
+                } else {
+                    aoBuffer = blurBuilder.read( aoBuffer ).write( aoBuffer );
                 }
             }
         }
@@ -779,209 +1285,253 @@ void DeferredRenderer::draw( const Rectf &rect )
      * SHADOW MAP	RAY SOURCE		RAY SCATTERED
      */
 
-    if ( mDrawDebug ) {
-        const gl::ScopedFramebuffer scopedFramebuffer( mFboPingPong );
-        gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboPingPong->getSize() );
-        const gl::ScopedMatrices scopedMatrices;
-        gl::setMatricesWindow( mFboPingPong->getSize() );
-        gl::disableDepthRead();
-        gl::disableDepthWrite();
+    Handle debug = -1;
+    if ( drawDebug ) {
+        RenderGraph::PassBuilder builder = mGraph.addPass( "Debug", [ = ]( const RenderGraph &graph )
+        {
+            gl::clear();
+            gl::setMatricesWindow( mSizeColor );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
 
-        const size_t columns = 4;
-
-        vec2 sz;
-        sz.x = (float)mFboPingPong->getWidth() / (float)columns;
-        sz.y = sz.x / mFboPingPong->getAspectRatio();
-
-        const gl::ScopedTextureBind scopedTextureBind0( mTextureFboGBuffer[ 0 ],					0 );
-        const gl::ScopedTextureBind scopedTextureBind1( mTextureFboGBuffer[ 1 ],					1 );
-        const gl::ScopedTextureBind scopedTextureBind2( mTextureFboGBuffer[ 2 ],					2 );
-        const gl::ScopedTextureBind scopedTextureBind3( mFboGBuffer->getDepthTexture(),				3 );
-        const gl::ScopedTextureBind scopedTextureBind4( mTextureFboAo[ 0 ],							4 );
-        const gl::ScopedTextureBind scopedTextureBind5( mTextureFboAccum[ mEnabledBloom ? 2 : 0 ],	5 );
-		const gl::ScopedTextureBind scopedTextureBind7( mFboShadowMap->getDepthTexture(),			6 );
-		if ( mTextureFboRayColor[ 0 ] ) mTextureFboRayColor[ 0 ]->bind( 7 );
-		if ( mTextureFboRayColor[ 1 ] ) mTextureFboRayColor[ 1 ]->bind( 8 );
-
-        mBatchDebugRect->getGlslProg()->uniform( "uFar",				f );
-        mBatchDebugRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
-        mBatchDebugRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
-		size_t count = mEnabledRay ? 14 : 12;
-        for ( int32_t i = 0; i <= count; ++i ) {
-            const gl::ScopedModelMatrix scopedModelMatrix;
-            const vec2 pos( ( i % columns ) * sz.x, glm::floor( (float)i / (float)columns ) * sz.y );
-            gl::translate( pos + sz * 0.5f );
-            gl::scale( sz );
-            mBatchDebugRect->getGlslProg()->uniform( "uMode", i );
-            mBatchDebugRect->draw();
+            const size_t columns = 4;
+
+            vec2 sz;
+            sz.x = (float)mSizeColor.x / (float)columns;
+            sz.y = sz.x * (float)mSizeColor.y / (float)mSizeColor.x;
+
+            const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( albedo ),		0 );
+            const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( material ),	1 );
+            const gl::ScopedTextureBind scopedTextureBind2( graph.getTexture( normal ),		2 );
+            const gl::ScopedTextureBind scopedTextureBind3( graph.getTexture( depth ),		3 );
+            const gl::ScopedTextureBind scopedTextureBind5( graph.getTexture( bloomed ),	5 );
+            const gl::ScopedTextureBind scopedTextureBind6( graph.getTexture( shadowMap ),	6 );
+            if ( aoBuffer >= 0 ) graph.getTexture( aoBuffer )->bind( 4 );
+            if ( ray ) graph.getTexture( rayColor )->bind( 7 );
+            if ( ray ) graph.getTexture( rayScatter )->bind( 8 );
+
+            mBatchDebugRect->getGlslProg()->uniform( "uFar",				f );
+            mBatchDebugRect->getGlslProg()->uniform( "uProjectionParams",	projectionParams );
+            mBatchDebugRect->getGlslProg()->uniform( "uProjMatrixInverse",	projMatrixInverse );
+            mBatchDebugRect->getGlslProg()->uniform( "uNumMaterials",		(int32_t)mScene.mMaterialData.size() );
+            size_t count = ray ? 14 : 12;
+            for ( int32_t i = 0; i <= count; ++i ) {
+                const gl::ScopedModelMatrix scopedModelMatrix;
+                const vec2 pos( ( i % columns ) * sz.x, glm::floor( (float)i / (float)columns ) * sz.y );
+                gl::translate( pos + sz * 0.5f );
+                gl::scale( sz );
+                mBatchDebugRect->getGlslProg()->uniform( "uMode", i );
+                mBatchDebugRect->draw();
+            }
+
+            if ( aoBuffer >= 0 ) graph.getTexture( aoBuffer )->unbind( 4 );
+            if ( ray ) graph.getTexture( rayColor )->unbind( 7 );
+            if ( ray ) graph.getTexture( rayScatter )->unbind( 8 );
+        } );
+        builder.read( albedo ).read( material ).read( normal ).read( depth ).read( bloomed ).read( shadowMap );
+        if ( aoBuffer >= 0 ) {
+            builder.read( aoBuffer );
         }
+        if ( ray ) {
+            builder.read( rayColor ).read( rayScatter );
+        }
+        debug = builder.write( mGraph.createTexture( "Debug", colorDesc ) );
+    }
 
-		if ( mTextureFboRayColor[ 0 ] ) mTextureFboRayColor[ 0 ]->unbind();
-		if ( mTextureFboRayColor[ 1 ] ) mTextureFboRayColor[ 1 ]->unbind();
-    } else {
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    /* COMPOSITE
+     *
+     * This first pass begins post-processing. That is, we actually start working on our final
+     * image in screen space here. If we have AO enabled, it is applied to the L-buffer result.
+     * Otherwise, we'll just make a copy of the L-buffer and move on.
+     */
+
+    Handle image = -1;
+    {
+        RenderGraph::PassBuilder builder = mGraph.addPass( "Composite", [ = ]( const RenderGraph &graph )
         {
-            //////////////////////////////////////////////////////////////////////////////////////////////
-            /* COMPOSITE
-             *
-             * This first pass begins post-processing. That is, we actually start working on our final
-             * image in screen space here. If we have AO enabled, it is applied to the L-buffer result.
-             * Otherwise, we'll just make a copy of the L-buffer and move on.
-             */
-
-            const gl::ScopedFramebuffer scopedFrameBuffer( mFboPingPong );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboPingPong->getSize() );
-            const gl::ScopedMatrices scopedMatrices;
-            gl::setMatricesWindow( mFboPingPong->getSize() );
-            gl::translate( mFboPingPong->getSize() / 2 );
-            gl::scale( mFboPingPong->getSize() );
+            gl::setMatricesWindow( mSizeColor );
+            gl::translate( mSizeColor / 2 );
+            gl::scale( mSizeColor );
             gl::disableDepthRead();
             gl::disableDepthWrite();
 
-            {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-                if ( mAo != Ao_None ) {
+            if ( aoBuffer >= 0 ) {
 
-                    // Blend L-buffer and AO
-                    const gl::ScopedTextureBind scopedTextureBind1( mTextureFboPingPong[ pong ],	0 );
-                    const gl::ScopedTextureBind scopedTextureBind0( mTextureFboAo[ 0 ],				1 );
-                    mBatchAoCompositeRect->draw();
-                } else {
+                // Blend L-buffer and AO
+                const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( lBuffer ),	0 );
+                const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( aoBuffer ),	1 );
+                mBatchAoCompositeRect->draw();
+            } else {
 
-                    // Draw L-buffer without AO
-                    const gl::ScopedTextureBind scopedTextureBind( mTextureFboPingPong[ pong ], 0 );
-                    mBatchStockTextureRect->draw();
-                }
-
-                ping = pong;
-                pong = ( ping + 1 ) % 2;
+                // Draw L-buffer without AO
+                const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( lBuffer ), 0 );
+                mBatchStockTextureRect->draw();
             }
+        } );
+        builder.read( lBuffer );
+        if ( aoBuffer >= 0 ) {
+            builder.read( aoBuffer );
+        }
+        image = builder.write( mGraph.createTexture( "Composite", colorDesc ) );
+    }
 
-            //////////////////////////////////////////////////////////////////////////////////////////////
-            /* FOG
-             *
-             * To simulate fog, all we really have to do represent the depth buffer as color and mix
-             * it into our image.
-             */
-
-            if ( mEnabledFog ) {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-                const gl::ScopedTextureBind scopedTextureBind0( mFboGBuffer->getDepthTexture(),	0 );
-                const gl::ScopedTextureBind scopedTextureBind1( mTextureFboPingPong[ pong ],	1 );
-                mBatchFogRect->draw();
-
-                ping = pong;
-                pong = ( ping + 1 ) % 2;
-            }
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    /* FOG
+     *
+     * To simulate fog, all we really have to do represent the depth buffer as color and mix
+     * it into our image.
+     */
 
-            //////////////////////////////////////////////////////////////////////////////////////////////
-            /* DEPTH OF FIELD
-             *
-             * Depth of field simulates a lens effect by performing a shaped blur (bokeh) on our
-             * image; based on its depth and distance from the camera. It helps to "unflatten" a 3D
-             * image's appearance on a 2D screen. This is a fairly expensive operation. It really only
-             * benefits a scene which has objects close to the camera that should be unfocused.
-             * If this doesn't describe your scene, do not enable this pass.
-             */
-
-            if ( mEnabledDoF ) {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-
-                const float d = mFocalDepth * glm::length( mScene.mCamera.getEyePoint() );
-                const gl::ScopedTextureBind scopedTextureBind0( mFboGBuffer->getDepthTexture(), 0 );
-                const gl::ScopedTextureBind scopedTextureBind1( mTextureFboPingPong[ pong ],	1 );
-                mBatchDofRect->getGlslProg()->uniform( "uFocalDepth",	d );
-                mBatchDofRect->getGlslProg()->uniform( "uNear",			n ); // n = camera near clip
-                mBatchDofRect->draw();
-
-                ping = pong;
-                pong = ( ping + 1 ) % 2;
-            }
+    if ( fog ) {
+        image = mGraph.addPass( "Fog", [ = ]( const RenderGraph &graph )
+        {
+            gl::setMatricesWindow( mSizeColor );
+            gl::translate( mSizeColor / 2 );
+            gl::scale( mSizeColor );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
 
-            //////////////////////////////////////////////////////////////////////////////////////////////
-            /* COLOR
-             *
-             * This pass applies chromatic aberration, brightness, saturation, contrast, and intensity
-             * filtering. You may modify these settings in post/color.frag.
-             */
+            const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( depth ),	0 );
+            const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( image ),	1 );
+            mBatchFogRect->draw();
+        } ).read( depth ).read( image ).write( mGraph.createTexture( "Fog", colorDesc ) );
+    }
 
-            if ( mEnabledColor ) {
-                gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-                const gl::ScopedTextureBind scopedTextureBind( mTextureFboPingPong[ pong ], 0 );
-                mBatchColorRect->draw();
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    /* DEPTH OF FIELD
+     *
+     * Depth of field simulates a lens effect by performing a shaped blur (bokeh) on our
+     * image; based on its depth and distance from the camera. It helps to "unflatten" a 3D
+     * image's appearance on a 2D screen. This is a fairly expensive operation. It really only
+     * benefits a scene which has objects close to the camera that should be unfocused.
+     * If this doesn't describe your scene, do not enable this pass.
+     */
 
-                ping = pong;
-                pong = ( ping + 1 ) % 2;
-            }
-        }
+    if ( dof ) {
+        image = mGraph.addPass( "Depth of field", [ = ]( const RenderGraph &graph )
+        {
+            gl::setMatricesWindow( mSizeColor );
+            gl::translate( mSizeColor / 2 );
+            gl::scale( mSizeColor );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
+
+            const float d = mFocalDepth * glm::length( mScene.mCamera.getEyePoint() );
+            const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( depth ),	0 );
+            const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( image ),	1 );
+            mBatchDofRect->getGlslProg()->uniform( "uFocalDepth",	d );
+            mBatchDofRect->getGlslProg()->uniform( "uNear",			n ); // n = camera near clip
+            mBatchDofRect->draw();
+        } ).read( depth ).read( image ).write( mGraph.createTexture( "Depth of field", colorDesc ) );
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    /* COLOR
+     *
+     * This pass applies chromatic aberration, brightness, saturation, contrast, and intensity
+     * filtering. You may modify these settings in post/color.frag.
+     */
+
+    if ( color ) {
+        image = mGraph.addPass( "Color", [ = ]( const RenderGraph &graph )
+        {
+            gl::setMatricesWindow( mSizeColor );
+            gl::translate( mSizeColor / 2 );
+            gl::scale( mSizeColor );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
+
+            const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( image ), 0 );
+            mBatchColorRect->draw();
+        } ).read( image ).write( mGraph.createTexture( "Color", colorDesc ) );
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    /* FINAL RENDER
+     *
+     * This pass prepares our image to be rendered to the screen. Light accumulation is painted
+     * onto the image. If we are in full screen AO mode, we'll prepare that view instead.
+     */
+
+    // Composite light rays into image
+    if ( ray ) {
+        image = mGraph.addPass( "Ray composite", [ = ]( const RenderGraph &graph )
+        {
+            gl::setMatricesWindow( mSizeColor );
+            gl::translate( mSizeColor / 2 );
+            gl::scale( mSizeColor );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
 
-        //////////////////////////////////////////////////////////////////////////////////////////////
-        /* FINAL RENDER
-         *
-         * This pass prepares our image to be rendered to the screen. Light accumulation is painted
-         * onto the image. If we are in full screen AO mode, we'll prepare that view instead.
-         */
-
-        const gl::ScopedFramebuffer scopedFramebuffer( mFboPingPong );
-        gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboPingPong->getSize() );
-        const gl::ScopedMatrices scopedMatrices;
-        gl::setMatricesWindow( mFboPingPong->getSize() );
-        gl::translate( mFboPingPong->getSize() / 2 );
-        gl::scale( mFboPingPong->getSize() );
+            const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( image ),		0 );
+            const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( rayScatter ),	1 );
+            mBatchRayCompositeRect->draw();
+        } ).read( image ).read( rayScatter ).write( mGraph.createTexture( "Ray composite", colorDesc ) );
+    }
+
+    // Composite light accumulation / bloom into our final image
+    image = mGraph.addPass( "Bloom composite", [ = ]( const RenderGraph &graph )
+    {
+        gl::setMatricesWindow( mSizeColor );
+        gl::translate( mSizeColor / 2 );
+        gl::scale( mSizeColor );
         gl::disableDepthRead();
         gl::disableDepthWrite();
 
-        // Fill screen with AO in AO view mode
-        if ( mDrawAo ) {
-            const gl::ScopedTextureBind scopedTextureBind( mTextureFboAo[ 0 ], 4 );
-            mBatchDebugRect->getGlslProg()->uniform( "uMode", 11 );
-            mBatchDebugRect->draw();
-        } else {
-
-            // Composite light rays into image
-            if ( mEnabledRay && mBatchRayCompositeRect ) {
-                const gl::ScopedTextureBind scopedTextureBind0( mTextureFboPingPong[ pong ],	0 );
-                const gl::ScopedTextureBind scopedTextureBind1( mTextureFboRayColor[ 1 ],		1 );
-                mBatchRayCompositeRect->draw();
+        const gl::ScopedTextureBind scopedTextureBind0( graph.getTexture( image ),		0 );
+        const gl::ScopedTextureBind scopedTextureBind1( graph.getTexture( bloomed ),	1 );
+        mBatchBloomCompositeRect->draw();
+    } ).read( image ).read( bloomed ).write( mGraph.createTexture( "Bloom composite", colorDesc ) );
 
-                ping = pong;
-                pong = ( ping + 1 ) % 2;
-            }
+    // Draw light volumes for debugging
+    if ( mDrawLightVolume ) {
+        image = mGraph.addPass( "Light volumes", [ this ]( const RenderGraph& )
+        {
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
+            const gl::ScopedBlendAlpha scopedBlendAlpha;
+            const gl::ScopedPolygonMode scopedPolygonMode( GL_LINE );
+            gl::setMatrices( mScene.mCamera );
 
-            // Composite light accumulation / bloom into our final image
-            gl::drawBuffer( GL_COLOR_ATTACHMENT0 + (GLenum)ping );
-            {
-                const gl::ScopedTextureBind scopedTextureBind0( mTextureFboPingPong[ pong ],				0 );
-                const gl::ScopedTextureBind scopedTextureBind1( mTextureFboAccum[ mEnabledBloom ? 2 : 0 ],	1 );
-                mBatchBloomCompositeRect->draw();
+            for ( const Light& light : mScene.mLightData ) {
+                const gl::ScopedModelMatrix scopedModelMatrix;
+                const gl::ScopedColor scopedColor( light.getColorDiffuse() * ColorAf( Colorf::white(), 0.08f ) );
+                gl::translate( light.getPosition() );
+                gl::scale( vec3( light.getVolume() ) );
+                mBatchStockColorSphere->draw();
             }
+        } ).read( image ).write( image );
+    }
 
-            // Draw light volumes for debugging
-            if ( mDrawLightVolume ) {
-                const gl::ScopedBlendAlpha scopedBlendAlpha;
-                const gl::ScopedPolygonMode scopedPolygonMode( GL_LINE );
-                const gl::ScopedMatrices scopedMatrices;
-                gl::setMatrices( mScene.mCamera );
+    // Fill screen with AO in AO view mode
+    Handle aoView = -1;
+    if ( drawAo ) {
+        aoView = mGraph.addPass( "AO view", [ = ]( const RenderGraph &graph )
+        {
+            gl::setMatricesWindow( mSizeColor );
+            gl::translate( mSizeColor / 2 );
+            gl::scale( mSizeColor );
+            gl::disableDepthRead();
+            gl::disableDepthWrite();
 
-				for ( const Light& light : mScene.mLightData ) {
-					const gl::ScopedModelMatrix scopedModelMatrix;
-					const gl::ScopedColor scopedColor( light.getColorDiffuse() * ColorAf( Colorf::white(), 0.08f ) );
-					gl::translate( light.getPosition() );
-					gl::scale( vec3( light.getVolume() ) );
-					mBatchStockColorSphere->draw();
-				}
-            }
-        }
+            const gl::ScopedTextureBind scopedTextureBind( graph.getTexture( aoBuffer ), 4 );
+            mBatchDebugRect->getGlslProg()->uniform( "uMode", 11 );
+            mBatchDebugRect->draw();
+        } ).read( aoBuffer ).write( mGraph.createTexture( "AO view", colorDesc ) );
     }
 
-    ping = pong;
-    pong = ( ping + 1 ) % 2;
+    // Only passes leading to the image on screen are run. The debug
+    // views leave the post-processing chain unused.
+    const Handle output = drawDebug ? debug : drawAo ? aoView : image;
+    mGraph.setOutput( output );
+    mGraph.execute( mProfiler );
 
     //////////////////////////////////////////////////////////////////////////////////////////////
     // BLIT
 
     // Render our final image to the screen
+    mProfiler.begin( "Blit" );
     const gl::ScopedViewport scopedViewport( rect.getUpperLeft(), rect.getSize() );
     const gl::ScopedMatrices scopedMatrices;
     //gl::setMatricesWindow( rect.getSize() );
@@ -989,8 +1539,8 @@ void DeferredRenderer::draw( const Rectf &rect )
     gl::scale( rect.getSize() );
     gl::disableDepthRead();
     gl::disableDepthWrite();
-    const gl::ScopedTextureBind scopedTextureBind( mTextureFboPingPong[ pong ], 0 );
-    if ( mEnabledFxaa ) {
+    const gl::ScopedTextureBind scopedTextureBind( mGraph.getTexture( output ), 0 );
+    if ( fxaa ) {
 
         // To keep bandwidth in check, we aren't using any hardware
         // anti-aliasing (MSAA). Instead, we use FXAA as a post-process
@@ -1001,7 +1551,13 @@ void DeferredRenderer::draw( const Rectf &rect )
         // Draw to screen without FXAA
         mBatchStockTextureRect->draw();
     }
+    mProfiler.end();
 
+    // Every instanced draw reading this frame's streaming region has been
+    // issued, so fence it for reuse kNumInstanceRegions frames from now
+    if ( mEnabledStreaming ) {
+        mInstanceFences[ mInstanceRegion ] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    }
 
 }
 
@@ -1027,20 +1583,14 @@ void DeferredRenderer::resize( const ivec2& windowSize )
     // to add 10% of the screen size to increase the sampling area.
     mOffset = mAo != Ao_None ? vec2( w, h ) * vec2( 0.1f ) : vec2( 0.0f );
 
-    // Texture formats for color buffers
-    GLuint colorInternalFormat = GL_RGB10_A2;
-    gl::Texture2d::Format colorTextureFormatLinear = gl::Texture2d::Format()
-    .internalFormat( colorInternalFormat )
-    .magFilter( GL_LINEAR )
-    .minFilter( GL_LINEAR )
-    .wrap( GL_CLAMP_TO_EDGE )
-    .dataType( GL_FLOAT );
-    gl::Texture2d::Format colorTextureFormatNearest = gl::Texture2d::Format()
-    .internalFormat( colorInternalFormat )
-    .magFilter( GL_NEAREST )
-    .minFilter( GL_NEAREST )
-    .wrap( GL_CLAMP_TO_EDGE )
-    .dataType( GL_FLOAT );
+    // Sizes of render targets. All but the accumulation buffer and shadow
+    // map are transient, and handed out by the render graph in draw().
+    mSizeColor		= ivec2( w, h );
+    mSizeAccum		= mSizeColor / 2;
+    mSizeGBuffer	= ivec2( vec2( w, h ) + mOffset * 2.0f );
+    mSizeAo			= mSizeGBuffer / 2;
+    mSizeRay		= mSizeColor / 2;
+    mGraph.releaseTextures();
 
     // Texture format for depth buffers
     gl::Texture2d::Format depthTextureFormat = gl::Texture2d::Format()
@@ -1050,143 +1600,27 @@ void DeferredRenderer::resize( const ivec2& windowSize )
     .wrap( GL_CLAMP_TO_EDGE )
     .dataType( GL_FLOAT );
 
-    // Light accumulation frame buffer
-    // 0 GL_COLOR_ATTACHMENT0 Light accumulation
-    // 1 GL_COLOR_ATTACHMENT1 Bloom ping
-    // 2 GL_COLOR_ATTACHMENT2 Bloom pong
+    // Light accumulation frame buffer. This persists across frames to
+    // leave light trails.
     {
-        ivec2 sz = ivec2( w, h ) / 2;
-        gl::Fbo::Format fboFormat;
-        fboFormat.disableDepth();
-        for ( size_t i = 0; i < 3; ++i ) {
-            mTextureFboAccum[ i ] = gl::Texture2d::create( sz.x, sz.y, colorTextureFormatLinear );
-            fboFormat.attachment( GL_COLOR_ATTACHMENT0 + (GLenum)i, mTextureFboAccum[ i ] );
-        }
-        mFboAccum = gl::Fbo::create( sz.x, sz.y, fboFormat );
+        mFboAccum = gl::Fbo::create( mSizeAccum.x, mSizeAccum.y, gl::Fbo::Format()
+                                    .disableDepth()
+                                    .colorTexture( gl::Texture2d::Format()
+                                                  .internalFormat( GL_RGB10_A2 )
+                                                  .magFilter( GL_LINEAR )
+                                                  .minFilter( GL_LINEAR )
+                                                  .wrap( GL_CLAMP_TO_EDGE )
+                                                  .dataType( GL_FLOAT ) ) );
         const gl::ScopedFramebuffer scopedFramebuffer( mFboAccum );
         const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboAccum->getSize() );
         gl::clear();
     }
 
-    // Set up the G-buffer
-    // 0 GL_COLOR_ATTACHMENT0	Albedo
-    // 1 GL_COLOR_ATTACHMENT1	Material ID
-    // 2 GL_COLOR_ATTACHMENT2	Encoded normals
-    {
-        const ivec2 sz = ivec2( vec2( w, h ) + mOffset * 2.0f );
-        for ( size_t i = 0; i < 3; ++i ) {
-            mTextureFboGBuffer[ i ] = gl::Texture2d::create( sz.x, sz.y );
-        }
-        mTextureFboGBuffer[ 0 ] = gl::Texture2d::create( sz.x, sz.y, colorTextureFormatNearest );
-        mTextureFboGBuffer[ 1 ] = gl::Texture2d::create( sz.x, sz.y,
-                                                        gl::Texture2d::Format()
-                                                        .internalFormat( GL_R8I )
-                                                        .magFilter( GL_NEAREST )
-                                                        .minFilter( GL_NEAREST )
-                                                        .wrap( GL_CLAMP_TO_EDGE )
-                                                        .dataType( GL_BYTE ) );
-        mTextureFboGBuffer[ 2 ] = gl::Texture2d::create( sz.x, sz.y,
-                                                        gl::Texture2d::Format()
-                                                        .internalFormat( GL_RG16F )
-                                                        .magFilter( GL_NEAREST )
-                                                        .minFilter( GL_NEAREST )
-                                                        .wrap( GL_CLAMP_TO_EDGE )
-                                                        .dataType( GL_BYTE ) );
-        gl::Fbo::Format fboFormat;
-        fboFormat.depthTexture( depthTextureFormat );
-        for ( size_t i = 0; i < 3; ++i ) {
-            fboFormat.attachment( GL_COLOR_ATTACHMENT0 + (GLenum)i, mTextureFboGBuffer[ i ] );
-        }
-        mFboGBuffer = gl::Fbo::create( sz.x, sz.y, fboFormat );
-        const gl::ScopedFramebuffer scopedFramebuffer( mFboGBuffer );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboGBuffer->getSize() );
-        gl::clear();
-    }
-
-    // Set up the ambient occlusion frame buffer with two attachments to ping-pong.
-    if ( mAo != Ao_None ) {
-        ivec2 sz = mFboGBuffer->getSize() / 2;
-        gl::Fbo::Format fboFormat;
-        fboFormat.disableDepth();
-        for ( size_t i = 0; i < 2; ++i ) {
-            mTextureFboAo[ i ] = gl::Texture2d::create( sz.x, sz.y, gl::Texture2d::Format()
-                                                       .internalFormat( GL_RG32F )
-                                                       .magFilter( GL_LINEAR )
-                                                       .minFilter( GL_LINEAR )
-                                                       .wrap( GL_CLAMP_TO_EDGE )
-                                                       .dataType( GL_FLOAT ) );
-            fboFormat.attachment( GL_COLOR_ATTACHMENT0 + (GLenum)i, mTextureFboAo[ i ] );
-        }
-        mFboAo = gl::Fbo::create( sz.x, sz.y, fboFormat );
-        {
-            const gl::ScopedFramebuffer scopedFramebuffer( mFboAo );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboAo->getSize() );
-            gl::clear();
-        }
-
-        // Set up the SAO mip-map (clip-space Z) buffer
-        if ( mAo == Ao_Sao ) {
-            gl::Texture2d::Format cszTextureFormat = gl::Texture2d::Format()
-            .internalFormat( GL_R32F )
-            .mipmap()
-            .magFilter( GL_NEAREST_MIPMAP_NEAREST )
-            .minFilter( GL_NEAREST_MIPMAP_NEAREST )
-            .wrap( GL_CLAMP_TO_EDGE )
-            .dataType( GL_FLOAT );
-            cszTextureFormat.setMaxMipmapLevel( mMipmapLevels );
-            mFboCsz = gl::Fbo::create( mFboGBuffer->getWidth(), mFboGBuffer->getHeight(),
-                                      gl::Fbo::Format().disableDepth().colorTexture( cszTextureFormat ) );
-            const gl::ScopedFramebuffer scopedFramebuffer( mFboCsz );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboCsz->getSize() );
-            gl::clear();
-        }
-    }
-
-    // Set up the ping pong frame buffer. We'll use this FBO to render
-    // the scene and perform post-processing passes.
-    {
-        gl::Fbo::Format fboFormat;
-        fboFormat.disableDepth();
-        for ( size_t i = 0; i < 2; ++i ) {
-            mTextureFboPingPong[ i ] = gl::Texture2d::create( w, h, colorTextureFormatNearest );
-            fboFormat.attachment( GL_COLOR_ATTACHMENT0 + (GLenum)i, mTextureFboPingPong[ i ] );
-        }
-        mFboPingPong = gl::Fbo::create( w, h, fboFormat );
-        const gl::ScopedFramebuffer scopedFramebuffer( mFboPingPong );
-        const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboPingPong->getSize() );
-        gl::clear();
-    }
-
-    // Create FBOs for light rays (volumetric light scattering)
-    if ( mEnabledRay ) {
-        {
-            gl::Fbo::Format fboFormat;
-            fboFormat.disableDepth();
-            ivec2 sz( w / 2, h / 2 );
-            for ( size_t i = 0; i < 2; ++i ) {
-                mTextureFboRayColor[ i ] = gl::Texture2d::create( sz.x, sz.y, colorTextureFormatLinear );
-                fboFormat.attachment( GL_COLOR_ATTACHMENT0 + (GLenum)i, mTextureFboRayColor[ i ] );
-            }
-            mFboRayColor = gl::Fbo::create( sz.x, sz.y, fboFormat );
-            const gl::ScopedFramebuffer scopedFramebuffer( mFboRayColor );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboRayColor->getSize() );
-            gl::clear();
-        }
-        {
-            ivec2 sz		= mFboGBuffer->getSize() / 2;
-            mFboRayDepth	= gl::Fbo::create( sz.x, sz.y,
-                                              gl::Fbo::Format().disableColor().depthTexture( depthTextureFormat ) );
-            const gl::ScopedFramebuffer scopedFramebuffer( mFboRayDepth );
-            const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboRayDepth->getSize() );
-            gl::clear();
-        }
-    }
-
     // Create shadow map buffer
     {
         int32_t sz = (int32_t)toPixels( mHighQuality ? 2048.0f : 1024.0f );
         mFboShadowMap = gl::Fbo::create( sz, sz,
-                                        gl::Fbo::Format().depthTexture( depthTextureFormat ) );
+                                        gl::Fbo::Format().disableColor().depthTexture( depthTextureFormat ) );
         mFboShadowMap->getDepthTexture()->setCompareMode( GL_COMPARE_REF_TO_TEXTURE );
         const gl::ScopedFramebuffer scopedFramebuffer( mFboShadowMap );
         const gl::ScopedViewport scopedViewport( ivec2( 0 ), mFboShadowMap->getSize() );
@@ -1204,147 +1638,698 @@ void DeferredRenderer::resize( const ivec2& windowSize )
 
 void DeferredRenderer::setUniforms( const ivec2 &windowSize )
 {
-    // Set sampler bindings
-    mBatchAoCompositeRect->getGlslProg()->uniform(		"uSampler",				0 );
-    mBatchAoCompositeRect->getGlslProg()->uniform(		"uSamplerAo",			1 );
-    mBatchBloomBlurRect->getGlslProg()->uniform(		"uSampler",				0 );
+    const bool sized		= mSizeColor.x > 0;
+    const vec2 szGBuffer	= sized ? mSizeGBuffer	: windowSize;
+    const vec2 szPingPong	= sized ? mSizeColor	: windowSize;
+    const vec2 szRay		= sized ? mSizeRay		: windowSize / 2;
+
+    // Set sampler bindings, texture buffer bindings and uniforms which need
+    // to know about screen dimensions
     mBatchBloomCompositeRect->getGlslProg()->uniform(	"uSamplerColor",		0 );
     mBatchBloomCompositeRect->getGlslProg()->uniform(	"uSamplerBloom",		1 );
-    mBatchBloomHighpassRect->getGlslProg()->uniform(	"uSampler",				0 );
-    mBatchColorRect->getGlslProg()->uniform(			"uSampler",				0 );
-    mBatchDebugRect->getGlslProg()->uniform(			"uSamplerAlbedo",		0 );
-    mBatchDebugRect->getGlslProg()->uniform(			"uSamplerMaterial",		1 );
-    mBatchDebugRect->getGlslProg()->uniform(			"uSamplerNormal",		2 );
-    mBatchDebugRect->getGlslProg()->uniform(			"uSamplerDepth",		3 );
-    mBatchDebugRect->getGlslProg()->uniform(			"uSamplerAo",			4 );
-    mBatchDebugRect->getGlslProg()->uniform(			"uSamplerAccum",		5 );
-	mBatchDebugRect->getGlslProg()->uniform(			"uSamplerShadow",		6 );
-	mBatchDebugRect->getGlslProg()->uniform(			"uSamplerRayColor",		7 );
-	mBatchDebugRect->getGlslProg()->uniform(			"uSamplerRayScatter",	8 );
-    mBatchDofRect->getGlslProg()->uniform(				"uSamplerDepth",		0 );
-    mBatchDofRect->getGlslProg()->uniform(				"uSamplerColor",		1 );
-    mBatchFogRect->getGlslProg()->uniform(				"uSamplerDepth",		0 );
-    mBatchFogRect->getGlslProg()->uniform(				"uSamplerColor",		1 );
+    mBatchBloomCompositeRect->getGlslProg()->uniform(	"uPixel",				vec2( 1.0f ) / vec2( szPingPong ) );
     mBatchEmissiveRect->getGlslProg()->uniform(			"uSamplerAlbedo",		0 );
     mBatchEmissiveRect->getGlslProg()->uniform(			"uSamplerMaterial",		1 );
-    mBatchFxaaRect->getGlslProg()->uniform(				"uSampler",				0 );
-    mBatchHbaoAoRect->getGlslProg()->uniform(			"uSamplerDepth",		0 );
-    mBatchHbaoAoRect->getGlslProg()->uniform(			"uSamplerNormal",		1 );
-    mBatchHbaoBlurRect->getGlslProg()->uniform(			"uSampler",				0 );
+    mBatchEmissiveRect->getGlslProg()->uniform(			"uBufferMaterials",		TEXTURE_UNIT_MATERIALS );
+    mBatchEmissiveRect->getGlslProg()->uniform(			"uOffset",				mOffset );
+    mBatchEmissiveRect->getGlslProg()->uniform(			"uWindowSize",			szGBuffer );
+    mBatchGBufferLightSourceSphere->getGlslProg()->uniform(	"uBufferLights",	TEXTURE_UNIT_LIGHTS );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uSamplerAlbedo",		0 );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uSamplerMaterial",		1 );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uSamplerNormal",		2 );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uSamplerDepth",		3 );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uBufferLights",		TEXTURE_UNIT_LIGHTS );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uBufferMaterials",		TEXTURE_UNIT_MATERIALS );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uBufferClusters",		TEXTURE_UNIT_CLUSTERS );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uBufferClusterLights",	TEXTURE_UNIT_CLUSTER_LIGHTS );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uOffset",				mOffset );
+    mBatchLBufferClusteredRect->getGlslProg()->uniform(	"uWindowSize",			szGBuffer );
     mBatchLBufferLightCube->getGlslProg()->uniform(		"uSamplerAlbedo",		0 );
     mBatchLBufferLightCube->getGlslProg()->uniform(		"uSamplerMaterial",		1 );
     mBatchLBufferLightCube->getGlslProg()->uniform(		"uSamplerNormal",		2 );
     mBatchLBufferLightCube->getGlslProg()->uniform(		"uSamplerDepth",		3 );
+    mBatchLBufferLightCube->getGlslProg()->uniform(		"uBufferLights",		TEXTURE_UNIT_LIGHTS );
+    mBatchLBufferLightCube->getGlslProg()->uniform(		"uBufferMaterials",		TEXTURE_UNIT_MATERIALS );
+    mBatchLBufferLightCube->getGlslProg()->uniform(		"uBufferLightIndices",	TEXTURE_UNIT_LIGHT_INDICES );
+    mBatchLBufferLightCube->getGlslProg()->uniform(		"uOffset",				mOffset );
+    mBatchLBufferLightCube->getGlslProg()->uniform(		"uWindowSize",			szGBuffer );
     mBatchLBufferShadowRect->getGlslProg()->uniform(	"uSampler",				0 );
     mBatchLBufferShadowRect->getGlslProg()->uniform(	"uSamplerDepth",		1 );
-	if ( mBatchRayCompositeRect ) {
-		mBatchRayCompositeRect->getGlslProg()->uniform( "uSamplerColor",		0 );
-		mBatchRayCompositeRect->getGlslProg()->uniform( "uSamplerRay",			1 );
+    mBatchLBufferShadowRect->getGlslProg()->uniform(	"uOffset",				mOffset );
+    mBatchLBufferShadowRect->getGlslProg()->uniform(	"uWindowSize",			szGBuffer );
+
+    for ( auto &b : mInstancedModelBatches ) {        
+		b.gBuffer.batch->getGlslProg()->uniform( "uTexture", 0 );
+		b.gBuffer.batch->getGlslProg()->uniform( "uCubeMap", 1 );
+    }
+
+    // The remaining batches are missing while their programs are still
+    // being built. This is called again once they are all ready.
+    if ( mBatchAoCompositeRect ) {
+        mBatchAoCompositeRect->getGlslProg()->uniform(	"uSampler",				0 );
+        mBatchAoCompositeRect->getGlslProg()->uniform(	"uSamplerAo",			1 );
+        mBatchAoCompositeRect->getGlslProg()->uniform(	"uOffset",				mOffset );
+        mBatchAoCompositeRect->getGlslProg()->uniform(	"uWindowSize",			szGBuffer );
+    }
+    if ( mBatchBloomBlurRect ) {
+        mBatchBloomBlurRect->getGlslProg()->uniform(	"uSampler",				0 );
+    }
+    if ( mBatchBloomHighpassRect ) {
+        mBatchBloomHighpassRect->getGlslProg()->uniform( "uSampler",			0 );
+    }
+    if ( mBatchColorRect ) {
+        mBatchColorRect->getGlslProg()->uniform(		"uSampler",				0 );
+    }
+    if ( mBatchDebugRect ) {
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerAlbedo",		0 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerMaterial",		1 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerNormal",		2 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerDepth",		3 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerAo",			4 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerAccum",		5 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerShadow",		6 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerRayColor",		7 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uSamplerRayScatter",	8 );
+        mBatchDebugRect->getGlslProg()->uniform(		"uBufferMaterials",		TEXTURE_UNIT_MATERIALS );
+    }
+    if ( mBatchDofRect ) {
+        mBatchDofRect->getGlslProg()->uniform(			"uSamplerDepth",		0 );
+        mBatchDofRect->getGlslProg()->uniform(			"uSamplerColor",		1 );
+        mBatchDofRect->getGlslProg()->uniform(			"uAspect",				windowSize.x / (float)windowSize.y );
+        mBatchDofRect->getGlslProg()->uniform(			"uOffset",				mOffset );
+        mBatchDofRect->getGlslProg()->uniform(			"uWindowSize",			szGBuffer );
+    }
+    if ( mBatchFogRect ) {
+        mBatchFogRect->getGlslProg()->uniform(			"uSamplerDepth",		0 );
+        mBatchFogRect->getGlslProg()->uniform(			"uSamplerColor",		1 );
+        mBatchFogRect->getGlslProg()->uniform(			"uOffset",				mOffset );
+        mBatchFogRect->getGlslProg()->uniform(			"uWindowSize",			szGBuffer );
+    }
+    if ( mBatchFxaaRect ) {
+        mBatchFxaaRect->getGlslProg()->uniform(			"uSampler",				0 );
+        mBatchFxaaRect->getGlslProg()->uniform(			"uPixel",				1.0f / vec2( szPingPong ) );
+    }
+    if ( mBatchHbaoAoRect ) {
+        mBatchHbaoAoRect->getGlslProg()->uniform(		"uSamplerDepth",		0 );
+        mBatchHbaoAoRect->getGlslProg()->uniform(		"uSamplerNormal",		1 );
+    }
+    if ( mBatchHbaoBlurRect ) {
+        mBatchHbaoBlurRect->getGlslProg()->uniform(		"uSampler",				0 );
+    }
+    if ( mBatchRayCompositeRect ) {
+        mBatchRayCompositeRect->getGlslProg()->uniform(	"uSamplerColor",		0 );
+        mBatchRayCompositeRect->getGlslProg()->uniform(	"uSamplerRay",			1 );
+        mBatchRayCompositeRect->getGlslProg()->uniform(	"uPixel",				vec2( 1.0f ) / vec2( szRay ) );
+    }
+    if ( mBatchRayLightSphere ) {
+        mBatchRayLightSphere->getGlslProg()->uniform(	"uBufferLights",		TEXTURE_UNIT_LIGHTS );
+    }
+    if ( mBatchRayOccludeRect ) {
+        mBatchRayOccludeRect->getGlslProg()->uniform(	"uSamplerDepth",		0 );
+        mBatchRayOccludeRect->getGlslProg()->uniform(	"uSamplerLightDepth",	1 );
+    }
+    if ( mBatchRayScatterRect ) {
+        mBatchRayScatterRect->getGlslProg()->uniform(	"uSampler",				0 );
+        mBatchRayScatterRect->getGlslProg()->uniform(	"uBufferLights",		TEXTURE_UNIT_LIGHTS );
+        mBatchRayScatterRect->getGlslProg()->uniform(	"uOffset",				mOffset * ( szRay / szGBuffer ) );
+        mBatchRayScatterRect->getGlslProg()->uniform(	"uWindowSize",			szRay );
+    }
+    if ( mBatchSaoAoRect ) {
+        mBatchSaoAoRect->getGlslProg()->uniform(		"uSampler",				0 );
+    }
+    if ( mBatchSaoBlurRect ) {
+        mBatchSaoBlurRect->getGlslProg()->uniform(		"uSampler",				0 );
+    }
+    if ( mBatchSaoCszRect ) {
+        mBatchSaoCszRect->getGlslProg()->uniform(		"uSamplerDepth",		0 );
+    }
+}
+
+void DeferredRenderer::createInstanceBatches()
+{
+	mInstancedModelBatches.clear();
+
+	if ( mFormatGBufferInstanced.getVertex().empty() ) {
+		mFormatGBufferInstanced = gl::GlslProg::Format().version( 330 )
+			.vertex( loadAsset( "shaders/deferred/gbuffer.vert" ) )
+			.fragment( loadAsset( "shaders/deferred/gbuffer.frag" ) )
+			.define( "INSTANCED_MODEL" ).define( "TEXTURE_ARRAY" );
+		mFormatShadowMapInstanced = gl::GlslProg::Format().version( 330 )
+			.vertex( loadAsset( "shaders/common/pass_through.vert" ) )
+			.fragment( loadAsset( "shaders/deferred/shadow_map.frag" ) )
+			.define( "INSTANCED_MODEL" );
 	}
-	if ( mBatchRayOccludeRect ) {
-		mBatchRayOccludeRect->getGlslProg()->uniform( "uSamplerDepth",			0 );
-		mBatchRayOccludeRect->getGlslProg()->uniform( "uSamplerLightDepth",		1 );
+
+	gl::GlslProg::Format format = mFormatGBufferInstanced;
+	if ( mInstanceLayout == InstanceLayout_Matrices ) {
+		format.define( "INSTANCE_MATRICES" );
+	} else if ( mInstanceLayout == InstanceLayout_Trs ) {
+		format.define( "INSTANCE_TRS" );
+	}
+	gl::GlslProgRef gBufferInst = loadGlslProg( format );
+	gBufferInst->uniform( "uTextureArray", TEXTURE_UNIT_TEXTURE_ARRAY );
+
+	// Shadow casters only write depth, so they are drawn with a minimal
+	// program which reads just the model matrix from the instance data
+	gl::GlslProg::Format shadowMapFormat = mFormatShadowMapInstanced;
+	if ( mInstanceLayout == InstanceLayout_Trs ) {
+		shadowMapFormat.define( "INSTANCE_TRS" );
 	}
-	if ( mBatchRayScatterRect ) {
-		mBatchRayScatterRect->getGlslProg()->uniform( "uSampler",				0 );
+	gl::GlslProgRef shadowMapInst = loadGlslProg( shadowMapFormat );
+
+	gl::Batch::AttributeMapping mapping;
+	if ( mInstanceLayout == InstanceLayout_Trs ) {
+		mapping = {
+			{ geom::Attrib::CUSTOM_0, "vInstanceTranslationScale" },
+			{ geom::Attrib::CUSTOM_1, "vInstanceRotation" },
+			{ geom::Attrib::CUSTOM_2, "vInstanceScale" }
+		};
+	} else {
+		mapping = {
+			{ geom::Attrib::CUSTOM_0, "vInstanceModelMatrix" },
+			{ geom::Attrib::CUSTOM_1, "vInstanceNormalMatrix" },
+			{ geom::Attrib::CUSTOM_2, "vInstanceModelViewMatrix" }
+		};
 	}
-    mBatchSaoAoRect->getGlslProg()->uniform(			"uSampler",				0 );
-    mBatchSaoBlurRect->getGlslProg()->uniform(			"uSampler",				0 );
-    mBatchSaoCszRect->getGlslProg()->uniform(			"uSamplerDepth",		0 );
 
-    for ( auto &b : mBatchGBuffers ) {        
-		b.batch->getGlslProg()->uniform( "uTexture", 0 );
-		b.batch->getGlslProg()->uniform( "uCubeMap", 1 );
-    }
-    
-    // Bind uniform buffer blocks to shaders
-    mBatchDebugRect->getGlslProg()->uniformBlock(					"Materials",	UBO_LOCATION_MATERIALS );
-    mBatchEmissiveRect->getGlslProg()->uniformBlock(				"Materials",	UBO_LOCATION_MATERIALS );
-    mBatchGBufferLightSourceSphere->getGlslProg()->uniformBlock(	"Lights",		UBO_LOCATION_LIGHTS );
-    mBatchLBufferLightCube->getGlslProg()->uniformBlock(			"Lights",		UBO_LOCATION_LIGHTS );
-    mBatchLBufferLightCube->getGlslProg()->uniformBlock(			"Materials",	UBO_LOCATION_MATERIALS );
-	if ( mBatchRayLightSphere ) {
-		mBatchRayLightSphere->getGlslProg()->uniformBlock(			"Lights",		UBO_LOCATION_LIGHTS );
+	const size_t stride		= getInstanceStride( mInstanceLayout );
+	const size_t numRegions	= mEnabledStreaming ? kNumInstanceRegions : 1;
+	for ( const auto &obj : mScene.mInstancedModels ) {
+		const InstancedModel &model = obj.get();
+		const gl::GlslProgRef programs[ NUM_INSTANCE_SECTIONS ] = {
+			model.hasShader() ? model.getShader() : gBufferInst,
+			shadowMapInst
+		};
+
+		InstancedModelBatch b;
+		b.obj			= obj;
+		b.shader		= model.getShader();
+		b.blankTextures	= model.hasBlankTextures();
+		b.streaming		= mEnabledStreaming;
+		b.capacity		= math< size_t >::max( model.capacity(), 1 );
+		b.vbo			= createInstanceVbo( getSectionOffset( b.capacity, stride, numRegions, 0 ), b.streaming, &b.mapped );
+		InstancedModelPass* passes[ NUM_INSTANCE_SECTIONS ] = { &b.gBuffer, &b.shadowMap };
+		for ( size_t region = 0; region < numRegions; ++region ) {
+			for ( size_t section = 0; section < NUM_INSTANCE_SECTIONS; ++section ) {
+				const geom::BufferLayout layout = getInstanceBufferLayout( mInstanceLayout, getSectionOffset( b.capacity, stride, region, section ) );
+				passes[ section ]->batches.push_back( gl::Batch::create( createInstanceMesh( model, layout, b.vbo ), programs[ section ], mapping ) );
+			}
+		}
+
+		// Static instances don't depend on the camera, so both passes draw
+		// all of them from one buffer. It is filled on the next draw.
+		b.statics.capacity	= math< size_t >::max( model.getNumStatic(), 1 );
+		b.statics.vbo		= gl::Vbo::create( GL_ARRAY_BUFFER, b.statics.capacity * stride, nullptr, GL_DYNAMIC_DRAW );
+		const gl::VboMeshRef staticMesh = createInstanceMesh( model, getInstanceBufferLayout( mInstanceLayout ), b.statics.vbo );
+		for ( size_t section = 0; section < NUM_INSTANCE_SECTIONS; ++section ) {
+			passes[ section ]->batch		= passes[ section ]->batches.front();
+			passes[ section ]->staticBatch	= gl::Batch::create( staticMesh, programs[ section ], mapping );
+		}
+
+		b.gBuffer.batch->getGlslProg()->uniform( "uTexture", 0 );
+		b.gBuffer.batch->getGlslProg()->uniform( "uCubeMap", 1 );
+		mInstancedModelBatches.push_back( b );
 	}
-	if ( mBatchRayScatterRect ) {
-		mBatchRayScatterRect->getGlslProg()->uniformBlock(			"Lights",		UBO_LOCATION_LIGHTS );
+	createIndirectBatch( format, mapping );
+
+	mInstanceLayoutPrev		= mInstanceLayout;
+	mEnabledStreamingPrev	= mEnabledStreaming;
+	mEnabledMultiDrawPrev	= mEnabledMultiDraw;
+}
+
+void DeferredRenderer::createIndirectBatch( const gl::GlslProg::Format &format, const gl::Batch::AttributeMapping &mapping )
+{
+	mBatchGBufferIndirect	= nullptr;
+	mVboIndirectInstances	= nullptr;
+	mVboIndirectDrawIds		= nullptr;
+	mIndirectCapacity		= 0;
+	mTextureIndirect		= nullptr;
+	mTextureCubeMapIndirect	= nullptr;
+	if ( ! mEnabledMultiDraw ) {
+		return;
 	}
-    
-    // Set uniforms which need to know about screen dimensions
-    const vec2 szGBuffer	= mFboGBuffer	? mFboGBuffer->getSize()	: windowSize;
-    const vec2 szPingPong	= mFboPingPong	? mFboPingPong->getSize()	: windowSize;
-    const vec2 szRay		= mFboRayColor	? mFboRayColor->getSize()	: windowSize / 2;
-    mBatchAoCompositeRect->getGlslProg()->uniform(		"uOffset",		mOffset );
-    mBatchAoCompositeRect->getGlslProg()->uniform(		"uWindowSize",	szGBuffer );
-    mBatchBloomCompositeRect->getGlslProg()->uniform(	"uPixel",		vec2( 1.0f ) / vec2( szPingPong ) );
-    mBatchDofRect->getGlslProg()->uniform(				"uAspect",		windowSize.x / (float)windowSize.y );
-    mBatchDofRect->getGlslProg()->uniform(				"uOffset",		mOffset );
-    mBatchDofRect->getGlslProg()->uniform(				"uWindowSize",	szGBuffer );
-    mBatchFogRect->getGlslProg()->uniform(				"uOffset",		mOffset );
-    mBatchFogRect->getGlslProg()->uniform(				"uWindowSize",	szGBuffer );
-    mBatchEmissiveRect->getGlslProg()->uniform(			"uOffset",		mOffset );
-    mBatchEmissiveRect->getGlslProg()->uniform(			"uWindowSize",	szGBuffer );
-    mBatchFxaaRect->getGlslProg()->uniform(				"uPixel",		1.0f / vec2( szPingPong ) );
-    mBatchLBufferLightCube->getGlslProg()->uniform(		"uOffset",		mOffset );
-    mBatchLBufferLightCube->getGlslProg()->uniform(		"uWindowSize",	szGBuffer );
-    mBatchLBufferShadowRect->getGlslProg()->uniform(	"uOffset",		mOffset );
-    mBatchLBufferShadowRect->getGlslProg()->uniform(	"uWindowSize",	szGBuffer );
-	if ( mBatchRayCompositeRect ) {
-		mBatchRayCompositeRect->getGlslProg()->uniform( "uPixel",		vec2( 1.0f ) / vec2( szRay ) );
+
+#if defined( GL_DRAW_INDIRECT_BUFFER )
+	const bool supported = gl::isExtensionAvailable( "GL_ARB_multi_draw_indirect" ) &&
+		gl::isExtensionAvailable( "GL_ARB_base_instance" );
+#else
+	const bool supported = false;
+#endif
+	if ( ! supported ) {
+		CI_LOG_W( "Multi-draw indirect is not supported, models will be drawn separately" );
+		return;
+	}
+
+	// Models with their own shader or textures keep their own draw. The rest
+	// have their meshes packed into one vertex and index buffer; meshes
+	// shared between models are packed once.
+	vector< IndirectVertex > vertices;
+	vector< uint32_t > indices;
+	map< gl::VboMesh*, const InstancedModelBatch* > packed;
+	for ( auto &b : mInstancedModelBatches ) {
+		const InstancedModel &model		= b.obj.get();
+		const gl::VboMeshRef &mesh		= model.getMesh();
+		if ( model.hasShader() || ! model.hasBlankTextures() || mesh->getGlPrimitive() != GL_TRIANGLES ) {
+			continue;
+		}
+		if ( ! mTextureIndirect ) {
+			mTextureIndirect		= model.getTexture();
+			mTextureCubeMapIndirect	= model.getTextureCubeMap();
+		}
+		b.indirect = true;
+
+		auto iter = packed.find( mesh.get() );
+		if ( iter != packed.end() ) {
+			b.firstIndex	= iter->second->firstIndex;
+			b.indexCount	= iter->second->indexCount;
+			b.baseVertex	= iter->second->baseVertex;
+			continue;
+		}
+		packed[ mesh.get() ] = &b;
+
+		const vector< vec4 > positions	= readVertexAttrib( mesh, geom::Attrib::POSITION, vec4( 0.0f ) );
+		const vector< vec4 > normals	= readVertexAttrib( mesh, geom::Attrib::NORMAL, vec4( 0.0f ) );
+		const vector< vec4 > colors		= readVertexAttrib( mesh, geom::Attrib::COLOR, vec4( 0.0f, 0.0f, 0.0f, 1.0f ) );
+		const vector< vec4 > uvs		= readVertexAttrib( mesh, geom::Attrib::TEX_COORD_0, vec4( 0.0f ) );
+		const vector< uint32_t > meshIndices = readIndices( mesh );
+
+		b.firstIndex	= (GLuint)indices.size();
+		b.indexCount	= (GLuint)meshIndices.size();
+		b.baseVertex	= (GLint)vertices.size();
+		for ( size_t i = 0; i < positions.size(); ++i ) {
+			IndirectVertex v;
+			v.position	= vec3( positions[ i ] );
+			v.normal	= vec3( normals[ i ] );
+			v.color		= colors[ i ];
+			v.uv		= vec2( uvs[ i ] );
+			vertices.push_back( v );
+		}
+		indices.insert( indices.end(), meshIndices.begin(), meshIndices.end() );
+	}
+	if ( vertices.empty() ) {
+		return;
+	}
+
+	geom::BufferLayout vertexLayout;
+	const size_t vertexStride = sizeof( IndirectVertex );
+	vertexLayout.append( geom::Attrib::POSITION,	3, vertexStride, offsetof( IndirectVertex, position ) );
+	vertexLayout.append( geom::Attrib::NORMAL,		3, vertexStride, offsetof( IndirectVertex, normal ) );
+	vertexLayout.append( geom::Attrib::COLOR,		4, vertexStride, offsetof( IndirectVertex, color ) );
+	vertexLayout.append( geom::Attrib::TEX_COORD_0,	2, vertexStride, offsetof( IndirectVertex, uv ) );
+
+	// Instance data and draw IDs are rewritten every frame and reallocated
+	// under the same names, so the VAO stays valid as they grow
+	geom::BufferLayout drawIdLayout;
+	drawIdLayout.append( geom::Attrib::CUSTOM_3, 1, sizeof( float ), 0, 1 );
+	mIndirectCapacity		= 1;
+	mVboIndirectInstances	= gl::Vbo::create( GL_ARRAY_BUFFER, getInstanceStride( mInstanceLayout ), nullptr, GL_STREAM_DRAW );
+	mVboIndirectDrawIds		= gl::Vbo::create( GL_ARRAY_BUFFER, sizeof( float ), nullptr, GL_STREAM_DRAW );
+
+	vector< pair< geom::BufferLayout, gl::VboRef > > layoutVbos;
+	layoutVbos.push_back( make_pair( vertexLayout, gl::Vbo::create( GL_ARRAY_BUFFER, vertices, GL_STATIC_DRAW ) ) );
+	layoutVbos.push_back( make_pair( getInstanceBufferLayout( mInstanceLayout ), mVboIndirectInstances ) );
+	layoutVbos.push_back( make_pair( drawIdLayout, mVboIndirectDrawIds ) );
+	const gl::VboMeshRef mesh = gl::VboMesh::create( (uint32_t)vertices.size(), GL_TRIANGLES, layoutVbos,
+		(uint32_t)indices.size(), GL_UNSIGNED_INT, gl::Vbo::create( GL_ELEMENT_ARRAY_BUFFER, indices, GL_STATIC_DRAW ) );
+
+	gl::GlslProg::Format indirectFormat = format;
+	indirectFormat.define( "MULTI_DRAW" );
+	gl::Batch::AttributeMapping indirectMapping = mapping;
+	indirectMapping[ geom::Attrib::CUSTOM_3 ] = "vInstanceDrawId";
+	mBatchGBufferIndirect = gl::Batch::create( mesh, loadGlslProg( indirectFormat ), indirectMapping );
+	mBatchGBufferIndirect->getGlslProg()->uniform( "uBufferDraws",	TEXTURE_UNIT_DRAWS );
+	mBatchGBufferIndirect->getGlslProg()->uniform( "uTexture",		0 );
+	mBatchGBufferIndirect->getGlslProg()->uniform( "uCubeMap",		1 );
+	mBatchGBufferIndirect->getGlslProg()->uniform( "uTextureArray",	TEXTURE_UNIT_TEXTURE_ARRAY );
+}
+
+void DeferredRenderer::appendIndirect( const InstancedModelBatch &b, const Model* models, size_t count )
+{
+	const GLsizei staticCount = b.gBuffer.staticCount;
+	if ( count == 0 && staticCount == 0 ) {
+		return;
+	}
+
+	// Both of the model's draws share its texture matrix and material
+	const InstancedModel &model	= b.obj.get();
+	const GLuint drawId			= (GLuint)( mIndirectDraws.size() / INDIRECT_DRAW_SIZE );
+	const mat4 textureMatrix	= model.getTextureMatrix();
+	for ( int32_t i = 0; i < 4; ++i ) {
+		mIndirectDraws.push_back( textureMatrix[ i ] );
+	}
+	const TextureLayer &layer = model.getTextureLayer();
+	mIndirectDraws.push_back( vec4( (float)model.getMaterialId(), layer.isValid() ? (float)layer.layer : -1.0f, 0.0f, 0.0f ) );
+
+	DrawElementsIndirectCommand command = { b.indexCount, 0, b.firstIndex, b.baseVertex, 0 };
+	if ( count > 0 ) {
+		const size_t stride = getInstanceStride( mInstanceLayout );
+		const size_t offset = mIndirectInstances.size();
+		mIndirectInstances.resize( offset + count * stride );
+		packInstances( models, count, mInstanceLayout, mIndirectInstances.data() + offset );
+		mIndirectDrawIds.insert( mIndirectDrawIds.end(), count, (float)drawId );
+
+		command.instanceCount	= (GLuint)count;
+		command.baseInstance	= (GLuint)( offset / stride );
+		mIndirectCommands.push_back( command );
+		mIndirectCommandArrays.push_back( layer.array );
+	}
+	if ( staticCount > 0 ) {
+		IndirectStaticCopy staticCopy = { b.statics.vbo, mIndirectCommands.size(), drawId, 0, 0 };
+		mIndirectStaticCopies.push_back( staticCopy );
+		command.instanceCount	= (GLuint)staticCount;
+		mIndirectCommands.push_back( command );
+		mIndirectCommandArrays.push_back( layer.array );
+	}
+}
+
+void DeferredRenderer::uploadIndirect()
+{
+	// Static instances go behind the dynamic ones
+	const size_t stride			= getInstanceStride( mInstanceLayout );
+	const size_t dynamicBytes	= mIndirectInstances.size();
+	for ( IndirectStaticCopy &staticCopy : mIndirectStaticCopies ) {
+		DrawElementsIndirectCommand &command = mIndirectCommands[ staticCopy.command ];
+		command.baseInstance	= (GLuint)mIndirectDrawIds.size();
+		staticCopy.first		= command.baseInstance;
+		staticCopy.count		= command.instanceCount;
+		mIndirectDrawIds.insert( mIndirectDrawIds.end(), command.instanceCount, (float)staticCopy.drawId );
+	}
+
+	// Group commands by texture array. Static copies refer to commands by
+	// index, so this comes after they have been placed.
+	if ( ! is_sorted( mIndirectCommandArrays.begin(), mIndirectCommandArrays.end() ) ) {
+		vector< size_t > order( mIndirectCommands.size() );
+		iota( order.begin(), order.end(), 0 );
+		stable_sort( order.begin(), order.end(), [ & ]( size_t a, size_t b ) {
+			return mIndirectCommandArrays[ a ] < mIndirectCommandArrays[ b ];
+		} );
+		vector< DrawElementsIndirectCommand > commands;
+		vector< int32_t > arrays;
+		commands.reserve( order.size() );
+		arrays.reserve( order.size() );
+		for ( size_t i : order ) {
+			commands.push_back( mIndirectCommands[ i ] );
+			arrays.push_back( mIndirectCommandArrays[ i ] );
+		}
+		mIndirectCommands.swap( commands );
+		mIndirectCommandArrays.swap( arrays );
+	}
+	mIndirectRanges.clear();
+	for ( size_t i = 0; i < mIndirectCommandArrays.size(); ++i ) {
+		if ( mIndirectRanges.empty() || mIndirectRanges.back().array != mIndirectCommandArrays[ i ] ) {
+			IndirectRange range = { mIndirectCommandArrays[ i ], i, 0 };
+			mIndirectRanges.push_back( range );
+		}
+		++mIndirectRanges.back().count;
+	}
+
+	const size_t count = mIndirectDrawIds.size();
+	if ( count > mIndirectCapacity ) {
+		mIndirectCapacity = math< size_t >::max( count, mIndirectCapacity * 2 );
 	}
-	if ( mBatchRayScatterRect ) {
-		mBatchRayScatterRect->getGlslProg()->uniform(	"uOffset",		mOffset * ( szRay / szGBuffer ) );
-		mBatchRayScatterRect->getGlslProg()->uniform(	"uWindowSize",	szRay );
+
+	// Orphan last frame's storage rather than wait for draws reading it
+	mVboIndirectInstances->bufferData( mIndirectCapacity * stride, nullptr, GL_STREAM_DRAW );
+	mVboIndirectDrawIds->bufferData( mIndirectCapacity * sizeof( float ), nullptr, GL_STREAM_DRAW );
+	if ( dynamicBytes > 0 ) {
+		mVboIndirectInstances->bufferSubData( 0, dynamicBytes, mIndirectInstances.data() );
+	}
+	if ( count > 0 ) {
+		mVboIndirectDrawIds->bufferSubData( 0, count * sizeof( float ), mIndirectDrawIds.data() );
 	}
+	if ( ! mIndirectStaticCopies.empty() ) {
+		const gl::ScopedBuffer scopedWriteBuffer( GL_COPY_WRITE_BUFFER, mVboIndirectInstances->getId() );
+		for ( const IndirectStaticCopy &staticCopy : mIndirectStaticCopies ) {
+			const gl::ScopedBuffer scopedReadBuffer( GL_COPY_READ_BUFFER, staticCopy.vbo->getId() );
+			glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+								 staticCopy.first * stride, staticCopy.count * stride );
+		}
+	}
+	mUploadedInstanceBytes += dynamicBytes + count * sizeof( float );
+
+	const size_t commandBytes = mIndirectCommands.size() * sizeof( DrawElementsIndirectCommand );
+	if ( ! mBufferIndirectCommands ) {
+		mBufferIndirectCommands = gl::BufferObj::create( GL_DRAW_INDIRECT_BUFFER, commandBytes, mIndirectCommands.data(), GL_STREAM_DRAW );
+	} else {
+		mBufferIndirectCommands->bufferData( commandBytes, mIndirectCommands.data(), GL_STREAM_DRAW );
+	}
+	uploadTextureBuffer( mBufferIndirectDraws, mTextureIndirectDraws, GL_RGBA32F,
+						 mIndirectDraws.data(), mIndirectDraws.size() * sizeof( vec4 ) );
 }
 
-void setLightUBO( Light* ubo, const Light& light )
+void DeferredRenderer::uploadInstances( InstancedModelBatch &b, size_t section, const ViewFrustum &frustum )
 {
-	ubo->setPosition(		light.getPosition()			);
-	ubo->setColorAmbient(	light.getColorAmbient()		);
-	ubo->setColorDiffuse(	light.getColorDiffuse()		);
-	ubo->setColorSpecular(	light.getColorSpecular()	);
-	ubo->setRadius(			light.getRadius()			);
-	ubo->setVolume(			light.getVolume()			);
-	ubo->setIntensity(		light.getIntensity()		);
+	const InstancedModel &model	= b.obj.get();
+	InstancedModelPass &pass	= section == 0 ? b.gBuffer : b.shadowMap;
+	pass.count			= 0;
+	pass.staticCount	= 0;
+	if ( ! b.obj.isVisible() ) {
+		return;
+	}
+
+	// Static instances are culled as one group
+	const StaticInstances &statics = b.statics;
+	if ( statics.count > 0 && ( ! mEnabledCulling || statics.bounds.getRadius() < 0.0f ||
+		frustum.intersects( statics.bounds.getCenter(), statics.bounds.getRadius() ) ) ) {
+		pass.staticCount = statics.count;
+	}
+
+	if ( model.size() == model.getNumStatic() ) {
+		if ( section == 0 && b.indirect ) {
+			appendIndirect( b, nullptr, 0 );
+		}
+		return;
+	}
+	if ( model.size() > b.capacity ) {
+		reserveInstances( b, model.capacity() );
+	}
+
+	const Model* models	= model.data();
+	size_t count		= model.size();
+	if ( mEnabledCulling ) {
+		mCulledModels.resize( model.size() );
+		count	= model.cull( frustum, mCulledModels.data() );
+		models	= mCulledModels.data();
+	} else if ( model.getNumStatic() > 0 ) {
+		mCulledModels.resize( model.size() );
+		count	= model.copyDynamic( mCulledModels.data() );
+		models	= mCulledModels.data();
+	}
+	if ( section == 0 && b.indirect ) {
+		appendIndirect( b, models, count );
+		pass.count = (GLsizei)count;
+		return;
+	}
+
+	const size_t stride	= getInstanceStride( mInstanceLayout );
+	const size_t bytes	= count * stride;
+	const size_t region	= b.streaming ? mInstanceRegion : 0;
+	const size_t offset	= getSectionOffset( b.capacity, stride, region, section );
+	if ( count > 0 ) {
+		if ( ! b.streaming ) {
+			mPackedInstances.resize( bytes );
+			packInstances( models, count, mInstanceLayout, mPackedInstances.data() );
+			b.vbo->bufferSubData( offset, bytes, mPackedInstances.data() );
+		} else if ( b.mapped != nullptr ) {
+
+			// The region's fence has already been waited on, so its previous
+			// contents are no longer being read and may be overwritten directly
+			packInstances( models, count, mInstanceLayout, b.mapped + offset );
+		} else {
+			const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+			void* dst = b.vbo->mapBufferRange( offset, bytes, access );
+			CI_ASSERT_MSG( dst != nullptr, "Unable to map instance buffer region" );
+			packInstances( models, count, mInstanceLayout, dst );
+			b.vbo->unmap();
+		}
+	}
+	pass.batch = pass.batches[ region ];
+	pass.count = (GLsizei)count;
+	mUploadedInstanceBytes += bytes;
+}
+
+void DeferredRenderer::uploadStaticInstances( InstancedModelBatch &b )
+{
+	StaticInstances &statics			= b.statics;
+	const InstancedModel &model			= b.obj.get();
+	const vector< uint32_t > &indices	= model.getStaticIndices();
+	const size_t stride					= getInstanceStride( mInstanceLayout );
+
+	// Writes static instances [first, last) to their place in the buffer and
+	// grows the group's bounds to enclose them
+	auto upload = [ & ]( size_t first, size_t last ) {
+		const size_t count = last - first;
+		mCulledModels.resize( count );
+		for ( size_t i = 0; i < count; ++i ) {
+			mCulledModels[ i ] = model.data()[ indices[ first + i ] ];
+		}
+		const size_t bytes = count * stride;
+		mPackedInstances.resize( bytes );
+		packInstances( mCulledModels.data(), count, mInstanceLayout, mPackedInstances.data() );
+		statics.vbo->bufferSubData( first * stride, bytes, mPackedInstances.data() );
+		mUploadedInstanceBytes += bytes;
+
+		if ( statics.bounds.getRadius() >= 0.0f ) {
+			for ( size_t i = first; i < last; ++i ) {
+				const Sphere bounds = model.getInstanceBounds( indices[ i ] );
+				statics.bounds.setRadius( math< float >::max( statics.bounds.getRadius(),
+					glm::distance( statics.bounds.getCenter(), bounds.getCenter() ) + bounds.getRadius() ) );
+			}
+		}
+	};
+
+	if ( statics.version != model.getStaticVersion() ) {
+
+		// The static set changed, so everything is packed again. Reallocating
+		// under the same buffer name keeps the batches' VAOs valid.
+		if ( indices.size() > statics.capacity ) {
+			statics.capacity = math< size_t >::max( indices.size(), statics.capacity * 2 );
+			statics.vbo->bufferData( statics.capacity * stride, nullptr, GL_DYNAMIC_DRAW );
+		}
+
+		vec3 center( 0.0f );
+		for ( uint32_t i : indices ) {
+			center += model.getInstanceBounds( i ).getCenter();
+		}
+		center /= (float)math< size_t >::max( indices.size(), 1 );
+		statics.bounds = Sphere( center, model.hasBounds() ? 0.0f : -1.0f );
+
+		if ( ! indices.empty() ) {
+			upload( 0, indices.size() );
+		}
+		statics.count	= (GLsizei)indices.size();
+		statics.version	= model.getStaticVersion();
+	} else {
+		for ( const auto &range : model.dirtyStaticRanges( STATIC_INSTANCE_RANGE_GAP ) ) {
+			upload( range.first, range.second );
+		}
+	}
+
+	if ( model.isDirty() ) {
+		b.obj.getUntracked().clearDirty();
+	}
+}
+
+void DeferredRenderer::reserveInstances( InstancedModelBatch &b, size_t capacity )
+{
+	// Section offsets move with the capacity, and persistently mapped storage
+	// is immutable, so the buffer is replaced and every VAO rebound to it
+	const InstancedModel &model	= b.obj.get();
+	const size_t stride			= getInstanceStride( mInstanceLayout );
+	const size_t numRegions		= b.gBuffer.batches.size();
+	b.capacity	= capacity;
+	b.vbo		= createInstanceVbo( getSectionOffset( b.capacity, stride, numRegions, 0 ), b.streaming, &b.mapped );
+	InstancedModelPass* passes[ NUM_INSTANCE_SECTIONS ] = { &b.gBuffer, &b.shadowMap };
+	for ( size_t region = 0; region < numRegions; ++region ) {
+		for ( size_t section = 0; section < NUM_INSTANCE_SECTIONS; ++section ) {
+			const geom::BufferLayout layout = getInstanceBufferLayout( mInstanceLayout, getSectionOffset( b.capacity, stride, region, section ) );
+			passes[ section ]->batches[ region ]->replaceVboMesh( createInstanceMesh( model, layout, b.vbo ) );
+		}
+	}
+}
+
+void DeferredRenderer::waitForInstanceRegion()
+{
+	GLsync &fence = mInstanceFences[ mInstanceRegion ];
+	if ( fence == nullptr ) {
+		return;
+	}
+
+	// The region was last written kNumInstanceRegions frames ago, so this
+	// normally returns immediately. Waiting here only happens when the CPU
+	// runs that far ahead of the GPU.
+	GLenum result = GL_TIMEOUT_EXPIRED;
+	while ( result == GL_TIMEOUT_EXPIRED ) {
+		result = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000 );
+	}
+	if ( result == GL_WAIT_FAILED ) {
+		CI_LOG_W( "Waiting on instance buffer fence failed" );
+	}
+	glDeleteSync( fence );
+	fence = nullptr;
+}
+
+void DeferredRenderer::uploadVisibleLights( const ViewFrustum &frustum )
+{
+	const auto &lights = mScene.mLightData;
+
+	mVisibleLightIndices.clear();
+	for ( size_t i = 0; i < lights.size(); ++i ) {
+		if ( ! lights.flags( i ).visible ) continue;
+		if ( mEnabledCulling && ! frustum.intersects( lights[ i ].getPosition(), lights[ i ].getVolume() ) ) continue;
+		mVisibleLightIndices.push_back( (int32_t)i );
+	}
+
+	uploadTextureBuffer( mBufferVisibleLights, mTextureVisibleLights, GL_R32I,
+						 mVisibleLightIndices.data(), mVisibleLightIndices.size() * sizeof( int32_t ) );
+}
+
+void DeferredRenderer::uploadLightClusters()
+{
+	const CameraPersp &camera = mScene.mCamera;
+	mLightClusters.update( camera.getViewMatrix(), camera.getProjectionMatrix(),
+						   camera.getNearClip(), camera.getFarClip(),
+						   mScene.mLightData.data(), mVisibleLightIndices.data(), mVisibleLightIndices.size() );
+
+	const auto &clusters	= mLightClusters.getClusters();
+	const auto &indices		= mLightClusters.getLightIndices();
+	uploadTextureBuffer( mBufferClusters, mTextureClusters, GL_RG32I,
+						 clusters.data(), clusters.size() * sizeof( ivec2 ) );
+	uploadTextureBuffer( mBufferClusterLights, mTextureClusterLights, GL_R32I,
+						 indices.data(), indices.size() * sizeof( int32_t ) );
+}
+
+// Drops batches of models which have been removed from the scene
+void DeferredRenderer::removeStaleBatches()
+{
+	auto isRemoved = []( const InstancedModelBatch &b ) { return ! b.obj; };
+	mInstancedModelBatches.erase( std::remove_if( mInstancedModelBatches.begin(), mInstancedModelBatches.end(), isRemoved ), mInstancedModelBatches.end() );
 }
 
 void DeferredRenderer::update()
 {    
-    // Call resize to rebuild buffers when render quality
-    // or AO method changes
+    // Call resize to rebuild buffers when render quality or AO method
+    // changes. Targets of disabled effects are released by the render graph.
     if ( mAoPrev			!= mAo			||
-        mEnabledRayPrev		!= mEnabledRay	||
         mHighQualityPrev	!= mHighQuality ) {
         resize( mWindowSize );
         mAoPrev				= mAo;
-        mEnabledRayPrev		= mEnabledRay;
         mHighQualityPrev	= mHighQuality;
     }
 
-	// FIXME: don't write UBOs unless necessary
+    // Make batches of programs built since the last frame, and request
+    // programs of effects enabled since then
+    if ( mProgramQueue ) {
+        mProgramQueue->poll();
+    }
+    if ( updateEffects() ) {
+        setUniforms( mWindowSize );
+    }
+    if ( mInstanceLayoutPrev	!= mInstanceLayout		||
+        mEnabledStreamingPrev	!= mEnabledStreaming	||
+        mEnabledMultiDrawPrev	!= mEnabledMultiDraw ) {
+        createInstanceBatches();
+    }
+
+	removeStaleBatches();
 
-    // Update light properties in UBO
-	{
-		auto ubo = mScene.getUboLight();
-		Light* lights = (Light*)ubo->mapWriteOnly();
-		for ( const Light& light : mScene.mLightData ) {
-			setLightUBO( lights, light );
-			++lights;
+	// A model given its own shader needs batches with that program, and one
+	// given textures can no longer be part of the multi-draw, or vice versa
+	for ( const auto &b : mInstancedModelBatches ) {
+		const InstancedModel &model = b.obj.get();
+		if ( model.getShader() != b.shader || ( mEnabledMultiDraw && model.hasBlankTextures() != b.blankTextures ) ) {
+			createInstanceBatches();
+			break;
 		}
-		ubo->unmap();
 	}
 
-	{
-		if ( mScene.getUboRayLight() ) {
-			auto ubo = mScene.getUboRayLight();
-			Light* lights = (Light*)ubo->mapWriteOnly();
-			for ( const Light& light : mScene.mRayLightData ) {
-				setLightUBO( lights, light );
-				++lights;
-			}
-			ubo->unmap();
-		}
-	}
-}
+	mUploadedBytes = 0;
 
+    // Upload modified light properties. Buffers grow as lights are added.
+	mUploadedBytes += mScene.mLightBuffer.update( mScene.mLightData );
+	mUploadedBytes += mScene.mRayLightBuffer.update( mScene.mRayLightData );
+
+	// Upload modified material properties. Materials are only indexed by
+	// shaders, so edits never require rebuilding programs or batches.
+	mUploadedBytes += mScene.mMaterialBuffer.update( mScene.mMaterialData );
+}
@@ -0,0 +1,143 @@
+#include "LightClusters.hpp"
+
+#include <algorithm>
+#include <limits>
+
+using namespace ci;
+using namespace std;
+
+LightClusters::LightClusters( const ivec3 &grid ) :
+	mNear( 0.1f ), mFar( 100.0f ), mSliceScale( 0.0f )
+{
+	setGrid( grid );
+}
+
+void LightClusters::setGrid( const ivec3 &grid )
+{
+	mGrid = glm::max( grid, ivec3( 1 ) );
+	mClusters.assign( getNumClusters(), ivec2( 0 ) );
+}
+
+float LightClusters::sliceDepth( int32_t slice ) const
+{
+	return mNear * glm::pow( mFar / mNear, (float)slice / (float)mGrid.z );
+}
+
+int32_t LightClusters::depthSlice( float depth ) const
+{
+	return glm::clamp( (int32_t)( glm::log( depth / mNear ) * mSliceScale ), 0, mGrid.z - 1 );
+}
+
+int32_t LightClusters::ndcTile( float ndc, int32_t tiles ) const
+{
+	return glm::clamp( (int32_t)glm::floor( ( ndc * 0.5f + 0.5f ) * (float)tiles ), 0, tiles - 1 );
+}
+
+ivec3 LightClusters::getCell( const vec3 &p ) const
+{
+	const float depth = -p.z;
+	if ( depth < mNear || depth > mFar ) {
+		return ivec3( -1 );
+	}
+
+	// ndc = ( P * p ).xy / depth, written out for a perspective projection
+	const float nx = ( mProjection[ 0 ][ 0 ] * p.x ) / depth - mProjection[ 2 ][ 0 ];
+	const float ny = ( mProjection[ 1 ][ 1 ] * p.y ) / depth - mProjection[ 2 ][ 1 ];
+	return ivec3( ndcTile( nx, mGrid.x ), ndcTile( ny, mGrid.y ), depthSlice( depth ) );
+}
+
+void LightClusters::update( const mat4 &viewMatrix, const mat4 &projectionMatrix,
+						   float nearClip, float farClip,
+						   const Light* lights, const int32_t* indices, size_t count )
+{
+	mProjection	= projectionMatrix;
+	mNear		= nearClip;
+	mFar		= farClip;
+	mSliceScale	= (float)mGrid.z / glm::log( mFar / mNear );
+
+	const float p00 = mProjection[ 0 ][ 0 ];
+	const float p11 = mProjection[ 1 ][ 1 ];
+	const float p20 = mProjection[ 2 ][ 0 ];
+	const float p21 = mProjection[ 2 ][ 1 ];
+
+	// View-space extent of ndc coordinate n at depth d, inverting getCell()
+	auto viewX = [ & ]( float n, float d ) { return ( n + p20 ) * d / p00; };
+	auto viewY = [ & ]( float n, float d ) { return ( n + p21 ) * d / p11; };
+
+	mAssignments.clear();
+	for ( size_t i = 0; i < count; ++i ) {
+		const int32_t index	= indices[ i ];
+		const Light &light	= lights[ index ];
+		const vec3 c		= vec3( viewMatrix * vec4( light.getPosition(), 1.0f ) );
+		const float r		= light.getVolume();
+		const float depth	= -c.z;
+
+		const float dMin	= glm::max( depth - r, mNear );
+		const float dMax	= glm::min( depth + r, mFar );
+		if ( dMin > dMax ) continue;
+
+		// Conservative tile bounds from the sphere's view-space box. A sphere
+		// which crosses the near plane can cover any part of the screen.
+		ivec2 lo( 0 );
+		ivec2 hi( mGrid.x - 1, mGrid.y - 1 );
+		if ( depth - r > mNear ) {
+			vec2 nMin( numeric_limits< float >::max() );
+			vec2 nMax( -numeric_limits< float >::max() );
+			for ( float d : { dMin, dMax } ) {
+				for ( float s : { -r, r } ) {
+					const vec2 n( p00 * ( c.x + s ) / d - p20, p11 * ( c.y + s ) / d - p21 );
+					nMin = glm::min( nMin, n );
+					nMax = glm::max( nMax, n );
+				}
+			}
+			if ( nMax.x < -1.0f || nMin.x > 1.0f || nMax.y < -1.0f || nMin.y > 1.0f ) continue;
+			lo = ivec2( ndcTile( nMin.x, mGrid.x ), ndcTile( nMin.y, mGrid.y ) );
+			hi = ivec2( ndcTile( nMax.x, mGrid.x ), ndcTile( nMax.y, mGrid.y ) );
+		}
+
+		// Refine by testing the sphere against each candidate cluster's box
+		const int32_t zLo = depthSlice( dMin );
+		const int32_t zHi = depthSlice( dMax );
+		for ( int32_t z = zLo; z <= zHi; ++z ) {
+			const float d0 = sliceDepth( z );
+			const float d1 = sliceDepth( z + 1 );
+			for ( int32_t y = lo.y; y <= hi.y; ++y ) {
+				const float ny0 = (float)y / mGrid.y * 2.0f - 1.0f;
+				const float ny1 = (float)( y + 1 ) / mGrid.y * 2.0f - 1.0f;
+				const float yMin = glm::min( glm::min( viewY( ny0, d0 ), viewY( ny0, d1 ) ), glm::min( viewY( ny1, d0 ), viewY( ny1, d1 ) ) );
+				const float yMax = glm::max( glm::max( viewY( ny0, d0 ), viewY( ny0, d1 ) ), glm::max( viewY( ny1, d0 ), viewY( ny1, d1 ) ) );
+				for ( int32_t x = lo.x; x <= hi.x; ++x ) {
+					const float nx0 = (float)x / mGrid.x * 2.0f - 1.0f;
+					const float nx1 = (float)( x + 1 ) / mGrid.x * 2.0f - 1.0f;
+					const float xMin = glm::min( glm::min( viewX( nx0, d0 ), viewX( nx0, d1 ) ), glm::min( viewX( nx1, d0 ), viewX( nx1, d1 ) ) );
+					const float xMax = glm::max( glm::max( viewX( nx0, d0 ), viewX( nx0, d1 ) ), glm::max( viewX( nx1, d0 ), viewX( nx1, d1 ) ) );
+
+					const vec3 boxMin( xMin, yMin, -d1 );
+					const vec3 boxMax( xMax, yMax, -d0 );
+					const vec3 delta = c - glm::clamp( c, boxMin, boxMax );
+					if ( glm::dot( delta, delta ) <= r * r ) {
+						mAssignments.emplace_back( (int32_t)getClusterIndex( ivec3( x, y, z ) ), index );
+					}
+				}
+			}
+		}
+	}
+
+	// Counting sort the assignments into contiguous per-cluster ranges
+	mClusters.assign( getNumClusters(), ivec2( 0 ) );
+	for ( const auto &a : mAssignments ) {
+		++mClusters[ a.first ].y;
+	}
+	int32_t offset = 0;
+	for ( ivec2 &cluster : mClusters ) {
+		cluster.x	= offset;
+		offset		+= cluster.y;
+		cluster.y	= 0;
+	}
+	mLightIndices.resize( mAssignments.size() );
+	for ( const auto &a : mAssignments ) {
+		ivec2 &cluster = mClusters[ a.first ];
+		mLightIndices[ cluster.x + cluster.y ] = a.second;
+		++cluster.y;
+	}
+}
@@ -1,6 +1,136 @@
 #include "Model.hpp"
+#include "WorkerPool.hpp"
+#include "cinder/CinderAssert.h"
+#include "glm/gtc/type_ptr.hpp"
+#include <algorithm>
+#include <limits>
 #include <memory>
 
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define MODEL_SSE
+#include <emmintrin.h>
+#endif
+
+// Instance transform kernels. Matrices are column-major float arrays as in
+// glm; rows of the structure-of-arrays inputs are tx, ty, tz, qx, qy, qz,
+// qw, sx, sy, sz.
+
+enum : size_t { TX, TY, TZ, QX, QY, QZ, QW, SX, SY, SZ, TRS_ROWS };
+
+#if defined( MODEL_SSE )
+
+// Composes four model matrices at once, one instance per lane
+static void composeTrs4( const float soa[ TRS_ROWS ][ 4 ], float* dst[ 4 ] )
+{
+	const __m128 one	= _mm_set1_ps( 1.0f );
+	const __m128 qx		= _mm_loadu_ps( soa[ QX ] );
+	const __m128 qy		= _mm_loadu_ps( soa[ QY ] );
+	const __m128 qz		= _mm_loadu_ps( soa[ QZ ] );
+	const __m128 qw		= _mm_loadu_ps( soa[ QW ] );
+	const __m128 x2		= _mm_add_ps( qx, qx );
+	const __m128 y2		= _mm_add_ps( qy, qy );
+	const __m128 z2		= _mm_add_ps( qz, qz );
+	const __m128 xx		= _mm_mul_ps( qx, x2 );
+	const __m128 yy		= _mm_mul_ps( qy, y2 );
+	const __m128 zz		= _mm_mul_ps( qz, z2 );
+	const __m128 xy		= _mm_mul_ps( qx, y2 );
+	const __m128 xz		= _mm_mul_ps( qx, z2 );
+	const __m128 yz		= _mm_mul_ps( qy, z2 );
+	const __m128 wx		= _mm_mul_ps( qw, x2 );
+	const __m128 wy		= _mm_mul_ps( qw, y2 );
+	const __m128 wz		= _mm_mul_ps( qw, z2 );
+	const __m128 sx		= _mm_loadu_ps( soa[ SX ] );
+	const __m128 sy		= _mm_loadu_ps( soa[ SY ] );
+	const __m128 sz		= _mm_loadu_ps( soa[ SZ ] );
+
+	// Columns of the rotation matrix, as in glm::mat3_cast(), times scale
+	__m128 c[ 4 ][ 4 ] = {
+		{	_mm_mul_ps( _mm_sub_ps( one, _mm_add_ps( yy, zz ) ), sx ),
+			_mm_mul_ps( _mm_add_ps( xy, wz ), sx ),
+			_mm_mul_ps( _mm_sub_ps( xz, wy ), sx ),
+			_mm_setzero_ps() },
+		{	_mm_mul_ps( _mm_sub_ps( xy, wz ), sy ),
+			_mm_mul_ps( _mm_sub_ps( one, _mm_add_ps( xx, zz ) ), sy ),
+			_mm_mul_ps( _mm_add_ps( yz, wx ), sy ),
+			_mm_setzero_ps() },
+		{	_mm_mul_ps( _mm_add_ps( xz, wy ), sz ),
+			_mm_mul_ps( _mm_sub_ps( yz, wx ), sz ),
+			_mm_mul_ps( _mm_sub_ps( one, _mm_add_ps( xx, yy ) ), sz ),
+			_mm_setzero_ps() },
+		{	_mm_loadu_ps( soa[ TX ] ),
+			_mm_loadu_ps( soa[ TY ] ),
+			_mm_loadu_ps( soa[ TZ ] ),
+			one }
+	};
+
+	// Transposing each column's lanes gives that column of each instance
+	for ( size_t j = 0; j < 4; ++j ) {
+		_MM_TRANSPOSE4_PS( c[ j ][ 0 ], c[ j ][ 1 ], c[ j ][ 2 ], c[ j ][ 3 ] );
+		for ( size_t i = 0; i < 4; ++i ) {
+			_mm_storeu_ps( dst[ i ] + j * 4, c[ j ][ i ] );
+		}
+	}
+}
+
+// out = a * b. out may alias a or b.
+static void multiply( const float* a, const float* b, float* out )
+{
+	const __m128 a0 = _mm_loadu_ps( a );
+	const __m128 a1 = _mm_loadu_ps( a + 4 );
+	const __m128 a2 = _mm_loadu_ps( a + 8 );
+	const __m128 a3 = _mm_loadu_ps( a + 12 );
+	__m128 r[ 4 ];
+	for ( size_t j = 0; j < 4; ++j ) {
+		const float* bj = b + j * 4;
+		r[ j ] = _mm_add_ps(	_mm_add_ps( _mm_mul_ps( a0, _mm_set1_ps( bj[ 0 ] ) ), _mm_mul_ps( a1, _mm_set1_ps( bj[ 1 ] ) ) ),
+								_mm_add_ps( _mm_mul_ps( a2, _mm_set1_ps( bj[ 2 ] ) ), _mm_mul_ps( a3, _mm_set1_ps( bj[ 3 ] ) ) ) );
+	}
+	for ( size_t j = 0; j < 4; ++j ) {
+		_mm_storeu_ps( out + j * 4, r[ j ] );
+	}
+}
+
+static inline __m128 cross( __m128 a, __m128 b )
+{
+	const __m128 aYzx = _mm_shuffle_ps( a, a, _MM_SHUFFLE( 3, 0, 2, 1 ) );
+	const __m128 bYzx = _mm_shuffle_ps( b, b, _MM_SHUFFLE( 3, 0, 2, 1 ) );
+	const __m128 c = _mm_sub_ps( _mm_mul_ps( a, bYzx ), _mm_mul_ps( aYzx, b ) );
+	return _mm_shuffle_ps( c, c, _MM_SHUFFLE( 3, 0, 2, 1 ) );
+}
+
+// Writes the inverse transpose of m's upper 3x3 to the 3x3 matrix n. The
+// cofactor matrix divided by the determinant avoids a general inverse.
+static void normalMatrix( const float* m, float* n )
+{
+	const __m128 mask	= _mm_castsi128_ps( _mm_set_epi32( 0, -1, -1, -1 ) );
+	const __m128 c0		= _mm_and_ps( _mm_loadu_ps( m ), mask );
+	const __m128 c1		= _mm_and_ps( _mm_loadu_ps( m + 4 ), mask );
+	const __m128 c2		= _mm_and_ps( _mm_loadu_ps( m + 8 ), mask );
+	__m128 n0			= cross( c1, c2 );
+	__m128 n1			= cross( c2, c0 );
+	__m128 n2			= cross( c0, c1 );
+
+	__m128 d			= _mm_mul_ps( c0, n0 );
+	d					= _mm_add_ps( d, _mm_movehl_ps( d, d ) );
+	d					= _mm_add_ss( d, _mm_shuffle_ps( d, d, 1 ) );
+	const float det		= _mm_cvtss_f32( d );
+	if ( det != 0.0f ) {
+		const __m128 inv = _mm_set1_ps( 1.0f / det );
+		n0 = _mm_mul_ps( n0, inv );
+		n1 = _mm_mul_ps( n1, inv );
+		n2 = _mm_mul_ps( n2, inv );
+	}
+
+	// Columns are packed, so each store spills into the next column's first
+	// element before it is overwritten; the last one must not spill.
+	_mm_storeu_ps( n, n0 );
+	_mm_storeu_ps( n + 3, n1 );
+	_mm_storel_pi( (__m64*)( n + 6 ), n2 );
+	_mm_store_ss( n + 8, _mm_movehl_ps( n2, n2 ) );
+}
+
+#endif
+
 using namespace ci;
 using namespace std;
 
@@ -59,23 +189,46 @@ void Model::setMatrices( const ci::mat4& modelMatrix, const ci::mat4& viewMatrix
     setNormalMatrix( glm::inverseTranspose( mat3( mModelViewMatrix ) ) );
 }
 
+// Reads back the mesh's positions to find a sphere which encloses them. This
+// happens once per model, so the synchronous read is acceptable.
+Sphere calcBoundingSphere( const gl::VboMeshRef &mesh )
+{
+	geom::AttribInfo info;
+	gl::VboRef vbo;
+	if ( mesh->getNumVertices() == 0 || ! mesh->findAttrib( geom::Attrib::POSITION, &info, &vbo ) ) {
+		return Sphere( vec3( 0.0f ), -1.0f );
+	}
+
+	const uint8_t dims		= info.getDims();
+	const size_t stride		= info.getStride() > 0 ? info.getStride() : dims * sizeof( float );
+	const uint8_t* ptr		= (const uint8_t*)vbo->map( GL_READ_ONLY ) + info.getOffset();
+
+	vec3 lo( numeric_limits< float >::max() );
+	vec3 hi( -numeric_limits< float >::max() );
+	for ( uint32_t i = 0; i < mesh->getNumVertices(); ++i, ptr += stride ) {
+		const float* f	= (const float*)ptr;
+		const vec3 p( f[ 0 ], dims > 1 ? f[ 1 ] : 0.0f, dims > 2 ? f[ 2 ] : 0.0f );
+		lo				= glm::min( lo, p );
+		hi				= glm::max( hi, p );
+	}
+	vbo->unmap();
+
+	return Sphere( ( lo + hi ) * 0.5f, glm::length( hi - lo ) * 0.5f );
+}
+
+static gl::TextureRef sBlankTex; // a 1x1 0,0,0,0 pixel
+static gl::TextureCubeMapRef sBlankCubeMap;
+static bool sBlankTexesInitialized = false;
+
 InstancedModel::InstancedModel( const ci::gl::VboMeshRef & mesh, size_t n ) :
 	mModels( n ),
 	mMaterialId( 0 ),
-	mMesh( mesh )
+	mMesh( mesh ),
+	mBounds( calcBoundingSphere( mesh ) )
 {
-	geom::BufferLayout bufferLayout;
-	size_t stride = sizeof( Model );
-	bufferLayout.append( geom::Attrib::CUSTOM_0, 16, stride, 0, 1 );
-	bufferLayout.append( geom::Attrib::CUSTOM_1, 9, stride, sizeof( mat4 ), 1 );
-	bufferLayout.append( geom::Attrib::CUSTOM_2, 16, stride, sizeof( mat4 ) + sizeof( mat3 ), 1 );
-
-	mVbo = gl::Vbo::create( GL_ARRAY_BUFFER, size() * stride, data(), GL_DYNAMIC_DRAW );
-	mMesh->appendVbo( bufferLayout, mVbo );
+	mStatic.resize( n, 0 );
+	mDirty.resize( n, 0 );
 
-	static gl::TextureRef sBlankTex; // a 1x1 0,0,0,0 pixel
-	static gl::TextureCubeMapRef sBlankCubeMap;
-	static bool sBlankTexesInitialized = false;
 	if ( ! sBlankTexesInitialized ) {
 		sBlankTexesInitialized = true;
 
@@ -98,3 +251,289 @@ InstancedModel::InstancedModel( const ci::geom::Source &geometry, size_t n ) :
 	InstancedModel( gl::VboMesh::create( geometry ), n )
 {
 }
+
+bool InstancedModel::hasBlankTextures() const
+{
+	return mTexture == sBlankTex && mTextureCubeMap == sBlankCubeMap;
+}
+
+void InstancedModel::setTextureLayer( const TextureLayer &layer )
+{
+	mTexture		= sBlankTex;
+	mTextureLayer	= layer;
+}
+
+void InstancedModel::reserve( size_t n )
+{
+	if ( n <= capacity() ) {
+		return;
+	}
+	mModels.reserve( n );
+}
+
+void InstancedModel::grow( size_t n )
+{
+	if ( n > capacity() ) {
+		reserve( std::max( n, capacity() * 2 ) );
+	}
+}
+
+void InstancedModel::resize( size_t n )
+{
+	const bool removesStatic = n < size() && find( mStatic.begin() + n, mStatic.end(), 1 ) != mStatic.end();
+	grow( n );
+	mModels.resize( n );
+	mStatic.resize( n, 0 );
+	mDirty.resize( n, 0 );
+	if ( removesStatic ) {
+		updateStaticIndices();
+	}
+}
+
+void InstancedModel::push_back( const Model &model )
+{
+	grow( size() + 1 );
+	mModels.push_back( model );
+	mStatic.push_back( 0 );
+	mDirty.push_back( 0 );
+}
+
+void InstancedModel::pop_back()
+{
+	CI_ASSERT( ! empty() );
+	const bool removesStatic = mStatic.back() != 0;
+	mModels.pop_back();
+	mStatic.pop_back();
+	mDirty.pop_back();
+	if ( removesStatic ) {
+		updateStaticIndices();
+	}
+}
+
+void InstancedModel::clear()
+{
+	const bool removesStatic = ! mStaticIndices.empty();
+	mModels.clear();
+	mStatic.clear();
+	mDirty.clear();
+	if ( removesStatic ) {
+		updateStaticIndices();
+	}
+}
+
+void InstancedModel::eraseUnordered( size_t i )
+{
+	CI_ASSERT( i < size() );
+	const bool movesStatic = mStatic[ i ] != 0 || mStatic.back() != 0;
+	mModels[ i ]	= mModels.back();
+	mStatic[ i ]	= mStatic.back();
+	mDirty[ i ]		= mDirty.back();
+	mModels.pop_back();
+	mStatic.pop_back();
+	mDirty.pop_back();
+	if ( movesStatic ) {
+		updateStaticIndices();
+	}
+}
+
+void InstancedModel::setStatic( size_t first, size_t count, bool isStatic )
+{
+	CI_ASSERT( first + count <= size() );
+	bool changed = false;
+	for ( size_t i = first; i < first + count; ++i ) {
+		changed		|= ( mStatic[ i ] != 0 ) != isStatic;
+		mStatic[ i ] = isStatic ? 1 : 0;
+	}
+	if ( changed ) {
+		updateStaticIndices();
+	}
+}
+
+// The renderer re-uploads every static instance when the version changes, so
+// pending dirty flags are dropped with it
+void InstancedModel::updateStaticIndices()
+{
+	mStaticIndices.clear();
+	for ( size_t i = 0; i < mStatic.size(); ++i ) {
+		if ( mStatic[ i ] != 0 ) {
+			mStaticIndices.push_back( (uint32_t)i );
+		}
+	}
+	++mStaticVersion;
+	clearDirty();
+}
+
+// Only static instances are tracked; dynamic ones are uploaded every frame
+// regardless. During updateParallel() only the per-instance flags are written
+// and mAnyDirty is settled once the workers are done.
+void InstancedModel::markDirty( size_t first, size_t count )
+{
+	CI_ASSERT( first + count <= size() );
+	if ( mStaticIndices.empty() ) {
+		return;
+	}
+	bool any = false;
+	for ( size_t i = first; i < first + count; ++i ) {
+		mDirty[ i ]	|= mStatic[ i ];
+		any			|= mStatic[ i ] != 0;
+	}
+	if ( any && ! mUpdatingParallel ) {
+		mAnyDirty = true;
+	}
+}
+
+void InstancedModel::clearDirty()
+{
+	if ( mAnyDirty ) {
+		fill( mDirty.begin(), mDirty.end(), 0 );
+		mAnyDirty = false;
+	}
+}
+
+vector< pair< size_t, size_t > > InstancedModel::dirtyStaticRanges( size_t gap ) const
+{
+	vector< pair< size_t, size_t > > ranges;
+	if ( ! mAnyDirty ) {
+		return ranges;
+	}
+
+	for ( size_t s = 0; s < mStaticIndices.size(); ++s ) {
+		if ( mDirty[ mStaticIndices[ s ] ] == 0 ) continue;
+		if ( ! ranges.empty() && s - ranges.back().second <= gap ) {
+			ranges.back().second = s + 1;
+		} else {
+			ranges.emplace_back( s, s + 1 );
+		}
+	}
+	return ranges;
+}
+
+// Largest axis scale of m, so that spheres scaled by it still enclose
+// non-uniformly scaled geometry
+float getMaxScale( const mat4 &m )
+{
+	return glm::sqrt( glm::max( glm::dot( vec3( m[ 0 ] ), vec3( m[ 0 ] ) ),
+					  glm::max( glm::dot( vec3( m[ 1 ] ), vec3( m[ 1 ] ) ),
+								glm::dot( vec3( m[ 2 ] ), vec3( m[ 2 ] ) ) ) ) );
+}
+
+Sphere InstancedModel::getInstanceBounds( size_t i ) const
+{
+	const mat4 &m = mModels[ i ].getModelMatrix();
+	return Sphere( vec3( m * vec4( mBounds.getCenter(), 1.0f ) ), mBounds.getRadius() * getMaxScale( m ) );
+}
+
+size_t InstancedModel::cull( const ViewFrustum &frustum, Model* visible ) const
+{
+	if ( ! hasBounds() ) {
+		return copyDynamic( visible );
+	}
+
+	const vec4 center( mBounds.getCenter(), 1.0f );
+	const float radius		= mBounds.getRadius();
+	const bool hasStatic	= ! mStaticIndices.empty();
+
+	size_t n = 0;
+	for ( size_t i = 0; i < mModels.size(); ++i ) {
+		if ( hasStatic && mStatic[ i ] != 0 ) continue;
+		const mat4 &m = mModels[ i ].getModelMatrix();
+		if ( frustum.intersects( vec3( m * center ), radius * getMaxScale( m ) ) ) {
+			visible[ n++ ] = mModels[ i ];
+		}
+	}
+
+	return n;
+}
+
+size_t InstancedModel::copyDynamic( Model* dst ) const
+{
+	if ( mStaticIndices.empty() ) {
+		copy( mModels.begin(), mModels.end(), dst );
+		return mModels.size();
+	}
+
+	size_t n = 0;
+	for ( size_t i = 0; i < mModels.size(); ++i ) {
+		if ( mStatic[ i ] == 0 ) {
+			dst[ n++ ] = mModels[ i ];
+		}
+	}
+	return n;
+}
+
+void InstancedModel::setTransforms( size_t first, size_t count, const vec3* translations,
+                                    const quat* rotations, const vec3* scales, const mat4* parents )
+{
+	CI_ASSERT( first + count <= size() );
+	Model* models = mModels.data() + first;
+
+	auto translation	= [ & ]( size_t i ) { return translations ? translations[ i ] : vec3( 0.0f ); };
+	auto rotation		= [ & ]( size_t i ) { return rotations ? rotations[ i ] : quat( 1.0f, 0.0f, 0.0f, 0.0f ); };
+	auto scale			= [ & ]( size_t i ) { return scales ? scales[ i ] : vec3( 1.0f ); };
+
+	size_t i = 0;
+#if defined( MODEL_SSE )
+	float soa[ TRS_ROWS ][ 4 ];
+	for ( ; i + 4 <= count; i += 4 ) {
+		float* dst[ 4 ];
+		for ( size_t l = 0; l < 4; ++l ) {
+			const vec3 t	= translation( i + l );
+			const quat q	= rotation( i + l );
+			const vec3 s	= scale( i + l );
+			soa[ TX ][ l ]	= t.x;
+			soa[ TY ][ l ]	= t.y;
+			soa[ TZ ][ l ]	= t.z;
+			soa[ QX ][ l ]	= q.x;
+			soa[ QY ][ l ]	= q.y;
+			soa[ QZ ][ l ]	= q.z;
+			soa[ QW ][ l ]	= q.w;
+			soa[ SX ][ l ]	= s.x;
+			soa[ SY ][ l ]	= s.y;
+			soa[ SZ ][ l ]	= s.z;
+			dst[ l ]		= glm::value_ptr( models[ i + l ].mModelMatrix );
+		}
+		composeTrs4( soa, dst );
+		if ( parents ) {
+			for ( size_t l = 0; l < 4; ++l ) {
+				multiply( glm::value_ptr( parents[ i + l ] ), dst[ l ], dst[ l ] );
+			}
+		}
+	}
+#endif
+	for ( ; i < count; ++i ) {
+		const mat4 m = glm::translate( translation( i ) ) * glm::mat4_cast( rotation( i ) ) * glm::scale( scale( i ) );
+		models[ i ].mModelMatrix = parents ? parents[ i ] * m : m;
+	}
+	markDirty( first, count );
+}
+
+void InstancedModel::setMatrices( size_t first, size_t count, const mat4 &viewMatrix )
+{
+	CI_ASSERT( first + count <= size() );
+	Model* models = mModels.data() + first;
+
+	for ( size_t i = 0; i < count; ++i ) {
+		Model &model = models[ i ];
+#if defined( MODEL_SSE )
+		multiply( glm::value_ptr( viewMatrix ), glm::value_ptr( model.mModelMatrix ), glm::value_ptr( model.mModelViewMatrix ) );
+		normalMatrix( glm::value_ptr( model.mModelViewMatrix ), glm::value_ptr( model.mNormalMatrix ) );
+#else
+		model.setMatrices( model.mModelMatrix, viewMatrix );
+#endif
+	}
+	markDirty( first, count );
+}
+
+void InstancedModel::updateParallel( const function< void( size_t, size_t ) > &fn, size_t grain )
+{
+	mUpdatingParallel = true;
+	WorkerPool::get().parallelFor( size(), grain, fn );
+	mUpdatingParallel = false;
+
+	for ( uint32_t i : mStaticIndices ) {
+		if ( mDirty[ i ] != 0 ) {
+			mAnyDirty = true;
+			break;
+		}
+	}
+}
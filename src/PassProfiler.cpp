@@ -0,0 +1,204 @@
+#include "PassProfiler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include "cinder/CinderAssert.h"
+
+using namespace ci;
+using namespace std;
+
+void PassProfiler::History::push( double v, size_t capacity )
+{
+	if ( samples.size() < capacity ) {
+		samples.push_back( v );
+	} else {
+		samples[ head ] = v;
+		head = ( head + 1 ) % capacity;
+	}
+}
+
+PassProfiler::Stats PassProfiler::History::getStats() const
+{
+	return calcStats( samples );
+}
+
+PassProfiler::Stats PassProfiler::calcStats( const vector< double > &samples )
+{
+	Stats stats;
+	stats.count = samples.size();
+	if ( samples.empty() ) {
+		return stats;
+	}
+
+	vector< double > sorted( samples );
+	sort( sorted.begin(), sorted.end() );
+	// Nearest-rank percentile
+	auto percentile = [ & ]( double p )
+	{
+		const size_t rank = (size_t)ceil( p * (double)sorted.size() );
+		return sorted[ min( sorted.size(), max( rank, (size_t)1 ) ) - 1 ];
+	};
+
+	double sum = 0.0;
+	for ( double v : sorted ) {
+		sum += v;
+	}
+	stats.average	= sum / (double)sorted.size();
+	stats.min		= sorted.front();
+	stats.max		= sorted.back();
+	stats.p50		= percentile( 0.5 );
+	stats.p95		= percentile( 0.95 );
+	stats.p99		= percentile( 0.99 );
+	return stats;
+}
+
+PassProfiler::PassProfiler( size_t historySize ) :
+	mHistorySize( max( historySize, (size_t)1 ) )
+{
+}
+
+void PassProfiler::beginFrame()
+{
+	CI_ASSERT_MSG( mCurrent == nullptr, "Pass still open at the start of a frame" );
+	if ( ! mEnabled ) {
+		return;
+	}
+
+	for ( Pass &pass : mPasses ) {
+		for ( size_t i = 0; i < kNumQueries; ++i ) {
+			if ( pass.pending[ i ] && pass.queries[ i ]->isReady() ) {
+				pass.gpu.push( pass.queries[ i ]->getElapsedMilliseconds(), mHistorySize );
+				pass.pending[ i ] = false;
+			}
+		}
+	}
+	++mFrame;
+}
+
+void PassProfiler::begin( const string &name )
+{
+	if ( ! mEnabled ) {
+		return;
+	}
+	CI_ASSERT_MSG( mCurrent == nullptr, "Profiled passes cannot nest" );
+
+	auto it = mPassIndices.find( name );
+	if ( it == mPassIndices.end() ) {
+		it = mPassIndices.emplace( name, mPasses.size() ).first;
+		mPasses.emplace_back();
+		Pass &pass = mPasses.back();
+		pass.name = name;
+		for ( size_t i = 0; i < kNumQueries; ++i ) {
+			pass.queries[ i ] = gl::QueryTimeElapsed::create();
+		}
+	}
+
+	mCurrent = &mPasses[ it->second ];
+
+	// Skip GPU timing for this frame rather than wait on a query which is
+	// still in flight
+	const size_t i	= mFrame % kNumQueries;
+	mCurrent->active = ! mCurrent->pending[ i ];
+	if ( mCurrent->active ) {
+		mCurrent->queries[ i ]->begin();
+	}
+	mCurrent->timer.start();
+}
+
+void PassProfiler::end()
+{
+	if ( mCurrent == nullptr ) {
+		return;
+	}
+
+	mCurrent->timer.stop();
+	mCurrent->cpu.push( mCurrent->timer.getSeconds() * 1000.0, mHistorySize );
+
+	if ( mCurrent->active ) {
+		const size_t i = mFrame % kNumQueries;
+		mCurrent->queries[ i ]->end();
+		mCurrent->pending[ i ] = true;
+	}
+	mCurrent = nullptr;
+}
+
+PassProfiler::PassStats PassProfiler::getStats( const Pass &pass ) const
+{
+	PassStats stats;
+	stats.name	= pass.name;
+	stats.gpu	= pass.gpu.getStats();
+	stats.cpu	= pass.cpu.getStats();
+	return stats;
+}
+
+vector< PassProfiler::PassStats > PassProfiler::getStats() const
+{
+	vector< PassStats > stats;
+	for ( const Pass &pass : mPasses ) {
+		stats.push_back( getStats( pass ) );
+	}
+	return stats;
+}
+
+PassProfiler::PassStats PassProfiler::getStats( const string &name ) const
+{
+	auto it = mPassIndices.find( name );
+	if ( it == mPassIndices.end() ) {
+		PassStats stats;
+		stats.name = name;
+		return stats;
+	}
+	return getStats( mPasses[ it->second ] );
+}
+
+void PassProfiler::setHistorySize( size_t n )
+{
+	mHistorySize = max( n, (size_t)1 );
+	clear();
+}
+
+void PassProfiler::clear()
+{
+	for ( Pass &pass : mPasses ) {
+		pass.gpu = History();
+		pass.cpu = History();
+	}
+}
+
+void PassProfiler::writeCsv( const fs::path &path ) const
+{
+	ofstream file( path.string() );
+	file << "pass,timer,count,average,min,max,p50,p95,p99\n";
+	for ( const PassStats &pass : getStats() ) {
+		for ( const auto &timer : { make_pair( "gpu", pass.gpu ), make_pair( "cpu", pass.cpu ) } ) {
+			const Stats &s = timer.second;
+			file << pass.name << "," << timer.first << "," << s.count << ","
+				<< s.average << "," << s.min << "," << s.max << ","
+				<< s.p50 << "," << s.p95 << "," << s.p99 << "\n";
+		}
+	}
+}
+
+void PassProfiler::writeJson( const fs::path &path ) const
+{
+	auto write = []( ofstream &file, const Stats &s )
+	{
+		file << "{ \"count\": " << s.count << ", \"average\": " << s.average
+			<< ", \"min\": " << s.min << ", \"max\": " << s.max
+			<< ", \"p50\": " << s.p50 << ", \"p95\": " << s.p95 << ", \"p99\": " << s.p99 << " }";
+	};
+
+	ofstream file( path.string() );
+	const vector< PassStats > stats = getStats();
+	file << "{\n  \"unit\": \"ms\",\n  \"passes\": [\n";
+	for ( size_t i = 0; i < stats.size(); ++i ) {
+		file << "    { \"name\": \"" << stats[ i ].name << "\", \"gpu\": ";
+		write( file, stats[ i ].gpu );
+		file << ", \"cpu\": ";
+		write( file, stats[ i ].cpu );
+		file << " }" << ( i + 1 < stats.size() ? "," : "" ) << "\n";
+	}
+	file << "  ]\n}\n";
+}
@@ -0,0 +1,286 @@
+#include "ProgramCache.hpp"
+
+#include "cinder/app/Platform.h"
+#include "cinder/gl/gl.h"
+#include "cinder/Log.h"
+#include "cinder/Utilities.h"
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+using namespace ci;
+using namespace std;
+
+// Bump when the file layout changes
+const uint32_t PROGRAM_CACHE_VERSION = 2;
+
+struct ProgramCacheHeader
+{
+	char		magic[ 4 ];
+	uint32_t	version;
+	uint64_t	keyHash;
+	uint64_t	keySize;
+	uint32_t	binaryFormat;
+	uint32_t	binarySize;
+};
+
+// FNV-1a, which unlike std::hash is the same from run to run
+uint64_t hashKey( const string &key )
+{
+	uint64_t h = 14695981039346656037ULL;
+	for ( char c : key ) {
+		h ^= (uint8_t)c;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Finds an #include the way Cinder's shader preprocessor does, relative to
+// the including file first and then to each asset directory
+fs::path findInclude( const fs::path &includingPath, const fs::path &include )
+{
+	const fs::path relative = includingPath.parent_path() / include;
+	if ( fs::exists( relative ) ) {
+		return relative;
+	}
+	for ( const fs::path &directory : app::Platform::get()->getAssetDirectories() ) {
+		if ( fs::exists( directory / include ) ) {
+			return directory / include;
+		}
+	}
+	return fs::path();
+}
+
+// Appends source to key, followed by any files it #includes. Returns false
+// if an include cannot be found, so that the program is compiled rather
+// than loaded from a binary which may be stale.
+bool appendSource( ostringstream &key, const string &source, const fs::path &path, size_t depth = 0 )
+{
+	key << source << "\n";
+	if ( path.empty() || depth > 8 ) {
+		return true;
+	}
+
+	istringstream lines( source );
+	string line;
+	while ( getline( lines, line ) ) {
+		const size_t directive = line.find( "#include" );
+		if ( directive == string::npos ) continue;
+		const size_t first	= line.find( '"', directive );
+		const size_t last	= first == string::npos ? string::npos : line.find( '"', first + 1 );
+		if ( last == string::npos ) continue;
+
+		const fs::path include		= line.substr( first + 1, last - first - 1 );
+		const fs::path includePath	= findInclude( path, include );
+		if ( includePath.empty() ) {
+			CI_LOG_W( "Unable to find " << include << " included by " << path << ", program will not be cached" );
+			return false;
+		}
+		if ( ! appendSource( key, loadString( loadFile( includePath ) ), includePath, depth + 1 ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+string getGlString( GLenum name )
+{
+	const GLubyte* s = glGetString( name );
+	return s != nullptr ? string( (const char*)s ) : string();
+}
+
+#if defined( GL_PROGRAM_BINARY_LENGTH )
+
+// A program linked from a binary. GlslProg always builds from source, so a
+// trivial program is built first, replaced by the binary, and its attribute
+// and uniform tables are read again.
+class BinaryGlslProg : public gl::GlslProg
+{
+public:
+	BinaryGlslProg( GLenum binaryFormat, const vector< uint8_t > &binary, bool *linked ) :
+		GlslProg( gl::GlslProg::Format().version( 330 )
+			.vertex( "in vec4 ciPosition;\nvoid main( void ) { gl_Position = ciPosition; }\n" )
+			.fragment( "out vec4 oColor;\nvoid main( void ) { oColor = vec4( 1.0 ); }\n" ) )
+	{
+		glProgramBinary( getHandle(), binaryFormat, binary.data(), (GLsizei)binary.size() );
+		GLint status = GL_FALSE;
+		glGetProgramiv( getHandle(), GL_LINK_STATUS, &status );
+		*linked = status == GL_TRUE;
+		if ( *linked ) {
+			mAttributes.clear();
+			mUniforms.clear();
+			mUniformBlocks.clear();
+			cacheActiveAttribs();
+			cacheActiveUniforms();
+			cacheActiveUniformBlocks();
+		}
+	}
+};
+
+#endif
+
+ProgramCache::ProgramCache( const fs::path &directory ) :
+	mDirectory( directory )
+{
+}
+
+gl::GlslProgRef ProgramCache::create( const gl::GlslProg::Format &format )
+{
+	if ( mDirectory.empty() || ! isSupported() ) {
+		++mNumCompiled;
+		return gl::GlslProg::create( format );
+	}
+
+	const string key		= getKey( format );
+	if ( key.empty() ) {
+		++mNumCompiled;
+		return gl::GlslProg::create( format );
+	}
+	const fs::path path		= getPath( key );
+	gl::GlslProgRef program	= load( path, key );
+	if ( program ) {
+		++mNumLoaded;
+		return program;
+	}
+
+	program = gl::GlslProg::create( format );
+	++mNumCompiled;
+	save( path, key, program );
+	return program;
+}
+
+bool ProgramCache::isSupported()
+{
+#if defined( GL_PROGRAM_BINARY_LENGTH )
+	if ( mSupported < 0 ) {
+		GLint numFormats = 0;
+		if ( gl::isExtensionAvailable( "GL_ARB_get_program_binary" ) || gl::getVersion() >= make_pair( 4, 1 ) ) {
+			glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats );
+		}
+		mSupported = numFormats > 0 ? 1 : 0;
+		if ( mSupported == 0 ) {
+			CI_LOG_W( "Program binaries are not supported, programs will always be compiled" );
+		}
+	}
+	return mSupported == 1;
+#else
+	return false;
+#endif
+}
+
+string ProgramCache::getKey( const gl::GlslProg::Format &format ) const
+{
+	ostringstream key;
+	key << getGlString( GL_VENDOR ) << "\n" << getGlString( GL_RENDERER ) << "\n" << getGlString( GL_VERSION ) << "\n";
+	key << format.getVersion() << "\n";
+	for ( const auto &define : format.getDefines() ) {
+		key << "#define " << define.first << " " << define.second << "\n";
+	}
+	if ( ! appendSource( key, format.getVertex(), format.getVertexPath() ) ||
+		! appendSource( key, format.getFragment(), format.getFragmentPath() ) ||
+		! appendSource( key, format.getGeometry(), format.getGeometryPath() ) ) {
+		return string();
+	}
+	return key.str();
+}
+
+fs::path ProgramCache::getPath( const string &key ) const
+{
+	ostringstream name;
+	name << hex << setw( 16 ) << setfill( '0' ) << hashKey( key ) << ".bin";
+	return mDirectory / name.str();
+}
+
+gl::GlslProgRef ProgramCache::load( const fs::path &path, const string &key ) const
+{
+#if defined( GL_PROGRAM_BINARY_LENGTH )
+	ifstream file( path.string(), ios::binary );
+	if ( ! file ) {
+		return nullptr;
+	}
+
+	ProgramCacheHeader header;
+	file.read( (char*)&header, sizeof( header ) );
+	if ( ! file || memcmp( header.magic, "DRPB", 4 ) != 0 || header.version != PROGRAM_CACHE_VERSION ||
+		header.keyHash != hashKey( key ) || header.keySize != key.size() ) {
+		return nullptr;
+	}
+
+	// The full key follows the header, so that keys sharing a hash never
+	// load each other's binaries
+	string fileKey( key.size(), '\0' );
+	file.read( &fileKey[ 0 ], fileKey.size() );
+	if ( ! file || fileKey != key ) {
+		return nullptr;
+	}
+	vector< uint8_t > binary( header.binarySize );
+	file.read( (char*)binary.data(), binary.size() );
+	if ( ! file ) {
+		return nullptr;
+	}
+	file.close();
+
+	bool linked = false;
+	gl::GlslProgRef program( new BinaryGlslProg( header.binaryFormat, binary, &linked ) );
+	if ( linked ) {
+		return program;
+	}
+
+	// Stale, usually after a driver update. It is replaced once the program
+	// has been compiled again.
+	CI_LOG_W( "Discarding program binary " << path.filename() );
+	return nullptr;
+#else
+	return nullptr;
+#endif
+}
+
+void ProgramCache::save( const fs::path &path, const string &key, const gl::GlslProgRef &program ) const
+{
+#if defined( GL_PROGRAM_BINARY_LENGTH )
+
+	// Cinder links programs as it creates them, too early to set
+	// GL_PROGRAM_BINARY_RETRIEVABLE_HINT. Drivers which need it report a
+	// length of zero, and the program is simply not cached.
+	GLint length = 0;
+	glGetProgramiv( program->getHandle(), GL_PROGRAM_BINARY_LENGTH, &length );
+	if ( length <= 0 ) {
+		return;
+	}
+	vector< uint8_t > binary( length );
+	GLenum binaryFormat = 0;
+	glGetProgramBinary( program->getHandle(), length, &length, &binaryFormat, binary.data() );
+
+	ProgramCacheHeader header;
+	memcpy( header.magic, "DRPB", 4 );
+	header.version		= PROGRAM_CACHE_VERSION;
+	header.keyHash		= hashKey( key );
+	header.keySize		= key.size();
+	header.binaryFormat	= binaryFormat;
+	header.binarySize	= (uint32_t)length;
+
+	// Written under a temporary name, so that another instance starting at
+	// the same time never reads a partial file
+	try {
+		fs::create_directories( mDirectory );
+		fs::path tmp = path;
+		tmp += ".tmp";
+		{
+			ofstream file( tmp.string(), ios::binary );
+			file.write( (const char*)&header, sizeof( header ) );
+			file.write( key.data(), key.size() );
+			file.write( (const char*)binary.data(), length );
+			if ( ! file ) {
+				CI_LOG_W( "Unable to write program binary " << tmp );
+				return;
+			}
+		}
+		fs::rename( tmp, path );
+	} catch ( const fs::filesystem_error &e ) {
+		CI_LOG_W( "Unable to write program binary: " << e.what() );
+	}
+#endif
+}
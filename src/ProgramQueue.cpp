@@ -0,0 +1,104 @@
+#include "ProgramQueue.hpp"
+
+#include "cinder/gl/Environment.h"
+#include "cinder/gl/gl.h"
+#include "cinder/Thread.h"
+
+using namespace ci;
+using namespace std;
+
+ProgramQueue::ProgramQueue( ProgramCache &cache ) :
+	mCache( cache )
+{
+	// Shared contexts are created on the thread which owns the original
+	mContext	= gl::Context::create( gl::context() );
+	mThread		= thread( &ProgramQueue::run, this );
+}
+
+ProgramQueue::~ProgramQueue()
+{
+	{
+		const lock_guard< mutex > lock( mMutex );
+		mQuit = true;
+	}
+	mCondition.notify_all();
+	mThread.join();
+	mContext.reset();
+}
+
+void ProgramQueue::push( const gl::GlslProg::Format &format, const Callback &onReady )
+{
+	shared_ptr< Job > job = make_shared< Job >();
+	job->format		= format;
+	job->onReady	= onReady;
+	{
+		const lock_guard< mutex > lock( mMutex );
+		mJobs.push_back( job );
+	}
+	mCondition.notify_one();
+}
+
+size_t ProgramQueue::poll()
+{
+	while ( true ) {
+		shared_ptr< Job > job;
+		{
+			const lock_guard< mutex > lock( mMutex );
+			if ( mJobs.empty() || ! mJobs.front()->done ) {
+				break;
+			}
+			job = mJobs.front();
+			mJobs.pop_front();
+			--mNext;
+		}
+		if ( job->error ) {
+			rethrow_exception( job->error );
+		}
+		job->onReady( job->program );
+	}
+	return getNumPending();
+}
+
+size_t ProgramQueue::getNumPending() const
+{
+	const lock_guard< mutex > lock( mMutex );
+	return mJobs.size();
+}
+
+void ProgramQueue::run()
+{
+	ThreadSetup threadSetup;
+	mContext->makeCurrent();
+
+	while ( true ) {
+		shared_ptr< Job > job;
+		{
+			unique_lock< mutex > lock( mMutex );
+			mCondition.wait( lock, [ this ] { return mQuit || mNext < mJobs.size(); } );
+			if ( mQuit ) {
+				break;
+			}
+			job = mJobs[ mNext++ ];
+		}
+
+		gl::GlslProgRef program;
+		exception_ptr error;
+		try {
+			program = mCache.create( job->format );
+
+			// Make sure the program is complete before another context uses it
+			glFinish();
+		} catch ( ... ) {
+			error = current_exception();
+		}
+
+		const lock_guard< mutex > lock( mMutex );
+		job->program	= program;
+		job->error		= error;
+		job->done		= true;
+	}
+
+	// A context can't be destroyed while it is current on another thread
+	gl::env()->makeContextCurrent( nullptr );
+	gl::Context::reflectCurrent( nullptr );
+}
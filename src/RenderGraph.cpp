@@ -0,0 +1,335 @@
+#include "RenderGraph.hpp"
+
+#include "cinder/CinderAssert.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/gl/wrapper.h"
+#include "cinder/Log.h"
+
+#include <set>
+
+using namespace ci;
+using namespace std;
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::read( Handle handle )
+{
+	CI_ASSERT_MSG( handle >= 0 && handle < (Handle)mGraph.mVersions.size(), "Invalid render graph handle" );
+	mGraph.mPasses[ mPass ].reads.push_back( handle );
+	mGraph.mVersions[ handle ].readers.push_back( mPass );
+	return *this;
+}
+
+RenderGraph::Handle RenderGraph::PassBuilder::write( Handle handle )
+{
+	CI_ASSERT_MSG( handle >= 0 && handle < (Handle)mGraph.mVersions.size(), "Invalid render graph handle" );
+	const size_t resource = mGraph.mVersions[ handle ].resource;
+	CI_ASSERT_MSG( mGraph.mResources[ resource ].latest == handle, "Only the newest version of a texture can be written" );
+
+	Version version;
+	version.resource	= resource;
+	version.previous	= handle;
+	version.writer		= (int32_t)mPass;
+	const Handle result	= (Handle)mGraph.mVersions.size();
+	mGraph.mVersions.push_back( version );
+	mGraph.mResources[ resource ].latest = result;
+	mGraph.mPasses[ mPass ].writes.push_back( result );
+	return result;
+}
+
+void RenderGraph::clear()
+{
+	for ( Resource &resource : mResources ) {
+		if ( ! resource.imported && resource.texture ) {
+			mPool.release( resource.texture );
+		}
+	}
+	mResources.clear();
+	mVersions.clear();
+	mPasses.clear();
+}
+
+RenderGraph::Handle RenderGraph::importTexture( const string &name, const gl::Texture2dRef &texture )
+{
+	CI_ASSERT_MSG( texture, "Imported textures must exist" );
+	Resource resource;
+	resource.name		= name;
+	resource.desc		= TextureDesc( texture->getSize(), texture->getInternalFormat(), GL_UNSIGNED_BYTE );
+	resource.texture	= texture;
+	resource.imported	= true;
+	resource.latest		= (Handle)mVersions.size();
+	mResources.push_back( resource );
+
+	Version version;
+	version.resource = mResources.size() - 1;
+	mVersions.push_back( version );
+	return resource.latest;
+}
+
+RenderGraph::Handle RenderGraph::createTexture( const string &name, const TextureDesc &desc )
+{
+	Resource resource;
+	resource.name		= name;
+	resource.desc		= desc;
+	resource.latest		= (Handle)mVersions.size();
+	mResources.push_back( resource );
+
+	Version version;
+	version.resource = mResources.size() - 1;
+	mVersions.push_back( version );
+	return resource.latest;
+}
+
+RenderGraph::PassBuilder RenderGraph::addPass( const string &name, const ExecuteFn &execute )
+{
+	Pass pass;
+	pass.name		= name;
+	pass.execute	= execute;
+	mPasses.push_back( pass );
+	return PassBuilder( *this, mPasses.size() - 1 );
+}
+
+void RenderGraph::setOutput( Handle handle )
+{
+	CI_ASSERT_MSG( handle >= 0 && handle < (Handle)mVersions.size(), "Invalid render graph handle" );
+	mVersions[ handle ].output = true;
+}
+
+void RenderGraph::execute( PassProfiler &profiler )
+{
+	cull();
+	const vector< size_t > order = sort();
+
+	// Find where each texture is last used. Outputs outlive the frame.
+	for ( Resource &resource : mResources ) {
+		resource.last = -1;
+	}
+	for ( size_t i = 0; i < order.size(); ++i ) {
+		const Pass &pass = mPasses[ order[ i ] ];
+		for ( Handle handle : pass.reads ) {
+			mResources[ mVersions[ handle ].resource ].last = (int32_t)i;
+		}
+		for ( Handle handle : pass.writes ) {
+			mResources[ mVersions[ handle ].resource ].last = (int32_t)i;
+		}
+	}
+	for ( const Version &version : mVersions ) {
+		if ( version.output ) {
+			mResources[ version.resource ].last = (int32_t)order.size();
+		}
+	}
+
+	mExecutedPasses.clear();
+	for ( size_t i = 0; i < order.size(); ++i ) {
+		const Pass &pass = mPasses[ order[ i ] ];
+		for ( const vector< Handle > *handles : { &pass.reads, &pass.writes } ) {
+			for ( Handle handle : *handles ) {
+				Resource &resource = mResources[ mVersions[ handle ].resource ];
+				if ( ! resource.texture ) {
+					resource.texture = mPool.acquire( resource.desc );
+				}
+			}
+		}
+
+		{
+			const gl::FboRef fbo = getFbo( pass );
+			const gl::ScopedFramebuffer scopedFramebuffer( fbo );
+			const gl::ScopedViewport scopedViewport( ivec2( 0 ), fbo->getSize() );
+			const gl::ScopedMatrices scopedMatrices;
+			vector< GLenum > buffers;
+			for ( Handle handle : pass.writes ) {
+				if ( ! RenderTargetPool::isDepthFormat( getTexture( handle )->getInternalFormat() ) ) {
+					buffers.push_back( GL_COLOR_ATTACHMENT0 + (GLenum)buffers.size() );
+				}
+			}
+			if ( ! buffers.empty() ) {
+				gl::drawBuffers( (GLsizei)buffers.size(), buffers.data() );
+			}
+
+			const ScopedPassProfile scopedPassProfile( profiler, pass.name );
+			pass.execute( *this );
+		}
+		mExecutedPasses.push_back( pass.name );
+
+		// Passes draw into level 0 only, so rebuild the rest of the chain
+		for ( Handle handle : pass.writes ) {
+			const Resource &resource = mResources[ mVersions[ handle ].resource ];
+			if ( resource.desc.mipmapLevels > 0 ) {
+				const gl::ScopedTextureBind scopedTextureBind( resource.texture );
+				glGenerateMipmap( resource.texture->getTarget() );
+			}
+		}
+
+		// Hand back textures nothing reads any more
+		for ( const vector< Handle > *handles : { &pass.reads, &pass.writes } ) {
+			for ( Handle handle : *handles ) {
+				Resource &resource = mResources[ mVersions[ handle ].resource ];
+				if ( ! resource.imported && resource.texture && resource.last == (int32_t)i ) {
+					mPool.release( resource.texture );
+					resource.texture.reset();
+				}
+			}
+		}
+	}
+	mNumCulledPasses = mPasses.size() - order.size();
+
+	// Drop textures of passes which no longer run. Their ids may be given
+	// to new textures, so cached frame buffers can no longer be trusted.
+	if ( mPool.trim() > 0 ) {
+		mFbos.clear();
+	}
+}
+
+const gl::Texture2dRef& RenderGraph::getTexture( Handle handle ) const
+{
+	CI_ASSERT_MSG( handle >= 0 && handle < (Handle)mVersions.size(), "Invalid render graph handle" );
+	return mResources[ mVersions[ handle ].resource ].texture;
+}
+
+void RenderGraph::releaseTextures()
+{
+	clear();
+	mFbos.clear();
+	mPool.clear();
+}
+
+void RenderGraph::cull()
+{
+	// Passes are referenced by the versions they write, and versions by
+	// the passes reading them. Writes to imported textures are always kept.
+	for ( Pass &pass : mPasses ) {
+		pass.refCount	= (int32_t)pass.writes.size();
+		pass.culled		= false;
+		for ( Handle handle : pass.writes ) {
+			if ( mResources[ mVersions[ handle ].resource ].imported ) {
+				++pass.refCount;
+			}
+		}
+	}
+	vector< Handle > unused;
+	for ( size_t i = 0; i < mVersions.size(); ++i ) {
+		Version &version	= mVersions[ i ];
+		version.refCount	= (int32_t)version.readers.size() + ( version.output ? 1 : 0 );
+		if ( version.refCount == 0 && version.writer >= 0 ) {
+			unused.push_back( (Handle)i );
+		}
+	}
+
+	auto cullPass = [ & ]( Pass &pass )
+	{
+		pass.culled = true;
+		for ( Handle handle : pass.reads ) {
+			Version &version = mVersions[ handle ];
+			if ( --version.refCount == 0 && version.writer >= 0 ) {
+				unused.push_back( handle );
+			}
+		}
+	};
+	for ( Pass &pass : mPasses ) {
+		if ( pass.refCount == 0 ) {
+			cullPass( pass );
+		}
+	}
+	while ( ! unused.empty() ) {
+		Pass &writer = mPasses[ mVersions[ unused.back() ].writer ];
+		unused.pop_back();
+		if ( --writer.refCount == 0 ) {
+			cullPass( writer );
+		}
+	}
+}
+
+vector< size_t > RenderGraph::sort() const
+{
+	// A pass runs after the writers of what it reads, and before anything
+	// writes over it. Otherwise passes keep the order they were added in.
+	vector< vector< size_t > > next( mPasses.size() );
+	vector< int32_t > numPrevious( mPasses.size(), 0 );
+	auto addEdge = [ & ]( int32_t from, size_t to )
+	{
+		if ( from >= 0 && (size_t)from != to && ! mPasses[ from ].culled ) {
+			next[ from ].push_back( to );
+			++numPrevious[ to ];
+		}
+	};
+	size_t numAlive = 0;
+	for ( size_t i = 0; i < mPasses.size(); ++i ) {
+		const Pass &pass = mPasses[ i ];
+		if ( pass.culled ) continue;
+		++numAlive;
+		for ( Handle handle : pass.reads ) {
+			addEdge( mVersions[ handle ].writer, i );
+		}
+		for ( Handle handle : pass.writes ) {
+			const Handle previous = mVersions[ handle ].previous;
+			if ( previous >= 0 ) {
+				addEdge( mVersions[ previous ].writer, i );
+				for ( size_t reader : mVersions[ previous ].readers ) {
+					addEdge( (int32_t)reader, i );
+				}
+			}
+		}
+	}
+
+	vector< size_t > order;
+	set< size_t > ready;
+	for ( size_t i = 0; i < mPasses.size(); ++i ) {
+		if ( ! mPasses[ i ].culled && numPrevious[ i ] == 0 ) {
+			ready.insert( i );
+		}
+	}
+	while ( ! ready.empty() ) {
+		const size_t i = *ready.begin();
+		ready.erase( ready.begin() );
+		order.push_back( i );
+		for ( size_t j : next[ i ] ) {
+			if ( --numPrevious[ j ] == 0 ) {
+				ready.insert( j );
+			}
+		}
+	}
+
+	if ( order.size() != numAlive ) {
+		CI_LOG_E( "Render graph passes depend on each other, running them in the order they were added" );
+		order.clear();
+		for ( size_t i = 0; i < mPasses.size(); ++i ) {
+			if ( ! mPasses[ i ].culled ) {
+				order.push_back( i );
+			}
+		}
+	}
+	return order;
+}
+
+gl::FboRef RenderGraph::getFbo( const Pass &pass )
+{
+	CI_ASSERT_MSG( ! pass.writes.empty(), "Render graph passes must write a texture" );
+
+	vector< GLuint > key;
+	for ( Handle handle : pass.writes ) {
+		key.push_back( getTexture( handle )->getId() );
+	}
+	auto iter = mFbos.find( key );
+	if ( iter != mFbos.end() ) {
+		return iter->second;
+	}
+
+	// Frame buffers keep their textures alive, so ids in the cache are
+	// never reused by other textures
+	gl::Fbo::Format format;
+	format.disableDepth();
+	GLenum numColor = 0;
+	for ( Handle handle : pass.writes ) {
+		const gl::Texture2dRef &texture = getTexture( handle );
+		if ( RenderTargetPool::isDepthFormat( texture->getInternalFormat() ) ) {
+			format.attachment( GL_DEPTH_ATTACHMENT, texture );
+		} else {
+			format.attachment( GL_COLOR_ATTACHMENT0 + numColor++, texture );
+		}
+	}
+	if ( numColor == 0 ) {
+		format.disableColor();
+	}
+	const ivec2 size = getTexture( pass.writes.front() )->getSize();
+	const gl::FboRef fbo = gl::Fbo::create( size.x, size.y, format );
+	mFbos[ key ] = fbo;
+	return fbo;
+}
@@ -0,0 +1,168 @@
+#include "RenderTargetPool.hpp"
+
+#include <algorithm>
+
+#include "cinder/CinderAssert.h"
+
+using namespace ci;
+using namespace std;
+
+RenderTargetPool::Desc::Desc( const ivec2 &size, GLint internalFormat, GLenum dataType, GLenum filter, int32_t mipmapLevels ) :
+	size( size ), internalFormat( internalFormat ), dataType( dataType ), filter( filter ), mipmapLevels( mipmapLevels )
+{
+}
+
+bool RenderTargetPool::Desc::isDepth() const
+{
+	return isDepthFormat( internalFormat );
+}
+
+size_t RenderTargetPool::Desc::getBytes() const
+{
+	size_t bytesPerPixel = 4;
+	switch ( internalFormat ) {
+	case GL_R8:
+		bytesPerPixel = 1;
+		break;
+	case GL_R16F:
+	case GL_R16I:
+	case GL_RG8:
+	case GL_DEPTH_COMPONENT16:
+		bytesPerPixel = 2;
+		break;
+	case GL_RGB16F:
+		bytesPerPixel = 6;
+		break;
+	case GL_RG32F:
+	case GL_RGBA16F:
+	case GL_DEPTH32F_STENCIL8:
+		bytesPerPixel = 8;
+		break;
+	case GL_RGB32F:
+		bytesPerPixel = 12;
+		break;
+	case GL_RGBA32F:
+		bytesPerPixel = 16;
+		break;
+	default:
+		break;
+	}
+
+	size_t pixels = 0;
+	for ( int32_t level = 0; level <= mipmapLevels; ++level ) {
+		pixels += (size_t)max( size.x >> level, 1 ) * (size_t)max( size.y >> level, 1 );
+	}
+	return pixels * bytesPerPixel;
+}
+
+bool RenderTargetPool::Desc::operator==( const Desc &rhs ) const
+{
+	return size == rhs.size && internalFormat == rhs.internalFormat && dataType == rhs.dataType &&
+		filter == rhs.filter && mipmapLevels == rhs.mipmapLevels;
+}
+
+bool RenderTargetPool::isDepthFormat( GLint internalFormat )
+{
+	switch ( internalFormat ) {
+	case GL_DEPTH_COMPONENT:
+	case GL_DEPTH_COMPONENT16:
+	case GL_DEPTH_COMPONENT24:
+	case GL_DEPTH_COMPONENT32F:
+	case GL_DEPTH24_STENCIL8:
+	case GL_DEPTH32F_STENCIL8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+gl::Texture2dRef RenderTargetPool::acquire( const Desc &desc )
+{
+	Target *target = nullptr;
+	for ( Target &t : mTargets ) {
+		if ( t.free && t.desc == desc ) {
+			target = &t;
+			break;
+		}
+	}
+
+	if ( target == nullptr ) {
+		gl::Texture2d::Format format = gl::Texture2d::Format()
+			.internalFormat( desc.internalFormat )
+			.dataType( desc.dataType )
+			.magFilter( desc.filter )
+			.minFilter( desc.filter )
+			.wrap( GL_CLAMP_TO_EDGE );
+		if ( desc.mipmapLevels > 0 ) {
+			format.mipmap();
+			format.minFilter( desc.filter == GL_LINEAR ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_NEAREST );
+			format.setMaxMipmapLevel( desc.mipmapLevels );
+		}
+
+		Target t;
+		t.desc		= desc;
+		t.texture	= gl::Texture2d::create( desc.size.x, desc.size.y, format );
+		t.free		= true;
+		mTargets.push_back( t );
+		target		= &mTargets.back();
+
+		mBytes		+= desc.getBytes();
+		mPeakBytes	= max( mPeakBytes, mBytes );
+	}
+
+	target->free		= false;
+	target->acquired	= true;
+	mBytesInUse			+= target->desc.getBytes();
+	mPeakBytesInUse		= max( mPeakBytesInUse, mBytesInUse );
+	return target->texture;
+}
+
+void RenderTargetPool::release( const gl::Texture2dRef &texture )
+{
+	for ( Target &t : mTargets ) {
+		if ( t.texture == texture ) {
+			CI_ASSERT_MSG( ! t.free, "Render target released twice" );
+			t.free		= true;
+			mBytesInUse	-= t.desc.getBytes();
+			return;
+		}
+	}
+	CI_ASSERT_MSG( false, "Render target does not belong to this pool" );
+}
+
+size_t RenderTargetPool::trim()
+{
+	const size_t count = mTargets.size();
+	auto isUnused = [ this ]( const Target &t )
+	{
+		if ( t.free && ! t.acquired ) {
+			mBytes -= t.desc.getBytes();
+			return true;
+		}
+		return false;
+	};
+	mTargets.erase( remove_if( mTargets.begin(), mTargets.end(), isUnused ), mTargets.end() );
+	for ( Target &t : mTargets ) {
+		t.acquired = false;
+	}
+	return count - mTargets.size();
+}
+
+void RenderTargetPool::clear()
+{
+	auto isFree = [ this ]( const Target &t )
+	{
+		if ( t.free ) {
+			mBytes -= t.desc.getBytes();
+			return true;
+		}
+		return false;
+	};
+	mTargets.erase( remove_if( mTargets.begin(), mTargets.end(), isFree ), mTargets.end() );
+}
+
+void RenderTargetPool::resetPeakBytes()
+{
+	mPeakBytes		= mBytes;
+	mPeakBytesInUse	= mBytesInUse;
+}
@@ -0,0 +1,109 @@
+#include "TextureArrays.hpp"
+
+#include "cinder/CinderAssert.h"
+#include "cinder/gl/scoped.h"
+#include "cinder/Log.h"
+
+#include <algorithm>
+
+using namespace ci;
+using namespace std;
+
+TextureArrays::TextureArrays( int32_t layersPerArray ) :
+	mLayersPerArray( max( layersPerArray, 1 ) )
+{
+}
+
+TextureLayer TextureArrays::add( const Surface8u &surface )
+{
+	TextureLayer result;
+	const ivec2 size = surface.getSize();
+	if ( size.x <= 0 || size.y <= 0 ) {
+		CI_LOG_W( "Cannot add an empty surface to a texture array" );
+		return result;
+	}
+
+	for ( size_t i = 0; i < mArrays.size(); ++i ) {
+		if ( mArrays[ i ].size == size && ! mArrays[ i ].freeLayers.empty() ) {
+			result.array = (int32_t)i;
+			break;
+		}
+	}
+
+	if ( result.array < 0 ) {
+		Array a;
+		a.size		= size;
+		a.texture	= gl::Texture3d::create( size.x, size.y, mLayersPerArray, gl::Texture3d::Format()
+			.target( GL_TEXTURE_2D_ARRAY ).internalFormat( GL_RGBA8 )
+			.mipmap().minFilter( GL_LINEAR_MIPMAP_LINEAR ).magFilter( GL_LINEAR )
+			.wrap( GL_REPEAT ) );
+
+		// Hand out layers from the front
+		for ( int32_t j = mLayersPerArray - 1; j >= 0; --j ) {
+			a.freeLayers.push_back( j );
+		}
+		result.array = (int32_t)mArrays.size();
+		mArrays.push_back( a );
+	}
+
+	Array &a		= mArrays[ result.array ];
+	result.layer	= a.freeLayers.back();
+	a.freeLayers.pop_back();
+	upload( result, surface );
+
+	return result;
+}
+
+bool TextureArrays::remove( const TextureLayer &layer )
+{
+	if ( ! contains( layer ) ) {
+		return false;
+	}
+
+	vector< int32_t > &freeLayers = mArrays[ layer.array ].freeLayers;
+	if ( find( freeLayers.begin(), freeLayers.end(), layer.layer ) != freeLayers.end() ) {
+		return false;
+	}
+	freeLayers.push_back( layer.layer );
+	return true;
+}
+
+bool TextureArrays::update( const TextureLayer &layer, const Surface8u &surface )
+{
+	if ( ! contains( layer ) || surface.getSize() != mArrays[ layer.array ].size ) {
+		return false;
+	}
+	upload( layer, surface );
+	return true;
+}
+
+bool TextureArrays::contains( const TextureLayer &layer ) const
+{
+	return layer.isValid() && layer.array < (int32_t)mArrays.size() && layer.layer < mLayersPerArray;
+}
+
+void TextureArrays::upload( const TextureLayer &layer, const Surface8u &surface )
+{
+	const gl::Texture3dRef &texture = mArrays[ layer.array ].texture;
+
+	// Layers are stored as RGBA, so that images without alpha are opaque
+	// when the G-buffer blends them over the model's color
+	if ( surface.hasAlpha() && surface.getChannelOrder() == SurfaceChannelOrder::RGBA ) {
+		texture->update( surface, layer.layer );
+	} else {
+		Surface8u rgba( surface.getWidth(), surface.getHeight(), true, SurfaceChannelOrder::RGBA );
+		rgba.copyFrom( surface, surface.getBounds() );
+		if ( ! surface.hasAlpha() ) {
+			auto iter = rgba.getIter();
+			while ( iter.line() ) {
+				while ( iter.pixel() ) {
+					iter.a() = 255;
+				}
+			}
+		}
+		texture->update( rgba, layer.layer );
+	}
+
+	const gl::ScopedTextureBind scopedTextureBind( texture );
+	glGenerateMipmap( GL_TEXTURE_2D_ARRAY );
+}
@@ -0,0 +1,300 @@
+#include "TransformGraph.hpp"
+
+#include "cinder/CinderAssert.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace ci;
+using namespace std;
+
+const TransformGraph::node_t TransformGraph::kNoNode;
+
+template< typename T >
+static void permute( vector< T > &v, const vector< uint32_t > &order )
+{
+	vector< T > result;
+	result.reserve( order.size() );
+	for ( uint32_t i : order ) {
+		result.push_back( v[ i ] );
+	}
+	v.swap( result );
+}
+
+TransformGraph::node_t TransformGraph::add( node_t parent, const vec3 &translation, const quat &rotation, const vec3 &scale )
+{
+	CI_ASSERT_MSG( parent == kNoNode || contains( parent ), "Invalid parent node" );
+
+	node_t id;
+	if ( ! mFreeIds.empty() ) {
+		id = mFreeIds.back();
+		mFreeIds.pop_back();
+	} else {
+		id = (node_t)mIdToIndex.size();
+		mIdToIndex.push_back( 0 );
+	}
+
+	// Appending keeps parents ahead of their children
+	const size_t i = size();
+	mIdToIndex[ id ] = (uint32_t)i;
+	mParents.push_back( parent == kNoNode ? kNoNode : mIdToIndex[ parent ] );
+	mTranslations.push_back( translation );
+	mRotations.push_back( rotation );
+	mScales.push_back( scale );
+	mWorldMatrices.push_back( mat4( 1.0f ) );
+	mTargets.push_back( Target() );
+	mDirty.push_back( 0 );
+	mIndexToId.push_back( id );
+	markDirty( i );
+
+	return id;
+}
+
+bool TransformGraph::remove( node_t node )
+{
+	if ( ! contains( node ) ) {
+		return false;
+	}
+
+	// Descendants come after their ancestors, so one forward pass finds the
+	// whole subtree
+	const size_t first = index( node );
+	vector< uint8_t > removed( size(), 0 );
+	removed[ first ] = 1;
+	for ( size_t i = first + 1; i < size(); ++i ) {
+		removed[ i ] = mParents[ i ] != kNoNode && removed[ mParents[ i ] ];
+	}
+
+	vector< uint32_t > order;
+	order.reserve( size() );
+	for ( size_t i = 0; i < size(); ++i ) {
+		if ( removed[ i ] ) {
+			mIdToIndex[ mIndexToId[ i ] ] = kNoNode;
+			mFreeIds.push_back( mIndexToId[ i ] );
+		} else {
+			order.push_back( (uint32_t)i );
+		}
+	}
+	reorder( order );
+
+	return true;
+}
+
+void TransformGraph::clear()
+{
+	reorder( vector< uint32_t >() );
+	mIdToIndex.clear();
+	mFreeIds.clear();
+	mModels.clear();
+}
+
+bool TransformGraph::setParent( node_t node, node_t parent )
+{
+	if ( ! contains( node ) || ( parent != kNoNode && ! contains( parent ) ) || parent == node ) {
+		return false;
+	}
+
+	const size_t i = index( node );
+	const size_t p = parent == kNoNode ? kNoNode : index( parent );
+	if ( p == kNoNode || p < i ) {
+		mParents[ i ] = (uint32_t)p;
+		markDirty( i );
+		return true;
+	}
+
+	// The new parent comes after node. Move node's subtree behind everything
+	// else, preserving relative order, so that every parent still precedes
+	// its children.
+	vector< uint8_t > inSubtree( size(), 0 );
+	inSubtree[ i ] = 1;
+	for ( size_t j = i + 1; j < size(); ++j ) {
+		inSubtree[ j ] = mParents[ j ] != kNoNode && inSubtree[ mParents[ j ] ];
+	}
+	if ( inSubtree[ p ] ) {
+		return false;
+	}
+
+	vector< uint32_t > order;
+	order.reserve( size() );
+	for ( size_t j = 0; j < size(); ++j ) {
+		if ( ! inSubtree[ j ] ) order.push_back( (uint32_t)j );
+	}
+	for ( size_t j = i; j < size(); ++j ) {
+		if ( inSubtree[ j ] ) order.push_back( (uint32_t)j );
+	}
+	reorder( order );
+
+	const size_t moved = index( node );
+	mParents[ moved ] = mIdToIndex[ parent ];
+	markDirty( moved );
+	return true;
+}
+
+TransformGraph::node_t TransformGraph::getParent( node_t node ) const
+{
+	const uint32_t p = mParents[ index( node ) ];
+	return p == kNoNode ? kNoNode : mIndexToId[ p ];
+}
+
+void TransformGraph::setTranslation( node_t node, const vec3 &translation )
+{
+	const size_t i = index( node );
+	mTranslations[ i ] = translation;
+	markDirty( i );
+}
+
+void TransformGraph::setRotation( node_t node, const quat &rotation )
+{
+	const size_t i = index( node );
+	mRotations[ i ] = rotation;
+	markDirty( i );
+}
+
+void TransformGraph::setScale( node_t node, const vec3 &scale )
+{
+	const size_t i = index( node );
+	mScales[ i ] = scale;
+	markDirty( i );
+}
+
+void TransformGraph::setLocalTransform( node_t node, const vec3 &translation, const quat &rotation, const vec3 &scale )
+{
+	const size_t i = index( node );
+	mTranslations[ i ]	= translation;
+	mRotations[ i ]		= rotation;
+	mScales[ i ]		= scale;
+	markDirty( i );
+}
+
+void TransformGraph::attach( node_t node, const SceneObject< InstancedModel > &model, size_t i )
+{
+	auto iter = find( mModels.begin(), mModels.end(), model );
+	if ( iter == mModels.end() ) {
+		iter = mModels.insert( mModels.end(), model );
+	}
+
+	const size_t n = index( node );
+	mTargets[ n ].model		= (uint32_t)( iter - mModels.begin() );
+	mTargets[ n ].instance	= (uint32_t)i;
+	markDirty( n );
+}
+
+void TransformGraph::detach( node_t node )
+{
+	mTargets[ index( node ) ] = Target();
+}
+
+size_t TransformGraph::update()
+{
+	return sweep( nullptr, false );
+}
+
+size_t TransformGraph::update( const mat4 &viewMatrix )
+{
+	// Every attached instance's model-view matrix changes with the view
+	const bool viewChanged = ! mHasViewMatrix || viewMatrix != mViewMatrix;
+	mViewMatrix		= viewMatrix;
+	mHasViewMatrix	= true;
+	return sweep( &mViewMatrix, viewChanged );
+}
+
+size_t TransformGraph::sweep( const mat4* viewMatrix, bool allTargets )
+{
+	const size_t first = allTargets ? 0 : mFirstDirty;
+	if ( first >= size() ) {
+		mFirstDirty = SIZE_MAX;
+		return 0;
+	}
+
+	// Resolve each model once rather than per instance. Models which have
+	// been removed from the scene are skipped. Instances are flagged below,
+	// so the models themselves aren't.
+	mModelPtrs.resize( mModels.size() );
+	for ( size_t k = 0; k < mModels.size(); ++k ) {
+		mModelPtrs[ k ] = mModels[ k ] ? &mModels[ k ].getUntracked() : nullptr;
+	}
+
+	size_t count = 0;
+	for ( size_t i = first; i < size(); ++i ) {
+
+		// The parent's flag is final by now, as it precedes i
+		const uint32_t p = mParents[ i ];
+		if ( p != kNoNode && mDirty[ p ] ) {
+			mDirty[ i ] = 1;
+		}
+		if ( mDirty[ i ] ) {
+			const mat4 local	= glm::translate( mTranslations[ i ] ) * glm::mat4_cast( mRotations[ i ] ) * glm::scale( mScales[ i ] );
+			mWorldMatrices[ i ]	= p != kNoNode ? mWorldMatrices[ p ] * local : local;
+			++count;
+		} else if ( ! allTargets ) {
+			continue;
+		}
+
+		const Target &target = mTargets[ i ];
+		if ( target.model != kNoNode ) {
+			InstancedModel* model = mModelPtrs[ target.model ];
+			if ( model != nullptr && target.instance < model->size() ) {
+				Model &instance = model->data()[ target.instance ];
+				if ( viewMatrix != nullptr ) {
+					instance.setMatrices( mWorldMatrices[ i ], *viewMatrix );
+				} else {
+					instance.setModelMatrix( mWorldMatrices[ i ] );
+				}
+				model->markDirty( target.instance );
+			}
+		}
+	}
+
+	if ( mFirstDirty < size() ) {
+		fill( mDirty.begin() + mFirstDirty, mDirty.end(), 0 );
+	}
+	mFirstDirty = SIZE_MAX;
+
+	return count;
+}
+
+size_t TransformGraph::index( node_t node ) const
+{
+	CI_ASSERT_MSG( contains( node ), "Invalid node" );
+	return mIdToIndex[ node ];
+}
+
+void TransformGraph::markDirty( size_t i )
+{
+	mDirty[ i ]	= 1;
+	mFirstDirty	= min( mFirstDirty, i );
+}
+
+void TransformGraph::reorder( const vector< uint32_t > &order )
+{
+	vector< uint32_t > oldToNew( size(), kNoNode );
+	for ( size_t i = 0; i < order.size(); ++i ) {
+		oldToNew[ order[ i ] ] = (uint32_t)i;
+	}
+
+	permute( mParents, order );
+	permute( mTranslations, order );
+	permute( mRotations, order );
+	permute( mScales, order );
+	permute( mWorldMatrices, order );
+	permute( mTargets, order );
+	permute( mDirty, order );
+	permute( mIndexToId, order );
+
+	for ( size_t i = 0; i < order.size(); ++i ) {
+		if ( mParents[ i ] != kNoNode ) {
+			mParents[ i ] = oldToNew[ mParents[ i ] ];
+		}
+		mIdToIndex[ mIndexToId[ i ] ] = (uint32_t)i;
+	}
+
+	// Pending edits moved with their nodes; find the first one again. World
+	// matrices of the other nodes are unaffected by their position.
+	mFirstDirty = SIZE_MAX;
+	for ( size_t i = 0; i < mDirty.size(); ++i ) {
+		if ( mDirty[ i ] ) {
+			mFirstDirty = i;
+			break;
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#include "ViewFrustum.hpp"
+
+using namespace ci;
+using namespace std;
+
+ViewFrustum::ViewFrustum()
+{
+	set( mat4( 1.0f ) );
+}
+
+ViewFrustum::ViewFrustum( const Camera &camera )
+{
+	set( camera );
+}
+
+ViewFrustum::ViewFrustum( const mat4 &viewProjection )
+{
+	set( viewProjection );
+}
+
+void ViewFrustum::set( const Camera &camera )
+{
+	set( camera.getProjectionMatrix() * camera.getViewMatrix() );
+}
+
+void ViewFrustum::set( const mat4 &m )
+{
+	// Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the
+	// World-View-Projection Matrix". glm matrices are column-major, so row i
+	// is ( m[0][i], m[1][i], m[2][i], m[3][i] ).
+	const vec4 row0( m[ 0 ][ 0 ], m[ 1 ][ 0 ], m[ 2 ][ 0 ], m[ 3 ][ 0 ] );
+	const vec4 row1( m[ 0 ][ 1 ], m[ 1 ][ 1 ], m[ 2 ][ 1 ], m[ 3 ][ 1 ] );
+	const vec4 row2( m[ 0 ][ 2 ], m[ 1 ][ 2 ], m[ 2 ][ 2 ], m[ 3 ][ 2 ] );
+	const vec4 row3( m[ 0 ][ 3 ], m[ 1 ][ 3 ], m[ 2 ][ 3 ], m[ 3 ][ 3 ] );
+
+	mPlanes[ 0 ] = row3 + row0;
+	mPlanes[ 1 ] = row3 - row0;
+	mPlanes[ 2 ] = row3 + row1;
+	mPlanes[ 3 ] = row3 - row1;
+	mPlanes[ 4 ] = row3 + row2;
+	mPlanes[ 5 ] = row3 - row2;
+
+	for ( vec4 &p : mPlanes ) {
+		p /= glm::length( vec3( p ) );
+	}
+}
+
+bool ViewFrustum::intersects( const vec3 &center, float radius ) const
+{
+	for ( const vec4 &p : mPlanes ) {
+		if ( glm::dot( vec3( p ), center ) + p.w < -radius ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ViewFrustum::intersects( const Sphere &sphere ) const
+{
+	return intersects( sphere.getCenter(), sphere.getRadius() );
+}
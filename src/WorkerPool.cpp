@@ -0,0 +1,123 @@
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+// Set on workers, and on a thread while it calls parallelFor()
+static thread_local bool sInParallelFor = false;
+
+WorkerPool::WorkerPool( size_t numThreads ) :
+	mNext( 0 )
+{
+	for ( size_t i = 0; i < numThreads; ++i ) {
+		mThreads.emplace_back( &WorkerPool::run, this );
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard< mutex > lock( mMutex );
+		mQuit = true;
+	}
+	mWake.notify_all();
+	for ( thread &t : mThreads ) {
+		t.join();
+	}
+}
+
+WorkerPool& WorkerPool::get()
+{
+	static WorkerPool sPool;
+	return sPool;
+}
+
+size_t WorkerPool::defaultNumThreads()
+{
+	const size_t cores = thread::hardware_concurrency();
+	return cores > 1 ? cores - 1 : 0;
+}
+
+void WorkerPool::parallelFor( size_t count, size_t grain, const range_fn &fn )
+{
+	grain = max( grain, (size_t)1 );
+	if ( count == 0 ) {
+		return;
+	}
+	if ( mThreads.empty() || count <= grain || sInParallelFor ) {
+		fn( 0, count );
+		return;
+	}
+
+	// One loop at a time; workers share a single set of loop state
+	lock_guard< mutex > callLock( mCallMutex );
+	struct ScopedInParallelFor
+	{
+		ScopedInParallelFor() { sInParallelFor = true; }
+		~ScopedInParallelFor() { sInParallelFor = false; }
+	} scopedInParallelFor;
+	{
+		lock_guard< mutex > lock( mMutex );
+		mFn		= &fn;
+		mCount	= count;
+		mGrain	= grain;
+		mNext	= 0;
+		mBusy	= mThreads.size();
+		++mGeneration;
+	}
+	mWake.notify_all();
+
+	runChunks();
+
+	unique_lock< mutex > lock( mMutex );
+	mDone.wait( lock, [ this ] { return mBusy == 0; } );
+	mFn = nullptr;
+	if ( mError ) {
+		exception_ptr error = mError;
+		mError = nullptr;
+		rethrow_exception( error );
+	}
+}
+
+void WorkerPool::run()
+{
+	sInParallelFor = true;
+	uint64_t generation = 0;
+	unique_lock< mutex > lock( mMutex );
+	while ( true ) {
+		mWake.wait( lock, [ & ] { return mQuit || mGeneration != generation; } );
+		if ( mQuit ) {
+			return;
+		}
+		generation = mGeneration;
+
+		lock.unlock();
+		runChunks();
+		lock.lock();
+
+		if ( --mBusy == 0 ) {
+			mDone.notify_one();
+		}
+	}
+}
+
+void WorkerPool::runChunks()
+{
+	while ( true ) {
+		const size_t begin = mNext.fetch_add( mGrain );
+		if ( begin >= mCount ) {
+			break;
+		}
+		try {
+			( *mFn )( begin, min( begin + mGrain, mCount ) );
+		} catch ( ... ) {
+			lock_guard< mutex > lock( mMutex );
+			if ( ! mError ) {
+				mError = current_exception();
+			}
+			mNext = mCount;
+			break;
+		}
+	}
+}
@@ -0,0 +1,209 @@
+#include "cinder/Matrix.h"
+#include "cinder/Vector.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Light.hpp"
+#include "LightClusters.hpp"
+
+/*
+ * Checks LightClusters against brute force. Every cluster which a point
+ * inside a light's volume falls in must list the light, found by projecting
+ * the point and searching the slice boundaries. Every cluster which lists
+ * a light must have a bounding box the light's volume touches, built from
+ * the cluster's corners unprojected through the inverse projection. The
+ * assignment is conservative, so lights may be listed by clusters they only
+ * come near, but never missing from one they reach.
+ */
+
+using namespace ci;
+using namespace std;
+
+namespace {
+
+struct Frustum
+{
+	string	name;
+	ivec3	grid;
+	mat4	view;
+	mat4	projection;
+	float	nearClip;
+	float	farClip;
+};
+
+float sliceDepth( const Frustum &f, int32_t slice )
+{
+	return f.nearClip * pow( f.farClip / f.nearClip, (float)slice / (float)f.grid.z );
+}
+
+// Cell containing a view-space point, or ( -1 ) outside of the frustum
+ivec3 findCell( const Frustum &f, const vec3 &p )
+{
+	const float depth = -p.z;
+	if ( depth < f.nearClip || depth > f.farClip ) {
+		return ivec3( -1 );
+	}
+	const vec4 clip	= f.projection * vec4( p, 1.0f );
+	const vec2 ndc	= vec2( clip ) / clip.w;
+	if ( ndc.x < -1.0f || ndc.x > 1.0f || ndc.y < -1.0f || ndc.y > 1.0f ) {
+		return ivec3( -1 );
+	}
+
+	ivec3 cell(
+		glm::min( (int32_t)( ( ndc.x * 0.5f + 0.5f ) * (float)f.grid.x ), f.grid.x - 1 ),
+		glm::min( (int32_t)( ( ndc.y * 0.5f + 0.5f ) * (float)f.grid.y ), f.grid.y - 1 ),
+		0 );
+	while ( cell.z < f.grid.z - 1 && depth >= sliceDepth( f, cell.z + 1 ) ) {
+		++cell.z;
+	}
+	return cell;
+}
+
+// View-space point on the ray through ndc, at the given depth
+vec3 unproject( const mat4 &inverseProjection, const vec2 &ndc, float depth )
+{
+	const vec4 p	= inverseProjection * vec4( ndc, -1.0f, 1.0f );
+	const vec3 v	= vec3( p ) / p.w;
+	return v * ( depth / -v.z );
+}
+
+bool touchesCell( const Frustum &f, const mat4 &inverseProjection, const ivec3 &cell, const vec3 &center, float radius )
+{
+	vec3 boxMin( numeric_limits< float >::max() );
+	vec3 boxMax( -numeric_limits< float >::max() );
+	for ( int32_t i = 0; i < 8; ++i ) {
+		const vec2 ndc(
+			(float)( cell.x + ( i & 1 ) ) / (float)f.grid.x * 2.0f - 1.0f,
+			(float)( cell.y + ( ( i >> 1 ) & 1 ) ) / (float)f.grid.y * 2.0f - 1.0f );
+		const vec3 corner = unproject( inverseProjection, ndc, sliceDepth( f, cell.z + ( i >> 2 ) ) );
+		boxMin = glm::min( boxMin, corner );
+		boxMax = glm::max( boxMax, corner );
+	}
+	const vec3 delta = center - glm::clamp( center, boxMin, boxMax );
+	return glm::dot( delta, delta ) <= radius * radius * 1.001f + 1.0e-4f;
+}
+
+// Returns the number of failed checks
+size_t test( const Frustum &f, size_t numLights, uint32_t seed )
+{
+	// Volumes reach behind the camera, across the near plane, off screen and
+	// past the far plane. Only even lights are assigned.
+	mt19937 rng( seed );
+	uniform_real_distribution< float > unit( 0.0f, 1.0f );
+	auto range = [ & ]( float lo, float hi ) { return lo + ( hi - lo ) * unit( rng ); };
+
+	const mat4 inverseView = glm::inverse( f.view );
+	vector< Light > lights( numLights );
+	vector< vec3 > centers( numLights );
+	vector< int32_t > indices;
+	for ( size_t i = 0; i < numLights; ++i ) {
+		const float depth	= range( -5.0f, f.farClip * 1.1f );
+		centers[ i ]		= vec3( range( -0.7f, 0.7f ) * depth, range( -0.4f, 0.4f ) * depth, -depth );
+		lights[ i ].setPosition( vec3( inverseView * vec4( centers[ i ], 1.0f ) ) );
+		lights[ i ].setVolume( range( 0.05f, 15.0f ) );
+		if ( i % 2 == 0 ) {
+			indices.push_back( (int32_t)i );
+		}
+	}
+
+	LightClusters clusters( f.grid );
+	clusters.update( f.view, f.projection, f.nearClip, f.farClip, lights.data(), indices.data(), indices.size() );
+
+	size_t failures = 0;
+	auto fail = [ & ]( const string &message )
+	{
+		if ( failures++ < 10 ) {
+			cerr << f.name << ": " << message << endl;
+		}
+	};
+
+	vector< set< int32_t > > listed( clusters.getNumClusters() );
+	size_t total = 0;
+	for ( size_t i = 0; i < clusters.getNumClusters(); ++i ) {
+		const ivec2 cluster = clusters.getClusters()[ i ];
+		if ( cluster.x != (int32_t)total ) {
+			fail( "cluster " + to_string( i ) + " does not start where the previous one ends" );
+		}
+		total += cluster.y;
+		for ( int32_t j = cluster.x; j < cluster.x + cluster.y && j < (int32_t)clusters.getLightIndices().size(); ++j ) {
+			if ( ! listed[ i ].insert( clusters.getLightIndices()[ j ] ).second ) {
+				fail( "cluster " + to_string( i ) + " lists a light twice" );
+			}
+		}
+	}
+	if ( total != clusters.getLightIndices().size() ) {
+		fail( "cluster ranges do not cover the light indices" );
+	}
+
+	const mat4 inverseProjection = glm::inverse( f.projection );
+	for ( size_t i = 0; i < clusters.getNumClusters(); ++i ) {
+		const ivec3 cell( (int32_t)( i % f.grid.x ), (int32_t)( i / f.grid.x % f.grid.y ), (int32_t)( i / f.grid.x / f.grid.y ) );
+		for ( int32_t light : listed[ i ] ) {
+			if ( light % 2 != 0 ) {
+				fail( "unassigned light " + to_string( light ) + " is listed" );
+			} else if ( ! touchesCell( f, inverseProjection, cell, centers[ light ], lights[ light ].getVolume() ) ) {
+				fail( "light " + to_string( light ) + " is listed by cluster " + to_string( i ) + " but does not reach it" );
+			}
+		}
+	}
+
+	// Points stay just inside the volume, so boundaries rounded differently
+	// by the two sides can't change the outcome
+	for ( int32_t light : indices ) {
+		const float radius = lights[ light ].getVolume() * 0.99f;
+		for ( int32_t sample = 0; sample < 256; ++sample ) {
+			vec3 offset;
+			do {
+				offset = vec3( range( -1.0f, 1.0f ), range( -1.0f, 1.0f ), range( -1.0f, 1.0f ) );
+			} while ( glm::dot( offset, offset ) > 1.0f );
+			const ivec3 cell = findCell( f, centers[ light ] + offset * radius );
+			if ( cell.x >= 0 && listed[ clusters.getClusterIndex( cell ) ].count( light ) == 0 ) {
+				fail( "light " + to_string( light ) + " reaches cluster " + to_string( clusters.getClusterIndex( cell ) ) + " but is not listed" );
+			}
+		}
+	}
+	return failures;
+}
+
+} // namespace
+
+int main()
+{
+	const mat4 view = glm::lookAt( vec3( 3.0f, 4.0f, 10.0f ), vec3( 0.0f ), vec3( 0.0f, 1.0f, 0.0f ) );
+
+	Frustum symmetric;
+	symmetric.name			= "symmetric";
+	symmetric.grid			= ivec3( 16, 9, 24 );
+	symmetric.view			= view;
+	symmetric.projection	= glm::perspective( glm::radians( 60.0f ), 16.0f / 9.0f, 0.1f, 100.0f );
+	symmetric.nearClip		= 0.1f;
+	symmetric.farClip		= 100.0f;
+
+	// Lens shifted, with a grid which doesn't divide evenly
+	Frustum offCenter;
+	offCenter.name			= "off-center";
+	offCenter.grid			= ivec3( 7, 5, 11 );
+	offCenter.view			= view;
+	offCenter.projection	= glm::frustum( -0.08f, 0.12f, -0.05f, 0.07f, 0.1f, 50.0f );
+	offCenter.nearClip		= 0.1f;
+	offCenter.farClip		= 50.0f;
+
+	size_t failures = 0;
+	failures += test( symmetric, 1000, 1 );
+	failures += test( offCenter, 1000, 2 );
+	if ( failures > 0 ) {
+		cerr << failures << " checks failed" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "LightClusters matches brute force" << endl;
+	return EXIT_SUCCESS;
+}